@@ -0,0 +1,353 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/core/ocl.hpp"
+
+#include "config.hpp"
+#include "pipeline.hpp"
+#include "histogram.hpp"
+#include "mat_pool.hpp"
+#include "synthetic.hpp"
+
+
+#define MIN_ITERATIONS          3   // Iterations of each benchmark, at least
+#define MIN_TIME                1.0 // Seconds spent in each benchmark, at least
+
+
+/* One timed function; layers is the number of z-layers one call covers */
+struct Benchmark {
+    std::string name;
+    unsigned int layers;
+    std::function<void()> fn;
+};
+
+/* Time a benchmark and write its CSV row
+ *
+ * The function is called until min_time has passed, and at least
+ * MIN_ITERATIONS times; the median call time is reported so that a single
+ * slow call (page faults, a busy core) does not move the result.
+ */
+static void runBenchmark(const Benchmark &bench, double min_time, std::ostream *out) {
+
+    std::vector<double> call_ms;
+    double total_ms = 0;
+    while ((call_ms.size() < MIN_ITERATIONS) || (total_ms < min_time * 1000)) {
+        auto start = std::chrono::steady_clock::now();
+        bench.fn();
+        std::chrono::duration<double, std::milli> elapsed =
+                                        std::chrono::steady_clock::now() - start;
+        call_ms.push_back(elapsed.count());
+        total_ms += elapsed.count();
+    }
+    std::sort(call_ms.begin(), call_ms.end());
+    double median_ms = call_ms[call_ms.size()/2];
+    *out << bench.name << "," << call_ms.size() << "," << median_ms << ","
+         << median_ms / bench.layers << "," << 1000.0 / median_ms << std::endl;
+}
+
+/* Write count synthetic stacks and their image_list.dat under path */
+static bool generateDataset(SyntheticParams stack_params, std::string path,
+                                unsigned int count) {
+
+    struct stat st = {0};
+    if (stat(path.c_str(), &st) == -1) mkdir(path.c_str(), 0700);
+    std::ofstream list_stream(path + "image_list.dat");
+    if (!list_stream.is_open()) {
+        std::cerr << "Could not create '" << path << "image_list.dat'" << std::endl;
+        return false;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        std::string image_name = "synthetic_" + std::to_string(i);
+        std::vector<StackLayer> layers;
+        generateStack(stack_params, &layers);
+        if (!writeStack(layers, path, image_name)) return false;
+        list_stream << image_name << std::endl;
+        stack_params.seed++;
+    }
+    return true;
+}
+
+/* Check the specialized enhancement kernels against the OpenCV chain
+ *
+ * Each channel type runs on its synthetic plane and on uniform noise, whose
+ * blurred values hit every rounding tie and both thresholds, in 8 and 16 bits.
+ */
+static bool checkKernels(const StackLayer &layer, const PipelineParams &params) {
+
+    cv::Mat noise(layer.red.size(), CV_8UC1);
+    cv::randu(noise, 0, 256);
+    const struct {
+        const char *name;
+        ChannelType type;
+        const cv::Mat *src;
+    } channels[] = {
+        {"blue",        ChannelType::BLUE,      &layer.blue},
+        {"green",       ChannelType::GREEN,     &layer.green},
+        {"red",         ChannelType::RED,       &layer.red},
+        {"red_low",     ChannelType::RED_LOW,   &layer.red},
+        {"red_high",    ChannelType::RED_HIGH,  &layer.red},
+    };
+    bool identical = true;
+    for (auto &channel : channels) {
+        const cv::Mat *planes[] = {channel.src, &noise};
+        for (auto plane : planes) {
+            for (int depth : {CV_8U, CV_16U}) {
+                cv::Mat src, specialized, reference, different;
+                plane->convertTo(src, depth, (depth == CV_16U) ? 257 : 1);
+                if (!enhanceImage(src, channel.type, params, &specialized, true) ||
+                        !enhanceImage(src, channel.type, params, &reference, false)) {
+                    return false;
+                }
+                cv::compare(specialized, reference, different, cv::CMP_NE);
+                int pixels = cv::countNonZero(different);
+                if (!pixels) continue;
+                std::cerr << "Kernel " << channel.name << ((depth == CV_16U) ? "/16u" : "/8u")
+                          << " differs from the OpenCV chain in " << pixels << " pixels of the "
+                          << ((plane == &noise) ? "noise" : "synthetic") << " plane" << std::endl;
+                identical = false;
+            }
+        }
+    }
+    return identical;
+}
+
+/* Bench - microbenchmarks and an end-to-end run over a synthetic stack */
+int main(int argc, char *argv[]) {
+
+    /* Parse the arguments */
+    SyntheticParams stack_params;
+    PipelineParams params;
+    double min_time = MIN_TIME;
+    std::string filter, generate_path;
+    unsigned int generate_count = 0;
+    for (int arg_index = 1; arg_index < argc; arg_index++) {
+        std::string arg(argv[arg_index]);
+        std::string value = (arg_index+1 < argc) ? argv[arg_index+1] : "";
+        size_t separator = value.find('=');
+        if (arg == "--stack" && (separator != std::string::npos)) {
+            if (!setSyntheticParam(value.substr(0, separator),
+                                    value.substr(separator+1), &stack_params)) {
+                return -1;
+            }
+            arg_index++;
+        } else if (arg == "--set" && (separator != std::string::npos)) {
+            if (!setParam(value.substr(0, separator), value.substr(separator+1), &params)) {
+                return -1;
+            }
+            arg_index++;
+        } else if (arg == "--min-time" && arg_index+1 < argc) {
+            min_time = atof(argv[++arg_index]);
+        } else if (arg == "--filter" && arg_index+1 < argc) {
+            filter = argv[++arg_index];
+        } else if (arg == "--generate" && arg_index+2 < argc) {
+            generate_path = argv[++arg_index];
+            generate_count = static_cast<unsigned int>(atoi(argv[++arg_index]));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--stack key=value] [--set key=value] "
+                      << "[--min-time SEC] [--filter NAME] [--generate DIR COUNT]"
+                      << std::endl;
+            return -1;
+        }
+    }
+    if (!validateParams(params)) return -1;
+
+    /* Write a dataset for the analyze binary instead of benchmarking */
+    if (!generate_path.empty()) {
+        if (generate_path[generate_path.size()-1] != '/') generate_path += "/";
+        return generateDataset(stack_params, generate_path, generate_count) ? 0 : -1;
+    }
+
+    /* Generate the stack and the inputs of the per-stage benchmarks */
+    std::vector<StackLayer> layers;
+    generateStack(stack_params, &layers);
+    std::cerr << "Synthetic stack " << stack_params.width << "x" << stack_params.height
+              << "x" << stack_params.layers << ", seed " << stack_params.seed << std::endl;
+    cv::setNumThreads(1);
+
+    const StackLayer &layer = layers[0];
+    if (!checkKernels(layer, params)) return -1;
+    EnhancedLayer enhanced;
+    enhanceLayer(layer.blue, layer.green, layer.red, params, &enhanced);
+
+    std::vector<std::vector<cv::Point>> contours_blue;
+    std::vector<cv::Vec4i> hierarchy_blue;
+    RegionTable blue_regions, red_regions;
+    contourCalc(enhanced.blue, ChannelType::BLUE, params.min_area, NULL,
+                    &contours_blue, &hierarchy_blue, &blue_regions);
+    segmentCalc(SegmentEngine::CONTOURS, enhanced.red, ChannelType::RED, params.min_area,
+                    NULL, &red_regions);
+
+    cv::Mat blue_red_intersection, blue_green_intersection;
+    bitwise_and(enhanced.blue, enhanced.red, blue_red_intersection);
+    bitwise_and(enhanced.blue, enhanced.green, blue_green_intersection);
+    RegionTable classified_regions = blue_regions;
+    classifyMicroglialCells(contours_blue, blue_red_intersection,
+                                params.microglial_coverage, &classified_regions);
+
+    // Steady state of a worker: buffers come from a warm pool
+    MatPool pool;
+    PoolScope pool_scope(&pool);
+
+    OutputOptions output;
+    output.level = OutputLevel::METRICS;
+    ImageWriter writer;
+
+    unsigned int num_tasks = std::max(1u, std::thread::hardware_concurrency());
+
+    /* The benchmarks, in pipeline order */
+    std::vector<Benchmark> benchmarks;
+    const struct {
+        const char *name;
+        ChannelType type;
+        const cv::Mat *src;
+    } channels[] = {
+        {"blue",        ChannelType::BLUE,      &layer.blue},
+        {"green",       ChannelType::GREEN,     &layer.green},
+        {"red",         ChannelType::RED,       &layer.red},
+        {"red_low",     ChannelType::RED_LOW,   &layer.red},
+        {"red_high",    ChannelType::RED_HIGH,  &layer.red},
+    };
+    for (auto &channel : channels) {
+        ChannelType type = channel.type;
+        const cv::Mat *src = channel.src;
+        benchmarks.push_back({std::string("enhanceImage/") + channel.name, 1, [&, type, src]() {
+            cv::Mat dst;
+            enhanceImage(*src, type, params, &dst);
+        }});
+    }
+    cv::Mat red_16u;
+    layer.red.convertTo(red_16u, CV_16U, 257);
+    benchmarks.push_back({"enhanceImage/red_16u", 1, [&]() {
+        cv::Mat dst;
+        enhanceImage(red_16u, ChannelType::RED, params, &dst);
+    }});
+    benchmarks.push_back({"enhanceLayer", 1, [&]() {
+        EnhancedLayer dst;
+        enhanceLayer(layer.blue, layer.green, layer.red, params, &dst);
+    }});
+    benchmarks.push_back({"contourCalc/blue", 1, [&]() {
+        std::vector<std::vector<cv::Point>> contours;
+        std::vector<cv::Vec4i> hierarchy;
+        RegionTable regions;
+        contourCalc(enhanced.blue, ChannelType::BLUE, params.min_area, NULL,
+                        &contours, &hierarchy, &regions);
+    }});
+    benchmarks.push_back({"contourCalc/red", 1, [&]() {
+        std::vector<std::vector<cv::Point>> contours;
+        std::vector<cv::Vec4i> hierarchy;
+        RegionTable regions;
+        contourCalc(enhanced.red, ChannelType::RED, params.min_area, NULL,
+                        &contours, &hierarchy, &regions);
+    }});
+    benchmarks.push_back({"componentCalc/red", 1, [&]() {
+        RegionTable regions;
+        segmentCalc(SegmentEngine::COMPONENTS, enhanced.red, ChannelType::RED,
+                        params.min_area, NULL, &regions);
+    }});
+    benchmarks.push_back({"classifyMicroglialCells", 1, [&]() {
+        RegionTable regions = blue_regions;
+        classifyMicroglialCells(contours_blue, blue_red_intersection,
+                                    params.microglial_coverage, &regions);
+    }});
+    benchmarks.push_back({"classifyNeuralCells", 1, [&]() {
+        RegionTable regions = classified_regions;
+        classifyNeuralCells(contours_blue, blue_green_intersection,
+                                params.neural_coverage, &regions);
+    }});
+    BitMask packed_blue_red;
+    packed_blue_red.pack(blue_red_intersection);
+    benchmarks.push_back({"classifyMicroglialCells/packed", 1, [&]() {
+        RegionTable regions = blue_regions;
+        classifyMicroglialCells(contours_blue, packed_blue_red,
+                                    params.microglial_coverage, &regions);
+    }});
+    benchmarks.push_back({"BitMask::pack/red", 1, [&]() {
+        BitMask packed;
+        packed.pack(enhanced.red);
+    }});
+    benchmarks.push_back({"binArea", 1, [&]() {
+        AreaBins bins;
+        binArea(red_regions, params, &bins);
+    }});
+    benchmarks.push_back({"histogram/4_columns", 1, [&]() {
+        AreaBins bins[4];
+        histogram(BinSpec(params), {areaColumn(red_regions, &bins[0]), 
+                                    areaColumn(red_regions, &bins[1]), 
+                                    areaColumn(red_regions, &bins[2]), 
+                                    areaColumn(red_regions, &bins[3])});
+    }});
+
+    // Territories of a dense mosaic slice: 10k nuclei, 50k fibres
+    RegionTable dense_nuclei, dense_fibres;
+    cv::RNG rng(12345);
+    dense_nuclei.resize(10000);
+    for (size_t i = 0; i < dense_nuclei.size(); i++) {
+        dense_nuclei.area[i] = rng.uniform(50, 250);
+        dense_nuclei.centroid[i] = cv::Point2f(rng.uniform(0, 10000), rng.uniform(0, 10000));
+        dense_nuclei.label[i] = (i % 3) ? RegionClass::OTHER : RegionClass::MICROGLIAL;
+    }
+    dense_fibres.resize(50000);
+    for (size_t i = 0; i < dense_fibres.size(); i++) {
+        dense_fibres.bbox[i] = cv::Rect(rng.uniform(0, 10000), rng.uniform(0, 10000), 
+                                        rng.uniform(1, 40), rng.uniform(1, 40));
+        dense_fibres.area[i] = rng.uniform(1, 600);
+        dense_fibres.valid[i] = 1;
+    }
+    benchmarks.push_back({"microgliaTerritories/dense", 1, [&]() {
+        std::vector<Territory> territories;
+        microgliaTerritories(dense_nuclei, dense_fibres, params, &territories);
+    }});
+    const struct {
+        const char *name;
+        SegmentEngine engine;
+        Backend backend;
+        unsigned int tile_size, tasks;
+        bool packed_masks;
+    } runs[] = {
+        {"contours",        SegmentEngine::CONTOURS,    Backend::CPU,    0,                  1,          false},
+        {"components",      SegmentEngine::COMPONENTS,  Backend::CPU,    0,                  1,          false},
+        {"contours_tiled",  SegmentEngine::CONTOURS,    Backend::CPU,    DEFAULT_TILE_SIZE,  1,          false},
+        {"contours_tasks",  SegmentEngine::CONTOURS,    Backend::CPU,    DEFAULT_TILE_SIZE,  num_tasks,  false},
+        {"contours_opencl", SegmentEngine::CONTOURS,    Backend::OPENCL, 0,                  1,          false},
+        {"contours_packed", SegmentEngine::CONTOURS,    Backend::CPU,    0,                  1,          true},
+    };
+    for (auto &run : runs) {
+        if ((run.backend == Backend::OPENCL) && !cv::ocl::haveOpenCL()) continue;
+        ExecutionOptions exec;
+        exec.segment_engine = run.engine;
+        exec.backend = run.backend;
+        exec.tile_size = run.tile_size;
+        exec.tasks = run.tasks;
+        exec.packed_masks = run.packed_masks;
+        benchmarks.push_back({std::string("processImage/") + run.name, stack_params.layers,
+                                [&, exec]() {
+            SyntheticStackReader stack(&layers);
+            std::vector<MetricsRow> metrics;
+            processImage(&stack, "", "synthetic", params, output, exec, &writer, &metrics);
+        }});
+    }
+
+    benchmarks.push_back({"processVolume", stack_params.layers, [&]() {
+        SyntheticStackReader stack(&layers);
+        std::vector<MetricsRow> metrics;
+        processVolume(&stack, "synthetic", params, output, ExecutionOptions(), &metrics);
+    }});
+
+    /* Run them; per_sec is images/sec for processImage and processVolume, calls/sec otherwise */
+    std::cout << "benchmark,iterations,median_ms,ms_per_layer,per_sec" << std::endl;
+    for (auto &bench : benchmarks) {
+        if (!filter.empty() && (bench.name.find(filter) == std::string::npos)) continue;
+        runBenchmark(bench, min_time, &std::cout);
+    }
+    writer.flush();
+
+    return 0;
+}
@@ -0,0 +1,235 @@
+#include <iostream>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include "synthetic.hpp"
+
+
+/* Integer generator parameters and their minimum */
+static const struct {
+    const char *key;
+    int SyntheticParams::*field;
+    int min;
+} kIntParams[] = {
+    {"width",                   &SyntheticParams::width,    16},
+    {"height",                  &SyntheticParams::height,   16},
+};
+
+/* Unsigned generator parameters and their minimum */
+static const struct {
+    const char *key;
+    unsigned int SyntheticParams::*field;
+    unsigned int min;
+} kUIntParams[] = {
+    {"layers",                  &SyntheticParams::layers,   1},
+    {"seed",                    &SyntheticParams::seed,     0},
+};
+
+/* Real-valued generator parameters */
+static const struct {
+    const char *key;
+    double SyntheticParams::*field;
+} kDoubleParams[] = {
+    {"nucleus_density",         &SyntheticParams::nucleus_density},
+    {"fibre_density",           &SyntheticParams::fibre_density},
+    {"nucleus_radius",          &SyntheticParams::nucleus_radius},
+    {"fibre_length",            &SyntheticParams::fibre_length},
+    {"microglial_fraction",     &SyntheticParams::microglial_fraction},
+    {"neural_fraction",         &SyntheticParams::neural_fraction},
+};
+
+/* Set one generator parameter from its textual key and value */
+bool setSyntheticParam(std::string key, std::string value, SyntheticParams *params) {
+
+    char *end = NULL;
+    for (auto &param : kIntParams) {
+        if (key != param.key) continue;
+        long parsed = strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end || (parsed < param.min)) break;
+        params->*param.field = static_cast<int>(parsed);
+        return true;
+    }
+    for (auto &param : kUIntParams) {
+        if (key != param.key) continue;
+        long parsed = strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end || (parsed < static_cast<long>(param.min))) break;
+        params->*param.field = static_cast<unsigned int>(parsed);
+        return true;
+    }
+    for (auto &param : kDoubleParams) {
+        if (key != param.key) continue;
+        double parsed = strtod(value.c_str(), &end);
+        if (value.empty() || *end || (parsed < 0)) break;
+        params->*param.field = parsed;
+        return true;
+    }
+    std::cerr << "Invalid stack parameter '" << key << "=" << value << "'" << std::endl;
+    return false;
+}
+
+/* Nucleus and its surrounding cell */
+struct Nucleus {
+    enum Kind { MICROGLIAL, NEURAL, OTHER } kind;
+    cv::Point center;
+    cv::Size axes;
+    double angle, z_center, z_radius;
+    int intensity;
+};
+
+/* Red fibre, drawn as a polyline */
+struct Fibre {
+    std::vector<cv::Point> path;
+    double z_center, z_radius;
+    int intensity, thickness;
+};
+
+/* Random walk of the given length starting at start */
+static std::vector<cv::Point> fibrePath(cv::RNG *rng, cv::Point start,
+                                            double length, double angle) {
+    std::vector<cv::Point> path(1, start);
+    const double step = 4.0;
+    double x = start.x, y = start.y;
+    for (double walked = 0; walked < length; walked += step) {
+        angle += rng->uniform(-0.5, 0.5);
+        x += step * cos(angle);
+        y += step * sin(angle);
+        path.push_back(cv::Point(static_cast<int>(x), static_cast<int>(y)));
+    }
+    return path;
+}
+
+/* Scale of an object at z, 0 outside of its z extent */
+static double layerScale(double z, double z_center, double z_radius) {
+    double dz = (z - z_center) / (z_radius + 1.0);
+    return (fabs(dz) < 1.0) ? sqrt(1.0 - dz*dz) : 0.0;
+}
+
+/* Render every z-layer of a synthetic stack */
+void generateStack(const SyntheticParams &params, std::vector<StackLayer> *layers) {
+
+    cv::RNG rng(params.seed);
+    const double megapixels = params.width * static_cast<double>(params.height) / 1e6;
+    const double z_extent = std::max(1.0, params.layers / 4.0);
+
+    // Place the objects once so that they persist across the z-layers
+    std::vector<Nucleus> nuclei(static_cast<size_t>(params.nucleus_density * megapixels));
+    std::vector<Fibre> fibres;
+    for (auto &nucleus : nuclei) {
+        double kind = rng.uniform(0.0, 1.0);
+        nucleus.kind = (kind < params.microglial_fraction) ? Nucleus::MICROGLIAL :
+            (kind < params.microglial_fraction + params.neural_fraction) ?
+                Nucleus::NEURAL : Nucleus::OTHER;
+        nucleus.center = cv::Point(rng.uniform(0, params.width),
+                                    rng.uniform(0, params.height));
+        double radius = params.nucleus_radius * rng.uniform(0.6, 1.4);
+        nucleus.axes = cv::Size(static_cast<int>(radius * rng.uniform(0.8, 1.2)) + 1,
+                                static_cast<int>(radius * rng.uniform(0.8, 1.2)) + 1);
+        nucleus.angle = rng.uniform(0.0, 180.0);
+        nucleus.z_center = rng.uniform(0.0, static_cast<double>(params.layers));
+        nucleus.z_radius = rng.uniform(1.0, z_extent);
+        nucleus.intensity = rng.uniform(150, 255);
+
+        if (nucleus.kind != Nucleus::MICROGLIAL) continue;
+        int branches = rng.uniform(2, 6);
+        for (int i = 0; i < branches; i++) {
+            Fibre fibre;
+            fibre.path = fibrePath(&rng, nucleus.center,
+                            params.fibre_length * rng.uniform(0.5, 1.5),
+                            rng.uniform(0.0, 2*M_PI));
+            fibre.z_center = nucleus.z_center;
+            fibre.z_radius = nucleus.z_radius;
+            fibre.intensity = rng.uniform(180, 255);
+            fibre.thickness = rng.uniform(1, 3);
+            fibres.push_back(fibre);
+        }
+    }
+    size_t num_free_fibres = static_cast<size_t>(params.fibre_density * megapixels);
+    for (size_t i = 0; i < num_free_fibres; i++) {
+        Fibre fibre;
+        fibre.path = fibrePath(&rng,
+                        cv::Point(rng.uniform(0, params.width), rng.uniform(0, params.height)),
+                        params.fibre_length * rng.uniform(0.5, 1.5),
+                        rng.uniform(0.0, 2*M_PI));
+        fibre.z_center = rng.uniform(0.0, static_cast<double>(params.layers));
+        fibre.z_radius = rng.uniform(1.0, z_extent);
+        fibre.intensity = (i % 2) ? rng.uniform(60, 140) : rng.uniform(180, 255);
+        fibre.thickness = rng.uniform(1, 3);
+        fibres.push_back(fibre);
+    }
+
+    // Render each layer over a noisy background
+    layers->assign(params.layers, StackLayer());
+    for (unsigned int z = 0; z < params.layers; z++) {
+        StackLayer &layer = (*layers)[z];
+        cv::Mat *planes[] = {&layer.blue, &layer.green, &layer.red};
+        for (auto plane : planes) {
+            plane->create(params.height, params.width, CV_8UC1);
+            rng.fill(*plane, cv::RNG::NORMAL, cv::Scalar(4), cv::Scalar(3), true);
+        }
+
+        for (auto &fibre : fibres) {
+            double scale = layerScale(z, fibre.z_center, fibre.z_radius);
+            if (scale <= 0) continue;
+            int intensity = static_cast<int>(fibre.intensity * (0.5 + 0.5*scale));
+            for (size_t i = 1; i < fibre.path.size(); i++) {
+                cv::line(layer.red, fibre.path[i-1], fibre.path[i],
+                            cv::Scalar(intensity), fibre.thickness, cv::LINE_8);
+            }
+        }
+        for (auto &nucleus : nuclei) {
+            double scale = layerScale(z, nucleus.z_center, nucleus.z_radius);
+            if (scale <= 0) continue;
+            cv::Size axes(std::max(1, static_cast<int>(nucleus.axes.width * scale)),
+                            std::max(1, static_cast<int>(nucleus.axes.height * scale)));
+            if (nucleus.kind == Nucleus::MICROGLIAL) {
+                cv::ellipse(layer.red, nucleus.center,
+                            cv::Size(axes.width + 2, axes.height + 2), nucleus.angle,
+                            0, 360, cv::Scalar(nucleus.intensity), cv::FILLED);
+            } else if (nucleus.kind == Nucleus::NEURAL) {
+                cv::ellipse(layer.green, nucleus.center,
+                            cv::Size(2*axes.width, 2*axes.height), nucleus.angle,
+                            0, 360, cv::Scalar(nucleus.intensity), cv::FILLED);
+            }
+            cv::ellipse(layer.blue, nucleus.center, axes, nucleus.angle,
+                        0, 360, cv::Scalar(nucleus.intensity), cv::FILLED);
+        }
+
+        cv::Mat channel[] = {layer.blue, layer.green, layer.red};
+        cv::merge(channel, 3, layer.original);
+    }
+}
+
+/* Create a directory unless it already exists */
+static void createDirectory(std::string dir_name) {
+    struct stat st = {0};
+    if (stat(dir_name.c_str(), &st) == -1) {
+        mkdir(dir_name.c_str(), 0700);
+    }
+}
+
+/* Write a stack as tiff/<image>/<image>_zNNc1+2+3.tif under path */
+bool writeStack(const std::vector<StackLayer> &layers, std::string path,
+                    std::string image_name) {
+
+    std::string dir_name = path + "tiff/";
+    createDirectory(dir_name);
+    dir_name += image_name + "/";
+    createDirectory(dir_name);
+
+    size_t width = std::to_string(layers.size()).size();
+    for (size_t z = 0; z < layers.size(); z++) {
+        std::string layer_number = std::to_string(z+1);
+        layer_number.insert(0, width - layer_number.size(), '0');
+        std::string filename = dir_name + image_name + "_z" + layer_number + "c1+2+3.tif";
+        if (!cv::imwrite(filename, layers[z].original)) {
+            std::cerr << "Could not write '" << filename << "'" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+#ifndef SYNTHETIC_HPP
+#define SYNTHETIC_HPP
+
+#include <string>
+#include <vector>
+
+#include "stack_reader.hpp"
+
+
+/* Shape of a synthetic confocal z-stack
+ *
+ * Densities are objects per megapixel. Nuclei are blue ellipses; microglial
+ * nuclei are wrapped in red with fibres growing out of them, neural nuclei
+ * sit in a green soma. Free red fibres alternate between low and high
+ * intensity so both red masks see work. The same seed gives the same stack.
+ */
+struct SyntheticParams {
+    int width                       = 1024;
+    int height                      = 1024;
+    unsigned int layers             = 8;
+    double nucleus_density          = 150;
+    double fibre_density            = 300;
+    double nucleus_radius           = 6;    // mean radius in pixels
+    double fibre_length             = 40;   // mean length in pixels
+    double microglial_fraction      = 0.3;
+    double neural_fraction          = 0.3;
+    unsigned int seed               = 1;
+};
+
+/* Set one generator parameter from its textual key and value */
+bool setSyntheticParam(std::string key, std::string value, SyntheticParams *params);
+
+/* Render every z-layer of a synthetic stack */
+void generateStack(const SyntheticParams &params, std::vector<StackLayer> *layers);
+
+/* Write a stack as tiff/<image>/<image>_zNNc1+2+3.tif under path */
+bool writeStack(const std::vector<StackLayer> &layers, std::string path,
+                    std::string image_name);
+
+/* Reader over a stack held in memory */
+class SyntheticStackReader : public StackReader {
+public:
+    explicit SyntheticStackReader(const std::vector<StackLayer> *layers)
+        : layers_(layers) {}
+
+    unsigned int layerCount() const { return layers_->size(); }
+    bool readLayer(unsigned int z_index, StackLayer *layer) {
+        if (z_index >= layers_->size()) return false;
+        *layer = (*layers_)[z_index];
+        return true;
+    }
+
+private:
+    const std::vector<StackLayer> *layers_;
+};
+
+#endif // SYNTHETIC_HPP
@@ -0,0 +1,202 @@
+#ifdef HAVE_ARROW
+
+#include <iostream>
+
+#include "arrow_writer.hpp"
+
+
+/* Binned channels of a metrics row, as named in the Arrow columns */
+static const char *kBinnedNames[] = {
+    "microglial_fibres", "fibre_neural_intersections", "red_high_fibres", "red_low_fibres"
+};
+
+/* Schema of the metrics table; the integer columns follow metricsCounts() */
+static std::shared_ptr<arrow::Schema> metricsSchema(const PipelineParams &params) {
+
+    arrow::FieldVector fields = {
+        arrow::field("image_layer", arrow::utf8()),
+        arrow::field("total_nuclei", arrow::uint32()),
+        arrow::field("microglial_nuclei", arrow::uint32()),
+        arrow::field("neural_nuclei", arrow::uint32()),
+        arrow::field("other_nuclei", arrow::uint32()),
+    };
+    for (auto name : kBinnedNames) {
+        fields.push_back(arrow::field(name, arrow::uint32()));
+        for (unsigned int i = 0; i < params.num_area_bins; i++) {
+            fields.push_back(arrow::field(std::string(name) + "_bin_" + std::to_string(i),
+                                            arrow::uint32()));
+        }
+    }
+    auto metadata = arrow::key_value_metadata(
+                        {"num_area_bins", "bin_area", "log_area_bins"},
+                        {std::to_string(params.num_area_bins), std::to_string(params.bin_area),
+                            std::to_string(params.log_area_bins)});
+    return arrow::schema(fields, metadata);
+}
+
+/* Schema of the per-cell table, the columns of cells.csv */
+static std::shared_ptr<arrow::Schema> cellsSchema() {
+
+    return arrow::schema({
+        arrow::field("image_layer", arrow::utf8()),
+        arrow::field("region", arrow::uint32()),
+        arrow::field("class", arrow::utf8()),
+        arrow::field("valid", arrow::uint8()),
+        arrow::field("area", arrow::float64()),
+        arrow::field("hole_area", arrow::float64()),
+        arrow::field("perimeter", arrow::float64()),
+        arrow::field("centroid_x", arrow::float32()),
+        arrow::field("centroid_y", arrow::float32()),
+        arrow::field("bbox_x", arrow::int32()),
+        arrow::field("bbox_y", arrow::int32()),
+        arrow::field("bbox_width", arrow::int32()),
+        arrow::field("bbox_height", arrow::int32()),
+        arrow::field("red_overlap", arrow::float32()),
+        arrow::field("green_overlap", arrow::float32()),
+        arrow::field("z_first", arrow::int32()),
+        arrow::field("z_last", arrow::int32()),
+    });
+}
+
+/* Build one column from its values */
+template<typename Builder, typename T>
+static arrow::Status appendColumn(const std::vector<T> &values, arrow::ArrayVector *columns) {
+    Builder builder;
+    ARROW_RETURN_NOT_OK(builder.AppendValues(values));
+    std::shared_ptr<arrow::Array> column;
+    ARROW_RETURN_NOT_OK(builder.Finish(&column));
+    columns->push_back(column);
+    return arrow::Status::OK();
+}
+
+bool ArrowWriter::open(const std::string &filename, ArrowTable table,
+                        const PipelineParams &params) {
+
+    table_ = table;
+    filename_ = filename;
+    schema_ = (table == ArrowTable::METRICS) ? metricsSchema(params) : cellsSchema();
+    auto sink = arrow::io::FileOutputStream::Open(filename);
+    if (!sink.ok()) {
+        std::cerr << "Could not create '" << filename << "': "
+                  << sink.status().ToString() << std::endl;
+        return false;
+    }
+    sink_ = sink.ValueOrDie();
+    auto writer = arrow::ipc::MakeFileWriter(sink_, schema_);
+    if (!writer.ok()) {
+        std::cerr << "Could not start '" << filename << "': "
+                  << writer.status().ToString() << std::endl;
+        return false;
+    }
+    writer_ = writer.ValueOrDie();
+    return true;
+}
+
+/* Append the rows of one image as a record batch */
+bool ArrowWriter::write(const std::vector<MetricsRow> &rows) {
+
+    arrow::Status status = (table_ == ArrowTable::METRICS) ?
+                                writeMetrics(rows) : writeCells(rows);
+    if (!status.ok()) {
+        std::cerr << "Could not write '" << filename_ << "': "
+                  << status.ToString() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool ArrowWriter::close() {
+
+    if (!writer_) return true;
+    arrow::Status status = writer_->Close();
+    if (status.ok()) status = sink_->Close();
+    writer_.reset();
+    sink_.reset();
+    if (!status.ok()) {
+        std::cerr << "Could not close '" << filename_ << "': "
+                  << status.ToString() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+arrow::Status ArrowWriter::writeMetrics(const std::vector<MetricsRow> &rows) {
+
+    std::vector<std::string> image_layer;
+    std::vector<std::vector<unsigned int>> counts(schema_->num_fields() - 1);
+    for (auto &row : rows) {
+        image_layer.push_back(row.image_layer);
+        std::vector<unsigned int> row_counts = metricsCounts(row);
+        if (row_counts.size() != counts.size()) {
+            return arrow::Status::Invalid("metrics row does not match the schema");
+        }
+        for (size_t column = 0; column < counts.size(); column++) {
+            counts[column].push_back(row_counts[column]);
+        }
+    }
+
+    arrow::ArrayVector columns;
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::StringBuilder>(image_layer, &columns));
+    for (auto &column : counts) {
+        ARROW_RETURN_NOT_OK(appendColumn<arrow::UInt32Builder>(column, &columns));
+    }
+    return writer_->WriteRecordBatch(
+                *arrow::RecordBatch::Make(schema_, rows.size(), columns));
+}
+
+arrow::Status ArrowWriter::writeCells(const std::vector<MetricsRow> &rows) {
+
+    std::vector<std::string> image_layer, region_class;
+    std::vector<unsigned int> region;
+    std::vector<unsigned char> valid;
+    std::vector<double> area, hole_area, perimeter;
+    std::vector<float> centroid_x, centroid_y, red_overlap, green_overlap;
+    std::vector<int> bbox_x, bbox_y, bbox_width, bbox_height, z_first, z_last;
+    for (auto &row : rows) {
+        const RegionTable &nuclei = row.nuclei;
+        for (size_t i = 0; i < nuclei.size(); i++) {
+            image_layer.push_back(row.image_layer);
+            region.push_back(i);
+            region_class.push_back(regionClassName(nuclei.label[i]));
+            centroid_x.push_back(nuclei.centroid[i].x);
+            centroid_y.push_back(nuclei.centroid[i].y);
+            bbox_x.push_back(nuclei.bbox[i].x);
+            bbox_y.push_back(nuclei.bbox[i].y);
+            bbox_width.push_back(nuclei.bbox[i].width);
+            bbox_height.push_back(nuclei.bbox[i].height);
+        }
+        valid.insert(valid.end(), nuclei.valid.begin(), nuclei.valid.end());
+        area.insert(area.end(), nuclei.area.begin(), nuclei.area.end());
+        hole_area.insert(hole_area.end(), nuclei.hole_area.begin(), nuclei.hole_area.end());
+        perimeter.insert(perimeter.end(), nuclei.perimeter.begin(), nuclei.perimeter.end());
+        red_overlap.insert(red_overlap.end(),
+                            nuclei.red_overlap.begin(), nuclei.red_overlap.end());
+        green_overlap.insert(green_overlap.end(),
+                            nuclei.green_overlap.begin(), nuclei.green_overlap.end());
+        z_first.insert(z_first.end(), nuclei.z_first.begin(), nuclei.z_first.end());
+        z_last.insert(z_last.end(), nuclei.z_last.begin(), nuclei.z_last.end());
+    }
+
+    arrow::ArrayVector columns;
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::StringBuilder>(image_layer, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::UInt32Builder>(region, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::StringBuilder>(region_class, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::UInt8Builder>(valid, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::DoubleBuilder>(area, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::DoubleBuilder>(hole_area, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::DoubleBuilder>(perimeter, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::FloatBuilder>(centroid_x, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::FloatBuilder>(centroid_y, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::Int32Builder>(bbox_x, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::Int32Builder>(bbox_y, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::Int32Builder>(bbox_width, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::Int32Builder>(bbox_height, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::FloatBuilder>(red_overlap, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::FloatBuilder>(green_overlap, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::Int32Builder>(z_first, &columns));
+    ARROW_RETURN_NOT_OK(appendColumn<arrow::Int32Builder>(z_last, &columns));
+    return writer_->WriteRecordBatch(
+                *arrow::RecordBatch::Make(schema_, image_layer.size(), columns));
+}
+
+#endif // HAVE_ARROW
@@ -0,0 +1,49 @@
+#ifndef ARROW_WRITER_HPP
+#define ARROW_WRITER_HPP
+
+#ifdef HAVE_ARROW
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/writer.h>
+
+#include "config.hpp"
+#include "metrics.hpp"
+
+
+/* Table written by an ArrowWriter */
+enum class ArrowTable : unsigned char {
+    METRICS = 0,    // one row per merged layer, as computed_metrics.csv
+    CELLS           // one row per nucleus, as cells.csv
+};
+
+/* Arrow IPC file of metrics rows
+ *
+ * Each write() appends one record batch, so the file is written per image
+ * while the rows of later images are still being computed. Counts and bins
+ * are uint32 columns; the bin layout is kept in the schema metadata.
+ */
+class ArrowWriter {
+public:
+    bool open(const std::string &filename, ArrowTable table, const PipelineParams &params);
+    bool write(const std::vector<MetricsRow> &rows);
+    bool close();
+
+private:
+    arrow::Status writeMetrics(const std::vector<MetricsRow> &rows);
+    arrow::Status writeCells(const std::vector<MetricsRow> &rows);
+
+    ArrowTable table_ = ArrowTable::METRICS;
+    std::string filename_;
+    std::shared_ptr<arrow::Schema> schema_;
+    std::shared_ptr<arrow::io::FileOutputStream> sink_;
+    std::shared_ptr<arrow::ipc::RecordBatchWriter> writer_;
+};
+
+#endif // HAVE_ARROW
+
+#endif // ARROW_WRITER_HPP
@@ -0,0 +1,119 @@
+#include <assert.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "bit_mask.hpp"
+
+
+/* Set bit i for each nonzero byte i of 64 bytes */
+static inline uint64_t packWord(const uchar *src) {
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t word = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 16*i));
+        unsigned int is_zero = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero));
+        word |= static_cast<uint64_t>(~is_zero & 0xFFFF) << (16*i);
+    }
+    return word;
+#else
+    uint64_t word = 0;
+    for (int i = 0; i < 64; i++) word |= static_cast<uint64_t>(src[i] != 0) << i;
+    return word;
+#endif
+}
+
+/* Bits of pixels [x0, x1) within one word, 0 <= x0 < x1 <= 64 */
+static inline uint64_t spanBits(int x0, int x1) {
+    uint64_t high = (x1 == 64) ? ~0ULL : ((1ULL << x1) - 1);
+    return high & ~((1ULL << x0) - 1);
+}
+
+void BitMask::resize(int rows, int cols) {
+    rows_ = rows;
+    cols_ = cols;
+    row_words_ = (cols + 63) / 64;
+    words_.resize(static_cast<size_t>(rows) * row_words_);
+}
+
+/* Pack the nonzero pixels of an 8-bit mask, OR'ed into the bits with accumulate */
+void BitMask::pack(const cv::Mat &mask, bool accumulate) {
+
+    assert(mask.type() == CV_8UC1);
+    if (!accumulate || (mask.size() != size())) {
+        resize(mask.rows, mask.cols);
+        accumulate = false;
+    }
+    const int full_words = cols_ / 64, tail = cols_ % 64;
+    for (int y = 0; y < rows_; y++) {
+        const uchar *src = mask.ptr<uchar>(y);
+        uint64_t *dst = row(y);
+        for (int w = 0; w < full_words; w++) {
+            uint64_t word = packWord(src + 64*w);
+            dst[w] = accumulate ? (dst[w] | word) : word;
+        }
+        if (!tail) continue;
+        uint64_t word = 0;
+        for (int i = 0; i < tail; i++) {
+            word |= static_cast<uint64_t>(src[64*full_words + i] != 0) << i;
+        }
+        dst[full_words] = accumulate ? (dst[full_words] | word) : word;
+    }
+}
+
+/* Unpack to a 0/255 CV_8UC1 mask; dst must have the size of the mask */
+void BitMask::unpack(cv::Mat *dst) const {
+
+    // Each byte of a word expands to 8 bytes of 0 / 255
+    static const struct ExpandTable {
+        uint64_t bytes[256];
+        ExpandTable() {
+            for (int bits = 0; bits < 256; bits++) {
+                bytes[bits] = 0;
+                for (int i = 0; i < 8; i++) {
+                    if (bits & (1 << i)) bytes[bits] |= 0xFFULL << (8*i);
+                }
+            }
+        }
+    } expand;
+
+    assert((dst->size() == size()) && (dst->type() == CV_8UC1));
+    for (int y = 0; y < rows_; y++) {
+        const uint64_t *src = row(y);
+        uchar *dst_row = dst->ptr<uchar>(y);
+        int x = 0;
+        for (int w = 0; x + 64 <= cols_; w++, x += 64) {
+            for (int i = 0; i < 8; i++) {
+                uint64_t bytes = expand.bytes[(src[w] >> (8*i)) & 0xFF];
+                memcpy(dst_row + x + 8*i, &bytes, 8);
+            }
+        }
+        for (; x < cols_; x++) dst_row[x] = ((src[x/64] >> (x%64)) & 1) ? 255 : 0;
+    }
+}
+
+/* Number of set pixels of row y in columns [x0, x1) */
+unsigned int BitMask::countRow(int y, int x0, int x1) const {
+
+    if (x0 >= x1) return 0;
+    const uint64_t *src = row(y);
+    const int w0 = x0 / 64, w1 = (x1 - 1) / 64;
+    if (w0 == w1) return __builtin_popcountll(src[w0] & spanBits(x0 % 64, (x1 - 1) % 64 + 1));
+
+    unsigned int count = __builtin_popcountll(src[w0] & spanBits(x0 % 64, 64));
+    for (int w = w0 + 1; w < w1; w++) count += __builtin_popcountll(src[w]);
+    return count + __builtin_popcountll(src[w1] & spanBits(0, (x1 - 1) % 64 + 1));
+}
+
+/* dst = a & b */
+void BitMask::bitwiseAnd(const BitMask &a, const BitMask &b, BitMask *dst) {
+
+    assert(a.size() == b.size());
+    dst->resize(a.rows_, a.cols_);
+    const size_t num_words = a.words_.size();
+    const uint64_t *a_words = a.words_.data(), *b_words = b.words_.data();
+    uint64_t *dst_words = dst->words_.data();
+    for (size_t i = 0; i < num_words; i++) dst_words[i] = a_words[i] & b_words[i];
+}
@@ -0,0 +1,44 @@
+#ifndef BIT_MASK_HPP
+#define BIT_MASK_HPP
+
+#include <stdint.h>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+
+/* Binary mask packed to 1 bit per pixel
+ *
+ * Bit i of word w of a row is pixel 64*w + i; rows are padded to whole
+ * 64-bit words and the padding bits are always 0. The words of a mask are
+ * reused when it is packed again at the same size.
+ */
+class BitMask {
+public:
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    cv::Size size() const { return cv::Size(cols_, rows_); }
+    bool empty() const { return words_.empty(); }
+
+    /* Pack the nonzero pixels of an 8-bit mask, OR'ed into the bits with accumulate */
+    void pack(const cv::Mat &mask, bool accumulate = false);
+
+    /* Unpack to a 0/255 CV_8UC1 mask; dst must have the size of the mask */
+    void unpack(cv::Mat *dst) const;
+
+    /* Number of set pixels of row y in columns [x0, x1) */
+    unsigned int countRow(int y, int x0, int x1) const;
+
+    /* dst = a & b */
+    static void bitwiseAnd(const BitMask &a, const BitMask &b, BitMask *dst);
+
+private:
+    void resize(int rows, int cols);
+    const uint64_t *row(int y) const { return &words_[y * row_words_]; }
+    uint64_t *row(int y) { return &words_[y * row_words_]; }
+
+    int rows_ = 0, cols_ = 0, row_words_ = 0;
+    std::vector<uint64_t> words_;
+};
+
+#endif // BIT_MASK_HPP
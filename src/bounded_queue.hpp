@@ -0,0 +1,55 @@
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+
+/* Bounded FIFO between two pipeline stages
+ *
+ * push() blocks while the queue is full, which holds the producing stage
+ * back; pop() blocks while it is empty and fails once the queue is closed
+ * and drained. Thread-safe.
+ */
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t depth) : depth_(std::max<size_t>(depth, 1)) {}
+
+    /* Queue an item, blocking while the queue is full */
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]() { return queue_.size() < depth_; });
+        queue_.push_back(std::move(item));
+        not_empty_.notify_one();
+    }
+
+    /* Take the oldest item, blocking while empty; false once closed and drained */
+    bool pop(T *item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]() { return closed_ || !queue_.empty(); });
+        if (queue_.empty()) return false;
+        *item = std::move(queue_.front());
+        queue_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    /* No more items will be pushed */
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable not_full_, not_empty_;
+    std::deque<T> queue_;
+    size_t depth_;
+    bool closed_ = false;
+};
+
+#endif // BOUNDED_QUEUE_HPP
@@ -0,0 +1,196 @@
+#include <iostream>
+#include <fstream>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <cmath>
+
+#include "config.hpp"
+
+
+/* Integer parameters */
+static const struct {
+    const char *key;
+    unsigned int PipelineParams::*field;
+} kUIntParams[] = {
+    {"num_area_bins",           &PipelineParams::num_area_bins},
+    {"bin_area",                &PipelineParams::bin_area},
+    {"log_area_bins",           &PipelineParams::log_area_bins},
+    {"num_z_layers_combined",   &PipelineParams::num_z_layers_combined},
+    {"blue_tozero",             &PipelineParams::blue_tozero},
+    {"blue_binary",             &PipelineParams::blue_binary},
+    {"green_tozero",            &PipelineParams::green_tozero},
+    {"green_binary",            &PipelineParams::green_binary},
+    {"red_tozero",              &PipelineParams::red_tozero},
+    {"red_binary",              &PipelineParams::red_binary},
+    {"red_low_tozero",          &PipelineParams::red_low_tozero},
+    {"red_low_binary",          &PipelineParams::red_low_binary},
+    {"red_high_tozero",         &PipelineParams::red_high_tozero},
+    {"red_high_binary",         &PipelineParams::red_high_binary},
+};
+
+/* Real-valued parameters and their valid range; min is exclusive if open */
+static const struct {
+    const char *key;
+    double PipelineParams::*field;
+    double min, max;
+    bool open;
+} kDoubleParams[] = {
+    {"microglial_roi_factor",   &PipelineParams::microglial_roi_factor, 0,  HUGE_VAL,   true},
+    {"min_area",                &PipelineParams::min_area,              0,  HUGE_VAL,   false},
+    {"microglial_coverage",     &PipelineParams::microglial_coverage,   0,  1,          false},
+    {"neural_coverage",         &PipelineParams::neural_coverage,       0,  1,          false},
+};
+
+/* Strip leading and trailing whitespace */
+static std::string trim(std::string str) {
+    size_t begin = str.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) return std::string();
+    size_t end = str.find_last_not_of(" \t\r\n");
+    return str.substr(begin, end - begin + 1);
+}
+
+/* Set one parameter from its textual key and value */
+bool setParam(std::string key, std::string value, PipelineParams *params) {
+
+    key = trim(key);
+    value = trim(value);
+    char *end = NULL;
+    for (auto &param : kUIntParams) {
+        if (key != param.key) continue;
+        errno = 0;
+        long long parsed = strtoll(value.c_str(), &end, 10);
+        if (value.empty() || *end || (errno == ERANGE) || 
+                (parsed < 0) || (parsed > UINT_MAX)) {
+            break;
+        }
+        params->*param.field = static_cast<unsigned int>(parsed);
+        return true;
+    }
+    for (auto &param : kDoubleParams) {
+        if (key != param.key) continue;
+        double parsed = strtod(value.c_str(), &end);
+        if (value.empty() || *end || !std::isfinite(parsed)) break;
+        params->*param.field = parsed;
+        return true;
+    }
+    std::cerr << "Invalid parameter '" << key << " = " << value << "'" << std::endl;
+    return false;
+}
+
+/* Check that the parameters can be run */
+bool validateParams(const PipelineParams &params) {
+
+    if (!params.num_area_bins || !params.bin_area || !params.num_z_layers_combined) {
+        std::cerr << "num_area_bins, bin_area and num_z_layers_combined must be > 0"
+                    << std::endl;
+        return false;
+    }
+    if ((params.log_area_bins > 1) || 
+            (params.log_area_bins && (params.num_area_bins > LOG_AREA_BINS_MAX))) {
+        std::cerr << "log_area_bins must be 0 or 1, with at most " << LOG_AREA_BINS_MAX 
+                    << " num_area_bins" << std::endl;
+        return false;
+    }
+    for (auto &param : kUIntParams) {
+        std::string key(param.key);
+        if ((key.find("_tozero") != std::string::npos ||
+                key.find("_binary") != std::string::npos) &&
+                (params.*param.field > 255)) {
+            std::cerr << "Threshold '" << key << "' must be <= 255" << std::endl;
+            return false;
+        }
+    }
+    for (auto &param : kDoubleParams) {
+        const double value = params.*param.field;
+        if (!std::isfinite(value) || (value > param.max) || 
+                (param.open ? (value <= param.min) : (value < param.min))) {
+            std::cerr << "'" << param.key << "' must be " << (param.open ? "> " : ">= ") 
+                      << param.min;
+            if (std::isfinite(param.max)) std::cerr << " and <= " << param.max;
+            std::cerr << std::endl;
+            return false;
+        }
+    }
+    for (auto c : params.name) {
+        if (!isalnum(static_cast<unsigned char>(c)) && (c != '_') && (c != '-')) {
+            std::cerr << "Invalid parameter set name '" << params.name << "'" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Write the parameters as the 'key = value' lines loadConfig() reads 
+ * 
+ * Real values are written with full precision so that they read back exactly. 
+ */
+void writeParams(const PipelineParams &params, std::ostream *stream) {
+
+    std::streamsize precision = stream->precision(17);
+    for (auto &param : kUIntParams) {
+        *stream << param.key << " = " << params.*param.field << std::endl;
+    }
+    for (auto &param : kDoubleParams) {
+        *stream << param.key << " = " << params.*param.field << std::endl;
+    }
+    stream->precision(precision);
+}
+
+/* Load the parameter sets of a config file */
+bool loadConfig(std::string filename, const PipelineParams &base,
+                    std::vector<PipelineParams> *param_sets) {
+
+    std::ifstream config_stream(filename);
+    if (!config_stream.is_open()) {
+        std::cerr << "Could not open the config file '" << filename << "'." << std::endl;
+        return false;
+    }
+
+    PipelineParams common = base;
+    std::vector<PipelineParams> sections;
+    std::string line;
+    unsigned int line_number = 0;
+    while (std::getline(config_stream, line)) {
+        line_number++;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+
+        if (line[0] == '[') {
+            if (line[line.size()-1] != ']') {
+                std::cerr << filename << ":" << line_number << ": invalid section" << std::endl;
+                return false;
+            }
+            sections.push_back(common);
+            sections.back().name = trim(line.substr(1, line.size()-2));
+            if (sections.back().name.empty()) {
+                std::cerr << filename << ":" << line_number << ": empty section name" << std::endl;
+                return false;
+            }
+            continue;
+        }
+
+        size_t separator = line.find('=');
+        if (separator == std::string::npos) {
+            std::cerr << filename << ":" << line_number << ": expected 'key = value'" << std::endl;
+            return false;
+        }
+        PipelineParams *target = sections.empty() ? &common : &sections.back();
+        if (!setParam(line.substr(0, separator), line.substr(separator+1), target)) {
+            return false;
+        }
+    }
+
+    if (sections.empty()) sections.push_back(common);
+    for (size_t i = 0; i < sections.size(); i++) {
+        if (!validateParams(sections[i])) return false;
+        for (size_t j = 0; j < i; j++) {
+            if (sections[j].name != sections[i].name) continue;
+            std::cerr << "Duplicate parameter set '" << sections[i].name << "'" << std::endl;
+            return false;
+        }
+    }
+    *param_sets = sections;
+    return true;
+}
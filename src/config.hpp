@@ -0,0 +1,64 @@
+#ifndef CONFIG_HPP
+#define CONFIG_HPP
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+
+#define MICROGLIAL_ROI_FACTOR   20  // ROI of microglial cell = roi factor * mean microglial dia
+#define NUM_AREA_BINS           21  // Number of bins
+#define BIN_AREA                25  // Bin area
+#define LOG_AREA_BINS_MAX       32  // Max number of log bins; past 2^30 pixels they stay empty
+#define NUM_Z_LAYERS_COMBINED   1   // Number of z-layers combined
+
+
+/* Pipeline parameters, defaulting to the values the pipeline was tuned with
+ *
+ * Each channel is enhanced as threshold(src, <channel>_tozero, TOZERO),
+ * inverted, blurred and thresholded at <channel>_binary.
+ */
+struct PipelineParams {
+    std::string name;                   // parameter set name, empty by default
+
+    double microglial_roi_factor        = MICROGLIAL_ROI_FACTOR;
+    unsigned int num_area_bins          = NUM_AREA_BINS;
+    unsigned int bin_area               = BIN_AREA;
+    unsigned int log_area_bins          = 0;    // 1: bin edges double from bin_area on
+    unsigned int num_z_layers_combined  = NUM_Z_LAYERS_COMBINED;
+    double min_area                     = 1.0;
+
+    unsigned int blue_tozero            = 10;
+    unsigned int blue_binary            = 150;
+    unsigned int green_tozero           = 10;
+    unsigned int green_binary           = 240;
+    unsigned int red_tozero             = 5;
+    unsigned int red_binary             = 250;
+    unsigned int red_low_tozero         = 50;
+    unsigned int red_low_binary         = 250;
+    unsigned int red_high_tozero        = 50;
+    unsigned int red_high_binary        = 250;
+
+    double microglial_coverage          = 0.30; // min blue-red coverage of microglia
+    double neural_coverage              = 0.20; // min blue-green coverage of neurons
+};
+
+/* Set one parameter from its textual key and value */
+bool setParam(std::string key, std::string value, PipelineParams *params);
+
+/* Check that the parameters can be run */
+bool validateParams(const PipelineParams &params);
+
+/* Write the parameters as the 'key = value' lines loadConfig() reads */
+void writeParams(const PipelineParams &params, std::ostream *stream);
+
+/* Load the parameter sets of a config file
+ *
+ * The file holds 'key = value' lines; '#' starts a comment. Keys before the
+ * first '[name]' section apply to every set. Each section starts a sweep
+ * point named after it; without sections the file yields a single set.
+ */
+bool loadConfig(std::string filename, const PipelineParams &base,
+                    std::vector<PipelineParams> *param_sets);
+
+#endif // CONFIG_HPP
@@ -0,0 +1,154 @@
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include "enhance_kernels.hpp"
+#include "mat_pool.hpp"
+
+
+#define GAUSS_KSIZE             3   // Gaussian size of the enhancement chain
+
+/* Binomial coefficient; row KSIZE-1 is the OpenCV Gaussian of sizes 3 and 5 (sigma 0) */
+static constexpr unsigned int binomial(unsigned int n, unsigned int k) {
+    return ((k == 0) || (k == n)) ? 1 : binomial(n-1, k-1) + binomial(n-1, k);
+}
+
+/* Reflect-101 index for any overhang, as used by the default OpenCV border */
+static inline int reflectIndex(int index, int len) {
+    if (len == 1) return 0;
+    while ((index < 0) || (index >= len)) {
+        index = (index < 0) ? -index : 2*len - index - 2;
+    }
+    return index;
+}
+
+/* TOZERO and BINARY thresholds of a channel type */
+static inline void channelThresholds(ChannelType channel_type, const PipelineParams &params,
+                                        unsigned int *tozero, unsigned int *binary) {
+    switch (channel_type) {
+        case ChannelType::BLUE:
+            *tozero = params.blue_tozero;
+            *binary = params.blue_binary;
+            break;
+        case ChannelType::GREEN:
+            *tozero = params.green_tozero;
+            *binary = params.green_binary;
+            break;
+        case ChannelType::RED:
+            *tozero = params.red_tozero;
+            *binary = params.red_binary;
+            break;
+        case ChannelType::RED_LOW:
+            *tozero = params.red_low_tozero;
+            *binary = params.red_low_binary;
+            break;
+        case ChannelType::RED_HIGH:
+            *tozero = params.red_high_tozero;
+            *binary = params.red_high_binary;
+            break;
+    }
+}
+
+/* Vertical pass of the Gaussian over KSIZE rows
+ *
+ * sums holds width + KSIZE-1 entries: the column sums, with the reflect-101
+ * border columns the horizontal pass needs on each side.
+ */
+template <typename T, typename Sum, int KSIZE>
+static inline void columnSums(const T *const *rows, int width, Sum *sums) {
+    const int radius = KSIZE/2;
+    for (int x = 0; x < width; x++) {
+        Sum sum = 0;
+        for (int k = 0; k < KSIZE; k++) sum += binomial(KSIZE-1, k) * rows[k][x];
+        sums[radius + x] = sum;
+    }
+    for (int i = 1; i <= radius; i++) {
+        sums[radius - i] = sums[radius + reflectIndex(-i, width)];
+        sums[radius + width-1 + i] = sums[radius + reflectIndex(width-1 + i, width)];
+    }
+}
+
+/* Horizontal pass of the Gaussian at column x, rounded like OpenCV's fixed-point blur */
+template <typename Sum, int KSIZE>
+static inline unsigned int gaussAt(const Sum *sums, int x) {
+    unsigned int sum = 0;
+    for (int k = 0; k < KSIZE; k++) sum += binomial(KSIZE-1, k) * sums[x + k];
+    return (sum + (1u << (2*KSIZE - 3))) >> (2*KSIZE - 2);
+}
+
+/* Enhancement chain of enhanceChain() for one channel type, in one pass
+ *
+ * The planes thresholded at tozero and inverted are kept in a ring of KSIZE
+ * rows; each output row is blurred from it and thresholded at binary.
+ * RED_LOW also blurs the raw plane and keeps (1, 250] of it inside the mask.
+ * Pixel values follow the OpenCV chain on T.
+ */
+template <typename T, ChannelType CHANNEL, int KSIZE>
+static void enhanceChannel(const cv::Mat &src, const PipelineParams &params, cv::Mat *dst) {
+
+    static_assert((KSIZE == 3) || (KSIZE == 5), "the Gaussian is binomial up to size 5");
+    typedef typename std::conditional<sizeof(T) == 1, unsigned short, unsigned int>::type Sum;
+    const unsigned int max_value = std::numeric_limits<T>::max();
+    const bool raw_blur = (CHANNEL == ChannelType::RED_LOW);
+    const int radius = KSIZE/2, height = src.rows, width = src.cols;
+    unsigned int tozero = 0, binary = 0;
+    channelThresholds(CHANNEL, params, &tozero, &binary);
+    *dst = pooledMat(src.size(), src.type());
+
+    std::vector<T> ring(KSIZE * width);
+    std::vector<int> ring_row(KSIZE, -1);
+    std::vector<Sum> sums(width + 2*radius), raw_sums(raw_blur ? width + 2*radius : 0);
+    auto load_row = [&](int row) -> const T * {
+        T *masked = &ring[(row % KSIZE) * width];
+        if (ring_row[row % KSIZE] == row) return masked;
+        ring_row[row % KSIZE] = row;
+        const T *in = src.ptr<T>(row);
+        for (int x = 0; x < width; x++) {
+            masked[x] = max_value - ((in[x] > tozero) ? in[x] : 0);
+        }
+        return masked;
+    };
+
+    for (int y = 0; y < height; y++) {
+        const T *rows[KSIZE], *raw_rows[KSIZE];
+        for (int k = 0; k < KSIZE; k++) {
+            const int row = reflectIndex(y + k - radius, height);
+            rows[k] = load_row(row);
+            raw_rows[k] = src.ptr<T>(row);
+        }
+        columnSums<T, Sum, KSIZE>(rows, width, sums.data());
+        if (raw_blur) columnSums<T, Sum, KSIZE>(raw_rows, width, raw_sums.data());
+
+        T *out = dst->ptr<T>(y);
+        for (int x = 0; x < width; x++) {
+            const unsigned int mask = (gaussAt<Sum, KSIZE>(sums.data(), x) > binary) ? 255 : 0;
+            if (raw_blur) {
+                const unsigned int low = gaussAt<Sum, KSIZE>(raw_sums.data(), x) & mask;
+                out[x] = ((low > 1) && (low <= 250)) ? 255 : 0;
+            } else {
+                out[x] = max_value - mask;
+            }
+        }
+    }
+}
+
+/* Kernels by channel type, 8U only
+ *
+ * 16U GaussianBlur goes through OpenCV's float filter and rounds halves to
+ * even, which the fixed-point rounding of gaussAt() does not; 16U planes
+ * keep the OpenCV chain.
+ */
+static const EnhanceKernel kKernels[] = {
+    enhanceChannel<uchar, ChannelType::BLUE, GAUSS_KSIZE>,
+    enhanceChannel<uchar, ChannelType::GREEN, GAUSS_KSIZE>,
+    enhanceChannel<uchar, ChannelType::RED, GAUSS_KSIZE>,
+    enhanceChannel<uchar, ChannelType::RED_LOW, GAUSS_KSIZE>,
+    enhanceChannel<uchar, ChannelType::RED_HIGH, GAUSS_KSIZE>,
+};
+
+/* Kernel of a channel type for a CV_8UC1 image; NULL if there is none */
+EnhanceKernel enhanceKernel(ChannelType channel_type, int type) {
+    const size_t channel = static_cast<size_t>(channel_type);
+    if (channel >= sizeof(kKernels)/sizeof(kKernels[0])) return NULL;
+    return (type == CV_8UC1) ? kKernels[channel] : NULL;
+}
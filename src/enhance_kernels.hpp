@@ -0,0 +1,22 @@
+#ifndef ENHANCE_KERNELS_HPP
+#define ENHANCE_KERNELS_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include "config.hpp"
+#include "pipeline.hpp"
+
+
+/* Enhancement of one channel type on one pixel type, bit-exact with enhanceChain() */
+typedef void (*EnhanceKernel)(const cv::Mat &src, const PipelineParams &params, cv::Mat *dst);
+
+/* Kernel of a channel type for a CV_8UC1 image; NULL if there is none
+ *
+ * The kernels are compiled once per channel type and Gaussian size, so the
+ * chain of thresholds and blurs of enhanceImage() becomes a single pass over
+ * the image with no type checks or temporaries. The bench checks each one
+ * against the OpenCV chain before timing anything.
+ */
+EnhanceKernel enhanceKernel(ChannelType channel_type, int type);
+
+#endif // ENHANCE_KERNELS_HPP
@@ -0,0 +1,109 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "histogram.hpp"
+
+
+/* Areas are clamped to [0, AREA_CLAMP] pixels, far above any region */
+#define AREA_CLAMP  1073741824.0    // 2^30, within int32
+
+BinSpec::BinSpec(const PipelineParams &params)
+    : num_bins(params.num_area_bins), bin_area(params.bin_area),
+        log(params.log_area_bins != 0) {}
+
+/* Bin of one area; the same arithmetic as the SSE2 path of histogram() */
+unsigned int BinSpec::bin(double area) const {
+
+    double quotient = trunc(std::max(0.0, std::min(area, AREA_CLAMP)) + 0.5) / bin_area;
+    if (!log) return static_cast<unsigned int>(std::min(quotient, num_bins - 1.0));
+    if (quotient < 1.0) return 0;
+    return std::min(static_cast<unsigned int>(ilogb(quotient)) + 1, num_bins - 1);
+}
+
+/* Lower edge of a bin, in pixels */
+unsigned long long BinSpec::lower(unsigned int bin) const {
+    if (!log) return static_cast<unsigned long long>(bin) * bin_area;
+    return bin ? static_cast<unsigned long long>(bin_area) << (bin - 1) : 0;
+}
+
+/* The area column of the valid rows of a region table */
+HistogramColumn areaColumn(const RegionTable &regions, AreaBins *bins) {
+    return HistogramColumn{regions.area.data(), regions.valid.data(), regions.size(), bins};
+}
+
+#if defined(__SSE2__)
+/* Bins of 2 areas, in the low 2 int32 lanes */
+static inline __m128i binPair(const BinSpec &spec, const double *areas) {
+
+    const __m128d clamp = _mm_set1_pd(AREA_CLAMP), half = _mm_set1_pd(0.5);
+    __m128d area = _mm_max_pd(_mm_min_pd(_mm_loadu_pd(areas), clamp), _mm_setzero_pd());
+    __m128d rounded = _mm_cvtepi32_pd(_mm_cvttpd_epi32(_mm_add_pd(area, half)));
+    __m128d quotient = _mm_div_pd(rounded, _mm_set1_pd(spec.bin_area));
+    if (!spec.log) {
+        return _mm_cvttpd_epi32(_mm_min_pd(quotient, _mm_set1_pd(spec.num_bins - 1.0)));
+    }
+
+    // floor(log2(q)) + 1 is the biased exponent of q - 1022; clamp to the bins
+    __m128i exponent = _mm_srli_epi64(_mm_castpd_si128(quotient), 52);
+    __m128i bin = _mm_sub_epi32(_mm_shuffle_epi32(exponent, _MM_SHUFFLE(3, 1, 2, 0)),
+                                _mm_set1_epi32(1022));
+    bin = _mm_andnot_si128(_mm_cmplt_epi32(bin, _mm_setzero_si128()), bin);
+    __m128i last = _mm_set1_epi32(spec.num_bins - 1);
+    __m128i over = _mm_cmpgt_epi32(bin, last);
+    return _mm_or_si128(_mm_and_si128(over, last), _mm_andnot_si128(over, bin));
+}
+#endif
+
+/* Bin several columns with the same bins in one pass
+ *
+ * The bin of each row is computed branch-free, 4 rows at a time with SSE2;
+ * invalid rows land in a sink slot after the last bin. Consecutive rows
+ * count into 4 interleaved copies of the histogram, so that rows in the
+ * same bin do not wait on each other's increments.
+ */
+void histogram(const BinSpec &spec, const std::vector<HistogramColumn> &columns) {
+
+    const unsigned int stride = spec.num_bins + 1;
+    std::vector<unsigned int> counts(4 * stride);
+    for (auto &column : columns) {
+        std::fill(counts.begin(), counts.end(), 0);
+        size_t row = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128(), sink = _mm_set1_epi32(spec.num_bins);
+        alignas(16) int bins[4];
+        for (; row + 4 <= column.count; row += 4) {
+            __m128i bin = _mm_unpacklo_epi64(binPair(spec, column.areas + row),
+                                                binPair(spec, column.areas + row + 2));
+            int valid_bytes;
+            memcpy(&valid_bytes, column.valid + row, 4);
+            __m128i valid = _mm_unpacklo_epi16(
+                                _mm_unpacklo_epi8(_mm_cvtsi32_si128(valid_bytes), zero), zero);
+            __m128i invalid = _mm_cmpeq_epi32(valid, zero);
+            bin = _mm_or_si128(_mm_and_si128(invalid, sink), _mm_andnot_si128(invalid, bin));
+            _mm_store_si128(reinterpret_cast<__m128i *>(bins), bin);
+            counts[bins[0]]++;
+            counts[stride + bins[1]]++;
+            counts[2*stride + bins[2]]++;
+            counts[3*stride + bins[3]]++;
+        }
+#endif
+        for (; row < column.count; row++) {
+            unsigned int bin = column.valid[row] ? spec.bin(column.areas[row]) : spec.num_bins;
+            counts[(row % 4)*stride + bin]++;
+        }
+
+        AreaBins *area_bins = column.bins;
+        area_bins->bins.assign(spec.num_bins, 0);
+        area_bins->count = 0;
+        for (unsigned int bin = 0; bin < spec.num_bins; bin++) {
+            for (unsigned int copy = 0; copy < 4; copy++) {
+                area_bins->bins[bin] += counts[copy*stride + bin];
+            }
+            area_bins->count += area_bins->bins[bin];
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <vector>
+
+#include "config.hpp"
+#include "metrics.hpp"
+
+
+/* Bins of the area histograms
+ *
+ * Linear bins are bin_area wide. With log_area_bins bin 0 holds the areas
+ * below bin_area and bin i >= 1 the areas in [bin_area * 2^(i-1),
+ * bin_area * 2^i), for at most LOG_AREA_BINS_MAX bins. Areas are rounded
+ * to whole pixels first and the last bin also holds every larger area.
+ */
+struct BinSpec {
+    unsigned int num_bins;
+    unsigned int bin_area;
+    bool log;
+
+    explicit BinSpec(const PipelineParams &params);
+
+    /* Bin of one area */
+    unsigned int bin(double area) const;
+
+    /* Lower edge of a bin, in pixels */
+    unsigned long long lower(unsigned int bin) const;
+};
+
+/* A contiguous column of areas to bin; rows whose valid byte is 0 are skipped */
+struct HistogramColumn {
+    const double *areas;
+    const unsigned char *valid;
+    size_t count;
+    AreaBins *bins;
+};
+
+/* The area column of the valid rows of a region table */
+HistogramColumn areaColumn(const RegionTable &regions, AreaBins *bins);
+
+/* Bin several columns with the same bins in one pass, e.g. the four fibre classes */
+void histogram(const BinSpec &spec, const std::vector<HistogramColumn> &columns);
+
+#endif // HISTOGRAM_HPP
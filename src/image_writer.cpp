@@ -0,0 +1,141 @@
+#include <iostream>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "image_writer.hpp"
+
+
+ImageWriter::ImageWriter(unsigned int num_threads, size_t queue_depth)
+    : queue_depth_(queue_depth ? queue_depth : 1) {
+
+    if (!num_threads) num_threads = 1;
+    for (unsigned int i = 0; i < num_threads; i++) {
+        threads_.push_back(std::thread(&ImageWriter::run, this));
+    }
+}
+
+ImageWriter::~ImageWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    not_empty_.notify_all();
+    for (auto &thread : threads_) thread.join();
+}
+
+/* Queue an image, blocking while the queue is full */
+void ImageWriter::write(std::string filename, cv::Mat image) {
+    ScopedTimer timer(Stage::WRITE);
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (captured_) {
+        (*captured_)[filename] = image;
+        return;
+    }
+    not_full_.wait(lock, [this]() { return queue_.size() < queue_depth_; });
+    queue_.push_back(Job{filename, image, currentStats(), next_seq_});
+    pending_.insert(next_seq_++);
+    not_empty_.notify_one();
+}
+
+/* Hard-link an existing file, falling back to queueing the image */
+void ImageWriter::link(std::string src_filename, std::string filename, cv::Mat image) {
+    if (!src_filename.empty() && !captured_) {
+        unlink(filename.c_str());
+        if (!::link(src_filename.c_str(), filename.c_str())) return;
+    }
+    write(filename, image);
+}
+
+/* Keep the images by file name instead of writing them 
+ * 
+ * The images are kept as handed to write(); the caller owns the map and 
+ * reads it once the producers are done. 
+ */
+void ImageWriter::capture(std::map<std::string, cv::Mat> *images) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    captured_ = images;
+}
+
+/* Block until every queued image has been written */
+void ImageWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    drained_.wait(lock, [this]() { return queue_.empty() && !in_flight_; });
+}
+
+/* Sequence number of the next image queued, the since of onWritten() */
+unsigned long long ImageWriter::sequence() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return next_seq_;
+}
+
+/* Call done, on a writer thread, once every image queued so far is written 
+ * 
+ * done runs right away on the calling thread if nothing is pending. written 
+ * is false if an image queued between since and this call failed. 
+ */
+void ImageWriter::onWritten(std::function<void(bool written)> done, unsigned long long since) {
+    bool written = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!pending_.empty()) {
+            callbacks_.insert(std::make_pair(next_seq_, Callback{since, done}));
+            return;
+        }
+        auto failed = failed_.lower_bound(since);
+        written = (failed == failed_.end()) || (*failed >= next_seq_);
+    }
+    done(written);
+}
+
+/* Writer thread */
+void ImageWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        not_empty_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+        if (queue_.empty()) return; // stopped and drained
+
+        Job job = std::move(queue_.front());
+        queue_.pop_front();
+        in_flight_++;
+        not_full_.notify_one();
+        lock.unlock();
+
+        bool written = false;
+        {
+            ScopedTimer timer(Stage::ENCODE, job.stats);
+            try {
+                written = cv::imwrite(job.filename.c_str(), job.image);
+            } catch (const cv::Exception &) {}
+        }
+        struct stat st = {0};
+        if (!written) {
+            std::cerr << "Could not write '" << job.filename << "'" << std::endl;
+        } else if (job.stats && (stat(job.filename.c_str(), &st) != -1)) {
+            job.stats->bytes_written += st.st_size;
+        }
+        job.image.release();
+        job.stats.reset();
+
+        // Run the callbacks whose images have all been written
+        lock.lock();
+        pending_.erase(job.seq);
+        if (!written) failed_.insert(job.seq);
+        unsigned long long written_seq = pending_.empty() ? next_seq_ : *pending_.begin();
+        std::vector<std::pair<std::function<void(bool)>, bool>> ready;
+        while (!callbacks_.empty() && (callbacks_.begin()->first <= written_seq)) {
+            const unsigned long long seq = callbacks_.begin()->first;
+            Callback &callback = callbacks_.begin()->second;
+            auto failed = failed_.lower_bound(callback.since);
+            ready.push_back(std::make_pair(std::move(callback.done), 
+                                            (failed == failed_.end()) || (*failed >= seq)));
+            callbacks_.erase(callbacks_.begin());
+        }
+        if (!ready.empty()) {
+            lock.unlock();
+            for (auto &callback : ready) callback.first(callback.second);
+            lock.lock();
+        }
+        in_flight_--;
+        if (queue_.empty() && !in_flight_) drained_.notify_all();
+    }
+}
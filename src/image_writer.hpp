@@ -0,0 +1,101 @@
+#ifndef IMAGE_WRITER_HPP
+#define IMAGE_WRITER_HPP
+
+#include <string>
+#include <deque>
+#include <map>
+#include <set>
+#include <functional>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "opencv2/imgcodecs.hpp"
+
+#include "instrumentation.hpp"
+
+
+#define WRITER_QUEUE_DEPTH      16  // Images queued before producers block
+
+
+/* Images written for each processed stack */
+enum class OutputLevel : unsigned char {
+    METRICS = 0,    // computed_metrics.csv only
+    ENHANCED,       // + layer_N_b_enhanced.tif
+    FULL            // + layer_N_a_original.tif and layer_N_c_analyzed.tif
+};
+
+/* How layer_N_a_original.tif is produced */
+enum class OriginalOutput : unsigned char {
+    ENCODE = 0,     // re-encode the decoded layer
+    LINK,           // hard-link the input file, re-encode if that fails
+    SKIP            // do not produce it
+};
+
+/* Image outputs of a run */
+struct OutputOptions {
+    OutputLevel level = OutputLevel::FULL;
+    OriginalOutput original = OriginalOutput::ENCODE;
+    bool cells = false;             // keep the classified nuclei for the per-cell table
+    bool territories = false;       // fibres in the ROI of each microglial nucleus
+};
+
+/* Asynchronous image writer with a bounded queue
+ *
+ * Images handed to write() must not be modified afterwards; cv::Mat shares
+ * its buffer, so the queue only holds references until the image is encoded.
+ */
+class ImageWriter {
+public:
+    explicit ImageWriter(unsigned int num_threads = 1,
+                            size_t queue_depth = WRITER_QUEUE_DEPTH);
+    ~ImageWriter();
+
+    /* Queue an image, blocking while the queue is full */
+    void write(std::string filename, cv::Mat image);
+
+    /* Hard-link an existing file, falling back to queueing the image */
+    void link(std::string src_filename, std::string filename, cv::Mat image);
+
+    /* Block until every queued image has been written */
+    void flush();
+
+    /* Sequence number of the next image queued, the since of onWritten() */
+    unsigned long long sequence();
+
+    /* Call done, on a writer thread, once every image queued so far is written;
+     * written is false if one of the images queued from since on failed */
+    void onWritten(std::function<void(bool written)> done, unsigned long long since = 0);
+
+    /* Keep the images by file name in images instead of writing them (--verify) */
+    void capture(std::map<std::string, cv::Mat> *images);
+
+private:
+    struct Job {
+        std::string filename;
+        cv::Mat image;
+        std::shared_ptr<ImageStats> stats; // stats of the image being processed
+        unsigned long long seq;
+    };
+    void run();
+
+    size_t queue_depth_;
+    std::deque<Job> queue_;
+    unsigned int in_flight_ = 0;
+    unsigned long long next_seq_ = 0;
+    std::set<unsigned long long> pending_;  // queued and in-flight jobs
+    std::set<unsigned long long> failed_;   // jobs whose image could not be written
+    struct Callback {
+        unsigned long long since;
+        std::function<void(bool)> done;
+    };
+    std::multimap<unsigned long long, Callback> callbacks_;
+    bool stop_ = false;
+    std::map<std::string, cv::Mat> *captured_ = NULL;
+    std::mutex mutex_;
+    std::condition_variable not_empty_, not_full_, drained_;
+    std::vector<std::thread> threads_;
+};
+
+#endif // IMAGE_WRITER_HPP
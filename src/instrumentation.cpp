@@ -0,0 +1,143 @@
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+
+#include "instrumentation.hpp"
+
+
+/* Column names of the stages */
+static const char *kStageNames[] = {
+    "decode", "split", "enhance", "merge", "segment",
+    "classify", "bin", "write", "encode"
+};
+
+/* Name of a stage, as in the timings.csv columns */
+const char *stageName(Stage stage) {
+    return kStageNames[static_cast<int>(stage)];
+}
+
+/* Stats bound to this thread */
+static thread_local std::shared_ptr<ImageStats> current_stats;
+
+/* Chrome trace events */
+struct TraceEvent {
+    Stage stage;
+    std::string image_name;
+    unsigned long long ts_us, dur_us;
+    unsigned int tid;
+};
+static std::atomic<bool> trace_enabled(false);
+static std::mutex trace_mutex;
+static std::vector<TraceEvent> trace_events;
+static const std::chrono::steady_clock::time_point trace_epoch =
+                                            std::chrono::steady_clock::now();
+
+/* Small stable id of the calling thread for the trace */
+static unsigned int traceThreadId() {
+    static std::atomic<unsigned int> next_tid(1);
+    static thread_local unsigned int tid = next_tid++;
+    return tid;
+}
+
+ImageStats::ImageStats(std::string name)
+    : image_name(name), total_us(0), layers(0), contours(0), bytes_read(0),
+        bytes_written(0) {
+    for (auto &us : stage_us) us = 0;
+}
+
+StatsScope::StatsScope(std::shared_ptr<ImageStats> stats)
+    : previous_(current_stats) {
+    current_stats = stats;
+}
+
+StatsScope::~StatsScope() {
+    current_stats = previous_;
+}
+
+std::shared_ptr<ImageStats> currentStats() {
+    return current_stats;
+}
+
+ScopedTimer::ScopedTimer(Stage stage)
+    : ScopedTimer(stage, current_stats) {}
+
+ScopedTimer::ScopedTimer(Stage stage, std::shared_ptr<ImageStats> stats)
+    : stage_(stage), stats_(stats), start_(std::chrono::steady_clock::now()) {}
+
+ScopedTimer::~ScopedTimer() {
+    if (!stats_) return;
+    auto end = std::chrono::steady_clock::now();
+    unsigned long long dur_us = std::chrono::duration_cast<
+                        std::chrono::microseconds>(end - start_).count();
+    stats_->stage_us[static_cast<int>(stage_)] += dur_us;
+
+    if (!trace_enabled) return;
+    unsigned long long ts_us = std::chrono::duration_cast<
+                        std::chrono::microseconds>(start_ - trace_epoch).count();
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace_events.push_back(TraceEvent{stage_, stats_->image_name, ts_us, dur_us,
+                                        traceThreadId()});
+}
+
+void countLayers(unsigned long long count) {
+    if (current_stats) current_stats->layers += count;
+}
+
+void countContours(unsigned long long count) {
+    if (current_stats) current_stats->contours += count;
+}
+
+void countBytesRead(unsigned long long count) {
+    if (current_stats) current_stats->bytes_read += count;
+}
+
+/* Record the process-wide peak RSS into the stats */
+void recordPeakRss(ImageStats *stats) {
+    struct rusage usage;
+    if (!getrusage(RUSAGE_SELF, &usage)) stats->peak_rss_kb = usage.ru_maxrss;
+}
+
+/* Write the timings.csv header */
+void writeTimingsHeader(std::ostream *stream) {
+    *stream << "image,total_ms,";
+    for (auto name : kStageNames) *stream << name << "_ms,";
+    *stream << "layers,contours,bytes_read,bytes_written,peak_rss_kb" << std::endl;
+}
+
+/* Write the timings.csv row of one image */
+void writeTimingsRow(const ImageStats &stats, std::ostream *stream) {
+    *stream << stats.image_name << "," << stats.total_us / 1000.0 << ",";
+    for (auto &us : stats.stage_us) *stream << us / 1000.0 << ",";
+    *stream << stats.layers << "," << stats.contours << "," << stats.bytes_read
+            << "," << stats.bytes_written << "," << stats.peak_rss_kb << std::endl;
+}
+
+void enableTrace() {
+    trace_enabled = true;
+}
+
+/* Write the collected events in the Chrome trace event format */
+bool writeTrace(std::string filename) {
+    std::ofstream trace_stream(filename);
+    if (!trace_stream.is_open()) return false;
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace_stream << "{\"traceEvents\":[";
+    for (size_t i = 0; i < trace_events.size(); i++) {
+        const TraceEvent &event = trace_events[i];
+        std::string image_name;
+        for (auto c : event.image_name) {
+            if ((c == '"') || (c == '\\')) image_name += '\\';
+            image_name += c;
+        }
+        trace_stream << (i ? ",\n" : "\n")
+            << "{\"name\":\"" << kStageNames[static_cast<int>(event.stage)]
+            << "\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.tid
+            << ",\"ts\":" << event.ts_us << ",\"dur\":" << event.dur_us
+            << ",\"args\":{\"image\":\"" << image_name << "\"}}";
+    }
+    trace_stream << "\n]}" << std::endl;
+    return true;
+}
@@ -0,0 +1,84 @@
+#ifndef INSTRUMENTATION_HPP
+#define INSTRUMENTATION_HPP
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <string>
+
+
+/* Pipeline stages that are timed */
+enum class Stage : unsigned char {
+    DECODE = 0,     // TIFF decode
+    SPLIT,          // cv::split / plane assembly
+    ENHANCE,        // enhanceLayer
+    MERGE,          // z-layer merges and channel intersections
+    SEGMENT,        // contourCalc / componentCalc
+    CLASSIFY,       // classifyMicroglialCells / classifyNeuralCells
+    BIN,            // binArea
+    WRITE,          // handing images to the writer, incl. queue back-pressure
+    ENCODE,         // imwrite on the writer threads
+    NUM_STAGES
+};
+
+/* Name of a stage, as in the timings.csv columns */
+const char *stageName(Stage stage);
+
+/* Per-image timings and counters
+ *
+ * Every field is atomic because the writer threads (and intra-image tasks)
+ * update the stats of an image concurrently with its compute thread.
+ */
+struct ImageStats {
+    std::string image_name;
+    std::atomic<unsigned long long> stage_us[static_cast<int>(Stage::NUM_STAGES)];
+    std::atomic<unsigned long long> total_us, layers, contours, bytes_read, bytes_written;
+    long peak_rss_kb = 0;
+
+    explicit ImageStats(std::string name);
+};
+
+/* Bind an image's stats to the calling thread for the lifetime of the scope */
+class StatsScope {
+public:
+    explicit StatsScope(std::shared_ptr<ImageStats> stats);
+    ~StatsScope();
+
+private:
+    std::shared_ptr<ImageStats> previous_;
+};
+
+/* Stats bound to the calling thread, NULL outside of a StatsScope */
+std::shared_ptr<ImageStats> currentStats();
+
+/* Time a stage of the image bound to the calling thread */
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Stage stage);
+    ScopedTimer(Stage stage, std::shared_ptr<ImageStats> stats);
+    ~ScopedTimer();
+
+private:
+    Stage stage_;
+    std::shared_ptr<ImageStats> stats_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/* Counters of the image bound to the calling thread */
+void countLayers(unsigned long long count);
+void countContours(unsigned long long count);
+void countBytesRead(unsigned long long count);
+
+/* Record the process-wide peak RSS into the stats */
+void recordPeakRss(ImageStats *stats);
+
+/* Write the timings.csv header and one row per image */
+void writeTimingsHeader(std::ostream *stream);
+void writeTimingsRow(const ImageStats &stats, std::ostream *stream);
+
+/* Collect the timed stages as Chrome trace events (chrome://tracing) */
+void enableTrace();
+bool writeTrace(std::string filename);
+
+#endif // INSTRUMENTATION_HPP
@@ -1,616 +1,232 @@
 #include <iostream>
-#include <dirent.h>
-#include <sys/stat.h>
 #include <fstream>
-#include <math.h>
-#include <assert.h>
-
-#include "opencv2/imgproc/imgproc.hpp"
-#include "opencv2/highgui/highgui.hpp"
-#include "opencv2/photo/photo.hpp"
-#include "opencv2/imgcodecs.hpp"
-
-
-#define DEBUG_FLAG              0   // Debug flag for image channels
-#define MICROGLIAL_ROI_FACTOR   20  // ROI of microglial cell = roi factor * mean microglial dia
-#define NUM_AREA_BINS           21  // Number of bins
-#define BIN_AREA                25  // Bin area
-#define NUM_Z_LAYERS_COMBINED   1   // Number of z-layers combined
-
-
-/* Channel type */
-enum class ChannelType : unsigned char {
-    BLUE = 0,
-    GREEN,
-    RED,
-    RED_LOW,
-    RED_HIGH
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <deque>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/core/ocl.hpp"
+
+#include "config.hpp"
+#include "pipeline.hpp"
+#include "instrumentation.hpp"
+#include "mat_pool.hpp"
+#include "arrow_writer.hpp"
+#include "result_cache.hpp"
+#include "shard.hpp"
+#include "stack_watcher.hpp"
+#include "bounded_queue.hpp"
+#include "memory_budget.hpp"
+#include "verify.hpp"
+
+
+#define MAX_THREADS             4096    // Largest thread count of an option
+
+
+/* Result of processing one entry of image_list.dat */
+struct ImageResult {
+    std::vector<std::vector<MetricsRow>> metrics; // one buffer per parameter set
+    bool success = false;
+    bool done = false;
 };
 
-/* Hierarchy type */
-enum class HierarchyType : unsigned char {
-    INVALID_CNTR = 0,
-    CHILD_CNTR,
-    PARENT_CNTR
+/* A stack of image_list.dat on its way through the reader and worker threads */
+struct StackJob {
+    size_t index = 0;
+    std::string image_name;
+    std::shared_ptr<ImageStats> stats;
+    std::string cache_file, cache_key;      // --incremental
+    std::unique_ptr<StackReader> stack;     // opened ahead by a reader (--readers)
+    unsigned long long reserved = 0;        // bytes held in the --max-memory budget
+    bool streamed = false;                  // too large for the budget, streamed
 };
 
-/* Enhance the image */
-bool enhanceImage(cv::Mat src, ChannelType channel_type, cv::Mat *dst) {
-
-    // Enhance the image using Gaussian blur and thresholding
-    cv::Mat enhanced;
-    switch(channel_type) {
-        case ChannelType::BLUE: {
-            // Enhance the blue channel
-
-            // Create the mask
-            cv::Mat src_gray;
-            cv::threshold(src, src_gray, 10, 255, cv::THRESH_TOZERO);
-            bitwise_not(src_gray, src_gray);
-            cv::GaussianBlur(src_gray, enhanced, cv::Size(3,3), 0, 0);
-            cv::threshold(enhanced, enhanced, 150, 255, cv::THRESH_BINARY);
-
-            // Invert the mask
-            bitwise_not(enhanced, enhanced);
-        } break;
-
-        case ChannelType::GREEN: {
-            // Enhance the green channel
-
-            // Create the mask
-            cv::Mat src_gray;
-            cv::threshold(src, src_gray, 10, 255, cv::THRESH_TOZERO);
-            bitwise_not(src_gray, src_gray);
-            cv::GaussianBlur(src_gray, enhanced, cv::Size(3,3), 0, 0);
-            cv::threshold(enhanced, enhanced, 240, 255, cv::THRESH_BINARY);
-
-            // Invert the mask
-            bitwise_not(enhanced, enhanced);
-        } break;
-
-        case ChannelType::RED: {
-            // Enhance the red channel
-
-            // Create the mask
-            cv::Mat src_gray;
-            cv::threshold(src, src_gray, 5, 255, cv::THRESH_TOZERO);
-            bitwise_not(src_gray, src_gray);
-            cv::GaussianBlur(src_gray, enhanced, cv::Size(3,3), 0, 0);
-            cv::threshold(enhanced, enhanced, 250, 255, cv::THRESH_BINARY);
-
-            // Invert the mask
-            bitwise_not(enhanced, enhanced);
-        } break;
-
-        case ChannelType::RED_LOW: {
-            // Enhance the red (low) channel
-
-            // Create the mask
-            cv::Mat src_gray;
-            cv::threshold(src, src_gray, 50, 255, cv::THRESH_TOZERO);
-            bitwise_not(src_gray, src_gray);
-            cv::GaussianBlur(src_gray, enhanced, cv::Size(3,3), 0, 0);
-            cv::threshold(enhanced, enhanced, 250, 255, cv::THRESH_BINARY);
-
-            // Enhance the low intensity features
-            cv::Mat red_low_gauss;
-            cv::GaussianBlur(src, red_low_gauss, cv::Size(3,3), 0, 0);
-            bitwise_and(red_low_gauss, enhanced, enhanced);
-            cv::threshold(enhanced, enhanced, 250, 255, cv::THRESH_TOZERO_INV);
-            cv::threshold(enhanced, enhanced, 1, 255, cv::THRESH_BINARY);
-        } break;
-
-        case ChannelType::RED_HIGH: {
-            // Enhance the red (high) channel
-
-            // Create the mask
-            cv::Mat src_gray;
-            cv::threshold(src, src_gray, 50, 255, cv::THRESH_TOZERO);
-            bitwise_not(src_gray, src_gray);
-            cv::GaussianBlur(src_gray, enhanced, cv::Size(3,3), 0, 0);
-            cv::threshold(enhanced, enhanced, 250, 255, cv::THRESH_BINARY);
-
-            // Invert the mask
-            bitwise_not(enhanced, enhanced);
-        } break;
-
-        default: {
-            std::cerr << "Invalid channel type" << std::endl;
-            return false;
-        }
-    }
-    *dst = enhanced;
+/* Set by SIGINT / SIGTERM to end --watch */
+static volatile sig_atomic_t stop_requested = 0;
+
+static void requestStop(int) {
+    stop_requested = 1;
+}
+
+/* Parse a thread count of at most MAX_THREADS; only digits are accepted */
+static bool parseThreadCount(const std::string &value, unsigned int *count) {
+    if (value.empty() || !isdigit(static_cast<unsigned char>(value[0]))) return false;
+    char *end = NULL;
+    errno = 0;
+    unsigned long parsed = strtoul(value.c_str(), &end, 10);
+    if (*end || (errno == ERANGE) || (parsed > MAX_THREADS)) return false;
+    *count = static_cast<unsigned int>(parsed);
     return true;
 }
 
-/* Find the contours in the image */
-void contourCalc(cv::Mat src, ChannelType channel_type, 
-                    double min_area, cv::Mat *dst, 
-                    std::vector<std::vector<cv::Point>> *contours, 
-                    std::vector<cv::Vec4i> *hierarchy, 
-                    std::vector<HierarchyType> *validity_mask, 
-                    std::vector<double> *parent_area) {
-
-    cv::Mat temp_src;
-    src.copyTo(temp_src);
-    switch(channel_type) {
-        case ChannelType::BLUE :
-        case ChannelType::GREEN : {
-            findContours(temp_src, *contours, *hierarchy, cv::RETR_EXTERNAL, 
-                                                        cv::CHAIN_APPROX_SIMPLE);
-        } break;
-
-        case ChannelType::RED :
-        case ChannelType::RED_LOW :
-        case ChannelType::RED_HIGH : {
-            findContours(temp_src, *contours, *hierarchy, cv::RETR_CCOMP, 
-                                                        cv::CHAIN_APPROX_SIMPLE);
-        } break;
-
-        default: return;
-    }
+/* Main - create the threads and start the processing */
+int main(int argc, char *argv[]) {
 
-    *dst = cv::Mat::zeros(temp_src.size(), CV_8UC3);
-    if (!contours->size()) return;
-    validity_mask->assign(contours->size(), HierarchyType::INVALID_CNTR);
-    parent_area->assign(contours->size(), 0.0);
-
-    // Keep the contours whose size is >= than min_area
-    cv::RNG rng(12345);
-    for (int index = 0 ; index < (int)contours->size(); index++) {
-        if ((*hierarchy)[index][3] > -1) continue; // ignore child
-        auto cntr_external = (*contours)[index];
-        double area_external = fabs(contourArea(cv::Mat(cntr_external)));
-        if (area_external < min_area) continue;
-
-        std::vector<int> cntr_list;
-        cntr_list.push_back(index);
-
-        int index_hole = (*hierarchy)[index][2];
-        double area_hole = 0.0;
-        while (index_hole > -1) {
-            std::vector<cv::Point> cntr_hole = (*contours)[index_hole];
-            double temp_area_hole = fabs(contourArea(cv::Mat(cntr_hole)));
-            if (temp_area_hole) {
-                cntr_list.push_back(index_hole);
-                area_hole += temp_area_hole;
+    /* Parse the arguments: [options] <image directory path> */
+    unsigned int num_jobs = 1, num_writers = 1, num_readers = 0;
+    unsigned long long max_memory = 0;
+    OutputOptions output;
+    bool output_given = false;
+    ExecutionOptions exec;
+    bool incremental = false;
+    ShardOptions shard;
+    unsigned int merge_shards = 0;
+    bool watch = false;
+    double settle_sec = WATCH_SETTLE_SEC;
+#ifdef HAVE_ARROW
+    bool arrow_output = false;
+#endif
+    std::string path, config_file, trace_file, verify_engine;
+    std::vector<std::string> param_overrides;
+    for (int arg_index = 1; arg_index < argc; arg_index++) {
+        std::string arg(argv[arg_index]);
+        std::string value = (arg_index+1 < argc) ? argv[arg_index+1] : "";
+        if (arg == "--jobs" && parseThreadCount(value, &num_jobs)) {
+            arg_index++;
+            if (!num_jobs) num_jobs = std::thread::hardware_concurrency();
+            if (!num_jobs) num_jobs = 1;
+        } else if (arg == "--config" && arg_index+1 < argc) {
+            config_file = argv[++arg_index];
+        } else if (arg == "--set" && (value.find('=') != std::string::npos)) {
+            param_overrides.push_back(value);
+            arg_index++;
+        } else if (arg == "--segment" && (value == "contours" || value == "components")) {
+            exec.segment_engine = (value == "components") ? 
+                                SegmentEngine::COMPONENTS : SegmentEngine::CONTOURS;
+            arg_index++;
+        } else if (arg == "--backend" && (value == "cpu" || value == "opencl")) {
+            exec.backend = (value == "opencl") ? Backend::OPENCL : Backend::CPU;
+            arg_index++;
+        } else if (arg == "--trace" && arg_index+1 < argc) {
+            trace_file = argv[++arg_index];
+            enableTrace();
+        } else if (arg == "--tasks" && parseThreadCount(value, &exec.tasks)) {
+            arg_index++;
+            if (!exec.tasks) exec.tasks = std::thread::hardware_concurrency();
+            if (!exec.tasks) exec.tasks = 1;
+        } else if (arg == "--tile" && arg_index+1 < argc) {
+            exec.tile_size = static_cast<unsigned int>(atoi(argv[++arg_index]));
+        } else if (arg == "--3d") {
+            exec.volumetric = true;
+        } else if (arg == "--packed") {
+            exec.packed_masks = true;
+        } else if (arg == "--plane-cache" && !value.empty()) {
+            exec.plane_cache = argv[++arg_index];
+            if (exec.plane_cache.back() != '/') exec.plane_cache += "/";
+            // Created now, or an existing directory the cache files can be written to
+            struct stat st = {0};
+            mkdir(exec.plane_cache.c_str(), 0700);
+            if ((stat(exec.plane_cache.c_str(), &st) == -1) || !S_ISDIR(st.st_mode) || 
+                    access(exec.plane_cache.c_str(), W_OK | X_OK)) {
+                std::cerr << "Could not create or write the plane cache directory '" 
+                          << exec.plane_cache << "'." << std::endl;
+                return -1;
             }
-            index_hole = (*hierarchy)[index_hole][0];
-        }
-        double area_contour = area_external - area_hole;
-        if (area_contour >= min_area) {
-            (*validity_mask)[cntr_list[0]] = HierarchyType::PARENT_CNTR;
-            (*parent_area)[cntr_list[0]] = area_contour;
-            for (unsigned int i = 1; i < cntr_list.size(); i++) {
-                (*validity_mask)[cntr_list[i]] = HierarchyType::CHILD_CNTR;
+        } else if (arg == "--writers" && parseThreadCount(value, &num_writers)) {
+            arg_index++;
+        } else if (arg == "--readers" && parseThreadCount(value, &num_readers)) {
+            arg_index++;
+        } else if (arg == "--max-memory" && parseMemorySize(value, &max_memory)) {
+            arg_index++;
+        } else if (arg == "--output" && 
+                    (value == "metrics" || value == "enhanced" || value == "full")) {
+            output.level = (value == "metrics") ? OutputLevel::METRICS : 
+                (value == "enhanced") ? OutputLevel::ENHANCED : OutputLevel::FULL;
+            output_given = true;
+            arg_index++;
+        } else if (arg == "--original" && 
+                    (value == "encode" || value == "link" || value == "skip")) {
+            output.original = (value == "encode") ? OriginalOutput::ENCODE : 
+                (value == "link") ? OriginalOutput::LINK : OriginalOutput::SKIP;
+            arg_index++;
+        } else if (arg == "--shard" && parseShard(value, &shard)) {
+            arg_index++;
+        } else if (arg == "--merge" && arg_index+1 < argc) {
+            merge_shards = static_cast<unsigned int>(atoi(argv[++arg_index]));
+            if (merge_shards < 2) {
+                std::cerr << "--merge needs the shard count, at least 2." << std::endl;
+                return -1;
             }
-            cv::Scalar color = cv::Scalar(rng.uniform(0, 255), rng.uniform(0,255), 
-                                            rng.uniform(0,255));
-            drawContours(*dst, *contours, index, color, cv::FILLED, cv::LINE_8, *hierarchy);
-        }
-    }
-}
-
-/* Classify Microglial cells */
-void classifyMicroglialCells(std::vector<std::vector<cv::Point>> blue_contours, 
-                                cv::Mat blue_red_intersection,
-                                std::vector<std::vector<cv::Point>> *microglial_contours,
-                                std::vector<std::vector<cv::Point>> *other_contours) {
-
-    for (size_t i = 0; i < blue_contours.size(); i++) {
-
-        // Eliminate small contours via contour arc calculation
-        if ((arcLength(blue_contours[i], true) < 10) || (blue_contours[i].size() < 5)) continue;
-
-        // Determine whether microglial cell by calculating blue-red coverage area
-        std::vector<std::vector<cv::Point>> specific_contour (1, blue_contours[i]);
-        cv::Mat drawing = cv::Mat::zeros(blue_red_intersection.size(), CV_8UC1);
-        drawContours(drawing, specific_contour, -1, cv::Scalar::all(255), cv::FILLED, 
-                                    cv::LINE_8, std::vector<cv::Vec4i>(), 0, cv::Point());
-        int contour_count_before = countNonZero(drawing);
-        cv::Mat contour_intersection;
-        bitwise_and(drawing, blue_red_intersection, contour_intersection);
-        int contour_count_after = countNonZero(contour_intersection);
-        float coverage_ratio = ((float)contour_count_after)/contour_count_before;
-        if (coverage_ratio < 0.30) {
-            other_contours->push_back(blue_contours[i]);
-        } else {
-            microglial_contours->push_back(blue_contours[i]);
-        }
-    }
-}
-
-/* Classify Neural cells */
-void classifyNeuralCells(std::vector<std::vector<cv::Point>> blue_contours, 
-                            cv::Mat blue_green_intersection,
-                            std::vector<std::vector<cv::Point>> *neural_contours,
-                            std::vector<std::vector<cv::Point>> *other_contours) {
-
-    for (size_t i = 0; i < blue_contours.size(); i++) {
-
-        // Eliminate small contours via contour arc calculation
-        if ((arcLength(blue_contours[i], true) < 10) || (blue_contours[i].size() < 5)) continue;
-
-        // Determine whether neural cell by calculating blue-green coverage area
-        std::vector<std::vector<cv::Point>> specific_contour (1, blue_contours[i]);
-        cv::Mat drawing = cv::Mat::zeros(blue_green_intersection.size(), CV_8UC1);
-        drawContours(drawing, specific_contour, -1, cv::Scalar::all(255), cv::FILLED, 
-                                    cv::LINE_8, std::vector<cv::Vec4i>(), 0, cv::Point());
-        int contour_count_before = countNonZero(drawing);
-        cv::Mat contour_intersection;
-        bitwise_and(drawing, blue_green_intersection, contour_intersection);
-        int contour_count_after = countNonZero(contour_intersection);
-        float coverage_ratio = ((float)contour_count_after)/contour_count_before;
-        if (coverage_ratio < 0.20) {
-            other_contours->push_back(blue_contours[i]);
+        } else if (arg == "--verify" && arg_index+1 < argc) {
+            verify_engine = argv[++arg_index];
+        } else if (arg == "--watch") {
+            watch = true;
+        } else if (arg == "--settle" && arg_index+1 < argc) {
+            settle_sec = atof(argv[++arg_index]);
+        } else if (arg == "--incremental") {
+            incremental = true;
+        } else if (arg == "--cells") {
+            output.cells = true;
+        } else if (arg == "--territories") {
+            output.territories = true;
+        } else if (arg == "--arrow") {
+#ifdef HAVE_ARROW
+            arrow_output = true;
+#else
+            std::cerr << "Built without Arrow support, rebuild with 'make ARROW=1'." << std::endl;
+            return -1;
+#endif
+        } else if (path.empty() && arg.compare(0, 2, "--")) {
+            path = arg;
         } else {
-            neural_contours->push_back(blue_contours[i]);
+            std::cerr << "Invalid arguments." << std::endl;
+            return -1;
         }
     }
-}
-
-/* Group microglia area into bins */
-void binArea(std::vector<HierarchyType> contour_mask, 
-                std::vector<double> contour_area, 
-                std::string *contour_bins,
-                unsigned int *contour_cnt) {
-
-    std::vector<unsigned int> count(NUM_AREA_BINS, 0);
-    *contour_cnt = 0;
-    for (size_t i = 0; i < contour_mask.size(); i++) {
-        if (contour_mask[i] != HierarchyType::PARENT_CNTR) continue;
-        unsigned int area = static_cast<unsigned int>(round(contour_area[i]));
-        unsigned int bin_index = 
-            (area/BIN_AREA < NUM_AREA_BINS) ? area/BIN_AREA : NUM_AREA_BINS-1;
-        count[bin_index]++;
-    }
-
-    for (size_t i = 0; i < count.size(); i++) {
-        *contour_cnt += count[i];
-        *contour_bins += std::to_string(count[i]) + ",";
-    }
-}
-
-/* Process the images inside each directory */
-bool processImage(std::string path, std::string image_name, std::string metrics_file) {
-
-    /* Create the data output file for images that were processed */
-    std::ofstream data_stream;
-    data_stream.open(metrics_file, std::ios::app);
-    if (!data_stream.is_open()) {
-        std::cerr << "Could not open the data output file." << std::endl;
-        return false;
+    if (path.empty()) {
+        std::cerr << "Invalid number of arguments." << std::endl;
+        return -1;
     }
-
-    // Count the number of images
-    uint8_t z_count = 0;
-    struct dirent *dir = NULL;
-
-    std::string dir_name = path + "tiff/" + image_name + "/";
-    DIR *read_dir = opendir(dir_name.c_str());
-    if (!read_dir) {
-        std::cerr << "Could not open directory '" << dir_name << "'" << std::endl;
-        return false;
+    if (exec.backend == Backend::OPENCL) {
+        if (!cv::ocl::haveOpenCL()) {
+            std::cerr << "No OpenCL device available for --backend opencl." << std::endl;
+            return -1;
+        }
+        cv::ocl::setUseOpenCL(true);
+        std::cout << "OpenCL device: " << cv::ocl::Device::getDefault().name() << std::endl;
     }
-    while ((dir = readdir(read_dir))) {
-        if (!strcmp (dir->d_name, ".") || !strcmp (dir->d_name, "..")) {
-            continue;
+    if (exec.volumetric) {
+        // The 3D objects span the stack; no per-layer images are produced
+        if (output_given && (output.level != OutputLevel::METRICS)) {
+            std::cerr << "--3d writes no images, it needs --output metrics." << std::endl;
+            return -1;
         }
-        z_count++;
+        output.level = OutputLevel::METRICS;
     }
-    closedir(read_dir);
-
-    // Create the output directory
-    std::string out_directory = path + "result/";
-    struct stat st = {0};
-    if (stat(out_directory.c_str(), &st) == -1) {
-        mkdir(out_directory.c_str(), 0700);
+    if (exec.packed_masks && (exec.tile_size || (exec.backend == Backend::OPENCL))) {
+        std::cerr << "--packed cannot be combined with --tile or --backend opencl." << std::endl;
+        return -1;
     }
-    out_directory = out_directory + image_name + "/";
-    st = {0};
-    if (stat(out_directory.c_str(), &st) == -1) {
-        mkdir(out_directory.c_str(), 0700);
+    if (watch && ((shard.count > 1) || merge_shards || (settle_sec < 0))) {
+        std::cerr << "--watch needs a settle time >= 0 and cannot be sharded." << std::endl;
+        return -1;
     }
 
-    std::vector<cv::Mat> blue(z_count), green(z_count), red(z_count), original(z_count);
-    for (uint8_t z_index = 1; z_index <= z_count; z_index++) {
-
-        // Create the input filename and rgb stream output filenames
-        std::string in_filename;
-        if (z_count < 10) {
-            in_filename  = dir_name + image_name + "_z" + std::to_string(z_index) + "c1+2+3.tif";
-        } else {
-            if (z_index < 10) {
-                in_filename  = dir_name + image_name + "_z0" + std::to_string(z_index) + "c1+2+3.tif";
-            } else if (z_index < 100) {
-                in_filename  = dir_name + image_name + "_z" + std::to_string(z_index) + "c1+2+3.tif";
-            } else { // assuming number of z plane layers will never exceed 99
-                std::cerr << "Does not support more than 99 z layers curently" << std::endl;
-                return false;
-            }
-        }
-
-        // Extract the bgr streams for each input image
-        cv::Mat img = cv::imread(in_filename.c_str(), cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
-        if (img.empty()) {
-            std::cerr << "Invalid input filename" << std::endl;
-            return false;
-        }
-        original[z_index-1] = img;
-
-        std::vector<cv::Mat> channel(3);
-        cv::split(img, channel);
-
-        blue[z_index-1]  = channel[0];
-        green[z_index-1] = channel[1];
-        red[z_index-1]   = channel[2];
-
-        // Original image
-        std::string out_original = out_directory + 
-            "layer_" + std::to_string(z_index) + "_a_original.tif";
-        cv::imwrite(out_original.c_str(), img);
+    /* Load the parameter sets; --set overrides apply to every set */
+    std::vector<PipelineParams> param_sets(1);
+    if (!config_file.empty() && !loadConfig(config_file, PipelineParams(), &param_sets)) {
+        return -1;
     }
-
-
-    /** Gather BGR channel information needed for feature extraction **/
-
-    cv::Mat blue_merge, green_merge, red_merge, red_low_merge, red_high_merge;
-    uint8_t merged_layer_count = 0;
-
-    for (uint8_t z_index = 0; z_index < z_count; z_index++) {
-        cv::Mat blue_enhanced, green_enhanced, red_enhanced, 
-                            red_low_enhanced, red_high_enhanced;
-
-        if(!enhanceImage(blue[z_index], ChannelType::BLUE, &blue_enhanced)) {
-            return false;
-        }
-        if(!enhanceImage(green[z_index], ChannelType::GREEN, &green_enhanced)) {
-            return false;
-        }
-        if(!enhanceImage(red[z_index], ChannelType::RED, &red_enhanced)) {
-            return false;
-        }
-        if(!enhanceImage(red[z_index], ChannelType::RED_LOW, &red_low_enhanced)) {
-            return false;
-        }
-        if(!enhanceImage(red[z_index], ChannelType::RED_HIGH, &red_high_enhanced)) {
-            return false;
-        }
-        if (z_index%NUM_Z_LAYERS_COMBINED) {
-            bitwise_or(blue_enhanced, blue_merge, blue_merge);
-            bitwise_or(green_enhanced, green_merge, green_merge);
-            bitwise_or(red_enhanced, red_merge, red_merge);
-            bitwise_or(red_low_enhanced, red_low_merge, red_low_merge);
-            bitwise_or(red_high_enhanced, red_high_merge, red_high_merge);
-        } else {
-            blue_merge = blue_enhanced;
-            green_merge = green_enhanced;
-            red_merge = red_enhanced;
-            red_low_merge = red_low_enhanced;
-            red_high_merge = red_high_enhanced;
-        }
-
-        if (((z_index+1)%NUM_Z_LAYERS_COMBINED == 0) || (z_index+1 == z_count)) {
-
-            merged_layer_count++;
-
-            // Blue channel
-            std::string out_blue = out_directory + 
-                "blue_merged_layer_" + std::to_string(merged_layer_count) + "_enhanced.tif";
-            if (DEBUG_FLAG) cv::imwrite(out_blue.c_str(), blue_merge);
-
-            cv::Mat blue_segmented;
-            std::vector<std::vector<cv::Point>> contours_blue;
-            std::vector<cv::Vec4i> hierarchy_blue;
-            std::vector<HierarchyType> blue_contour_mask;
-            std::vector<double> blue_contour_area;
-            contourCalc(blue_merge, ChannelType::BLUE, 1.0, &blue_segmented, 
-                &contours_blue, &hierarchy_blue, &blue_contour_mask, &blue_contour_area);
-            out_blue.insert(out_blue.find_last_of("."), "_segmented", 10);
-            if (DEBUG_FLAG) cv::imwrite(out_blue.c_str(), blue_segmented);
-
-            // Green channel
-            std::string out_green = out_directory + 
-                "green_merged_layer_" + std::to_string(merged_layer_count) + "_enhanced.tif";
-            if (DEBUG_FLAG) cv::imwrite(out_green.c_str(), green_merge);
-
-            cv::Mat green_segmented;
-            std::vector<std::vector<cv::Point>> contours_green;
-            std::vector<cv::Vec4i> hierarchy_green;
-            std::vector<HierarchyType> green_contour_mask;
-            std::vector<double> green_contour_area;
-            contourCalc(green_merge, ChannelType::GREEN, 1.0, &green_segmented, 
-                &contours_green, &hierarchy_green, &green_contour_mask, &green_contour_area);
-            out_green.insert(out_green.find_last_of("."), "_segmented", 10);
-            if (DEBUG_FLAG) cv::imwrite(out_green.c_str(), green_segmented);
-
-            // Red channel
-            std::string out_red = out_directory + 
-                "red_merged_layer_" + std::to_string(merged_layer_count) + "_enhanced.tif";
-            if (DEBUG_FLAG) cv::imwrite(out_red.c_str(), red_merge);
-
-            cv::Mat red_segmented;
-            std::vector<std::vector<cv::Point>> contours_red;
-            std::vector<cv::Vec4i> hierarchy_red;
-            std::vector<HierarchyType> red_contour_mask;
-            std::vector<double> red_contour_area;
-            contourCalc(red_merge, ChannelType::RED, 1.0, &red_segmented, 
-                &contours_red, &hierarchy_red, &red_contour_mask, &red_contour_area);
-            out_red.insert(out_red.find_last_of("."), "_segmented", 10);
-            if (DEBUG_FLAG) cv::imwrite(out_red.c_str(), red_segmented);
-
-            // Red (low) channel
-            std::string out_red_low = out_directory + 
-                "red_low_merged_layer_" + std::to_string(merged_layer_count) + "_enhanced.tif";
-            if (DEBUG_FLAG) cv::imwrite(out_red_low.c_str(), red_low_merge);
-
-            cv::Mat red_low_segmented;
-            std::vector<std::vector<cv::Point>> contours_red_low;
-            std::vector<cv::Vec4i> hierarchy_red_low;
-            std::vector<HierarchyType> red_low_contour_mask;
-            std::vector<double> red_low_contour_area;
-            contourCalc(red_low_merge, ChannelType::RED_LOW, 1.0, &red_low_segmented, 
-                &contours_red_low, &hierarchy_red_low, &red_low_contour_mask, &red_low_contour_area);
-            out_red.insert(out_red_low.find_last_of("."), "_segmented", 10);
-            if (DEBUG_FLAG) cv::imwrite(out_red_low.c_str(), red_low_segmented);
-
-            // Red (high) channel
-            std::string out_red_high = out_directory + 
-                "red_high_merged_layer_" + std::to_string(merged_layer_count) + "_enhanced.tif";
-            if (DEBUG_FLAG) cv::imwrite(out_red_high.c_str(), red_high_merge);
-
-            cv::Mat red_high_segmented;
-            std::vector<std::vector<cv::Point>> contours_red_high;
-            std::vector<cv::Vec4i> hierarchy_red_high;
-            std::vector<HierarchyType> red_high_contour_mask;
-            std::vector<double> red_high_contour_area;
-            contourCalc(red_high_merge, ChannelType::RED_HIGH, 1.0, &red_high_segmented, 
-                &contours_red_high, &hierarchy_red_high, &red_high_contour_mask, &red_high_contour_area);
-            out_red.insert(out_red_high.find_last_of("."), "_segmented", 10);
-            if (DEBUG_FLAG) cv::imwrite(out_red_high.c_str(), red_high_segmented);
-
-
-            /** Extract multi-dimensional features for analysis **/
-
-            // Blue-red channel intersection
-            cv::Mat blue_red_intersection;
-            bitwise_and(blue_merge, red_merge, blue_red_intersection);
-            std::string out_blue_red_intersection = out_directory + 
-                "blue_red_merged_layer_" + std::to_string(merged_layer_count) + "_enhanced.tif";
-            if (DEBUG_FLAG) cv::imwrite(out_blue_red_intersection.c_str(), 
-                                                        blue_red_intersection);
-
-            // Classify microglial cells
-            std::vector<std::vector<cv::Point>> microglial_contours, other_contours;
-            classifyMicroglialCells(contours_blue, blue_red_intersection, 
-                                        &microglial_contours, &other_contours);
-            data_stream << image_name + "_" + std::to_string(merged_layer_count) << "," 
-                        << microglial_contours.size() + other_contours.size() << "," 
-                        << microglial_contours.size() << ",";
-
-            // Blue-green channel intersection
-            cv::Mat blue_green_intersection;
-            bitwise_and(blue_merge, green_merge, blue_green_intersection);
-            std::string out_blue_green_intersection = out_directory + 
-                "blue_green_merged_layer_" + std::to_string(merged_layer_count) + "_enhanced.tif";
-            if (DEBUG_FLAG) cv::imwrite(out_blue_green_intersection.c_str(), 
-                                                        blue_green_intersection);
-
-            // Classify neural cells
-            std::vector<std::vector<cv::Point>> neural_contours, remaining_contours;
-            classifyNeuralCells(other_contours, blue_green_intersection, 
-                                    &neural_contours, &remaining_contours);
-            data_stream << neural_contours.size() << "," 
-                        << remaining_contours.size() << ",";
-
-            // Characterize microglial cells
-            std::string microglial_bins;
-            unsigned int microglial_cnt;
-            binArea(red_contour_mask, red_contour_area, &microglial_bins, &microglial_cnt);
-            data_stream << microglial_cnt << "," << microglial_bins;
-
-            // Green-red channel intersection
-            cv::Mat green_red_intersection;
-            bitwise_and(green_merge, red_merge, green_red_intersection);
-            std::string out_green_red_intersection = out_directory + 
-                "green_red_merged_layer_" + std::to_string(merged_layer_count) + "_enhanced.tif";
-            if (DEBUG_FLAG) cv::imwrite(out_green_red_intersection.c_str(), green_red_intersection);
-
-            // Segment the green-red intersection
-            cv::Mat green_red_segmented;
-            std::vector<std::vector<cv::Point>> contours_green_red;
-            std::vector<cv::Vec4i> hierarchy_green_red;
-            std::vector<HierarchyType> green_red_contour_mask;
-            std::vector<double> green_red_contour_area;
-            contourCalc(green_red_intersection, ChannelType::RED, 1.0, &green_red_segmented, 
-                        &contours_green_red, &hierarchy_green_red, &green_red_contour_mask, 
-                        &green_red_contour_area);
-
-            // Characterize microglial fibre interaction with neural cells
-            std::string microglial_neural_bins;
-            unsigned int microglial_neural_cnt;
-            binArea(green_red_contour_mask, green_red_contour_area, 
-                    &microglial_neural_bins, &microglial_neural_cnt);
-            data_stream << microglial_neural_cnt << "," << microglial_neural_bins;
-
-            // Characterize high intensity microglial fibres
-            std::string red_high_bins;
-            unsigned int red_high_cnt;
-            binArea(red_high_contour_mask, red_high_contour_area, &red_high_bins, &red_high_cnt);
-            data_stream << red_high_cnt << "," << red_high_bins;
-
-            // Characterize low intensity microglial fibres
-            std::string red_low_bins;
-            unsigned int red_low_cnt;
-            binArea(red_low_contour_mask, red_low_contour_area, &red_low_bins, &red_low_cnt);
-            data_stream << red_low_cnt << "," << red_low_bins;
-
-
-            data_stream << std::endl;
-
-
-            /** Enhanced image **/
-
-            std::vector<cv::Mat> merge_enhanced;
-            merge_enhanced.push_back(blue_merge);
-            merge_enhanced.push_back(green_merge);
-            merge_enhanced.push_back(red_merge);
-            cv::Mat color_enhanced;
-            cv::merge(merge_enhanced, color_enhanced);
-            std::string out_enhanced = out_directory + 
-                "layer_" + std::to_string(merged_layer_count) + "_b_enhanced.tif";
-            cv::imwrite(out_enhanced.c_str(), color_enhanced);
-
-
-            /** Analyzed image **/
-
-            cv::Mat drawing_blue  = blue_merge;
-            cv::Mat drawing_green = cv::Mat::zeros(green_merge.size(), CV_8UC1);
-            cv::Mat drawing_red   = cv::Mat::zeros(red_merge.size(), CV_8UC1);
-
-            // Draw microglial cell boundaries
-            for (size_t i = 0; i < microglial_contours.size(); i++) {
-                cv::RotatedRect min_ellipse = fitEllipse(cv::Mat(microglial_contours[i]));
-                ellipse(drawing_blue, min_ellipse, 255, 4, 8);
-                ellipse(drawing_green, min_ellipse, 0, 4, 8);
-                ellipse(drawing_red, min_ellipse, 255, 4, 8);
+    for (auto &params : param_sets) {
+        for (auto &param : param_overrides) {
+            size_t separator = param.find('=');
+            if (!setParam(param.substr(0, separator), param.substr(separator+1), &params)) {
+                return -1;
             }
-
-            // Draw neural cell boundaries
-            for (size_t i = 0; i < neural_contours.size(); i++) {
-                cv::RotatedRect min_ellipse = fitEllipse(cv::Mat(neural_contours[i]));
-                ellipse(drawing_blue, min_ellipse, 255, 4, 8);
-                ellipse(drawing_green, min_ellipse, 255, 4, 8);
-                ellipse(drawing_red, min_ellipse, 0, 4, 8);
-            }
-
-            // Merge the modified red, blue and green layers
-            std::vector<cv::Mat> merge_analyzed;
-            merge_analyzed.push_back(drawing_blue);
-            merge_analyzed.push_back(drawing_green);
-            merge_analyzed.push_back(drawing_red);
-            cv::Mat color_analyzed;
-            cv::merge(merge_analyzed, color_analyzed);
-            std::string out_analyzed = out_directory + 
-                "layer_" + std::to_string(merged_layer_count) + "_c_analyzed.tif";
-            cv::imwrite(out_analyzed.c_str(), color_analyzed);
         }
+        if (!validateParams(params)) return -1;
     }
-    data_stream.close();
-    return true;
-}
-
-/* Main - create the threads and start the processing */
-int main(int argc, char *argv[]) {
-
-    /* Check for argument count */
-    if (argc != 2) {
-        std::cerr << "Invalid number of arguments." << std::endl;
-        return -1;
-    }
-
-    /* Read the path to the data */
-    std::string path(argv[1]);
 
     /* Read the list of directories to process */
     std::string image_list_filename = path + "image_list.dat";
@@ -628,72 +244,373 @@ int main(int argc, char *argv[]) {
     }
     fclose(file);
 
+    /* Merge the outputs of the shards of a run instead of processing */
+    if (merge_shards) {
+        std::vector<ShardedFile> files;
+        for (auto &params : param_sets) {
+            std::string suffix = (param_sets.size() > 1) ? "_" + params.name : std::string();
+            files.push_back(ShardedFile{"computed_metrics" + suffix, true});
+            files.push_back(ShardedFile{"cells" + suffix, false});
+            files.push_back(ShardedFile{"territories" + suffix, false});
+        }
+        files.push_back(ShardedFile{"timings", false});
+        return mergeShards(path, input_images, merge_shards, files) ? 0 : -1;
+    }
+    input_images = shardImages(input_images, shard);
+
+    /* Compare an engine with the reference pipeline instead of processing */
+    if (!verify_engine.empty()) {
+        return verifyEngine(verify_engine, path, input_images, param_sets, output, exec) ? 
+                0 : -1;
+    }
+
     /* Create the error log for images that could not be processed */
-    std::string err_file = path + "err_list.dat";
+    std::string err_file = shardFilename(path + "err_list", ".dat", shard);
     std::ofstream err_stream(err_file);
     if (!err_stream.is_open()) {
         std::cerr << "Could not open the error log file." << std::endl;
         return -1;
     }
 
-    /* Create and prepare the file for metrics */
-    std::string metrics_file = path + "computed_metrics.csv";
-    std::ofstream data_stream;
-    data_stream.open(metrics_file, std::ios::out);
-    if (!data_stream.is_open()) {
-        std::cerr << "Could not create the metrics file." << std::endl;
-        return -1;
+    /* Create and prepare the files for metrics, one per parameter set of a sweep */
+    std::vector<std::unique_ptr<std::ofstream>> data_streams, cells_streams, territories_streams;
+#ifdef HAVE_ARROW
+    std::vector<std::unique_ptr<ArrowWriter>> arrow_writers;
+#endif
+    for (auto &params : param_sets) {
+        std::string suffix = (param_sets.size() > 1) ? "_" + params.name : std::string();
+        std::string metrics_file = shardFilename(path + "computed_metrics" + suffix, 
+                                                    ".csv", shard);
+        data_streams.push_back(std::unique_ptr<std::ofstream>(new std::ofstream()));
+        data_streams.back()->open(metrics_file, std::ios::out);
+        if (!data_streams.back()->is_open()) {
+            std::cerr << "Could not create the metrics file." << std::endl;
+            return -1;
+        }
+        writeMetricsHeader(params, data_streams.back().get());
+
+        if (output.cells) {
+            std::string cells_file = shardFilename(path + "cells" + suffix, ".csv", shard);
+            cells_streams.push_back(std::unique_ptr<std::ofstream>(new std::ofstream()));
+            cells_streams.back()->open(cells_file, std::ios::out);
+            if (!cells_streams.back()->is_open()) {
+                std::cerr << "Could not create the cells file." << std::endl;
+                return -1;
+            }
+            writeCellsHeader(cells_streams.back().get());
+        }
+        if (output.territories) {
+            std::string territories_file = shardFilename(path + "territories" + suffix, 
+                                                            ".csv", shard);
+            territories_streams.push_back(
+                    std::unique_ptr<std::ofstream>(new std::ofstream()));
+            territories_streams.back()->open(territories_file, std::ios::out);
+            if (!territories_streams.back()->is_open()) {
+                std::cerr << "Could not create the territories file." << std::endl;
+                return -1;
+            }
+            writeTerritoriesHeader(params, territories_streams.back().get());
+        }
+#ifdef HAVE_ARROW
+        if (arrow_output) {
+            arrow_writers.push_back(std::unique_ptr<ArrowWriter>(new ArrowWriter()));
+            if (!arrow_writers.back()->open(
+                        shardFilename(path + "computed_metrics" + suffix, ".arrow", shard), 
+                        ArrowTable::METRICS, params)) {
+                return -1;
+            }
+            if (output.cells) {
+                arrow_writers.push_back(std::unique_ptr<ArrowWriter>(new ArrowWriter()));
+                if (!arrow_writers.back()->open(
+                            shardFilename(path + "cells" + suffix, ".arrow", shard), 
+                            ArrowTable::CELLS, params)) {
+                    return -1;
+                }
+            }
+        }
+#endif
     }
 
-    data_stream << "image_layer,total nuclei count,microglial nuclei count,\
-                neural nuclei count,other nuclei count,microglial fibre count,";
-
-    for (unsigned int i = 0; i < NUM_AREA_BINS-1; i++) {
-        data_stream << i*BIN_AREA << " <= microglial fibre area < " 
-                    << (i+1)*BIN_AREA << ",";
+    /* Process each image directory on a pool of worker threads. The workers 
+     * buffer their metric rows privately; this thread is the single writer 
+     * and merges them in the order of image_list.dat. With --watch the list 
+     * keeps growing as new stacks settle in tiff/. With --readers, reader 
+     * threads decode the next stacks into a bounded queue the workers take 
+     * them from, so decoding overlaps processing. */
+    if (!watch && (num_jobs > input_images.size())) num_jobs = input_images.size();
+    if (!watch && (num_readers > input_images.size())) num_readers = input_images.size();
+    if ((num_jobs > 1) || (exec.tasks > 1)) {
+        cv::setNumThreads(1); // parallelism is per image and per stage instead
     }
-    data_stream << "microglial fibre area >= " 
-                << (NUM_AREA_BINS-1)*BIN_AREA << ",";
-
-    data_stream << "microglial fibre - neural cell intersection count,";
-    for (unsigned int i = 0; i < NUM_AREA_BINS-1; i++) {
-        data_stream << i*BIN_AREA 
-                    << " <= microglial fibre - neural cell intersection area < " 
-                    << (i+1)*BIN_AREA << ",";
+
+    StackWatcher watcher(path, settle_sec);
+    if (watch) {
+        std::set<std::string> listed(input_images.begin(), input_images.end());
+        if (!watcher.start(listed)) return -1;
+        signal(SIGINT, requestStop);
+        signal(SIGTERM, requestStop);
     }
-    data_stream << "microglial fibre - neural cell intersection area >= " 
-                << (NUM_AREA_BINS-1)*BIN_AREA << ",";
-
-    data_stream << "high intensity microglial fibre count,";
-    for (unsigned int i = 0; i < NUM_AREA_BINS-1; i++) {
-        data_stream << i*BIN_AREA 
-                    << " <= high intensity microglial fibre area < " 
-                    << (i+1)*BIN_AREA << ",";
+
+    // The deques only grow; their elements are accessed under result_mutex
+    ImageWriter writer(num_writers);
+    std::deque<ImageResult> results(input_images.size());
+    std::deque<std::shared_ptr<ImageStats>> image_stats(input_images.size());
+    size_t next_index = 0;
+    bool input_closed = !watch;
+    std::mutex result_mutex;
+    std::condition_variable result_ready, input_ready;
+
+    // Claim the next stack of the list; false once the list is closed and done
+    auto claim = [&](StackJob *job) {
+        {
+            std::unique_lock<std::mutex> lock(result_mutex);
+            input_ready.wait(lock, [&]() { 
+                return input_closed || (next_index < input_images.size()); 
+            });
+            if (next_index == input_images.size()) return false;
+            job->index = next_index++;
+            job->image_name = input_images[job->index];
+            job->stats = std::make_shared<ImageStats>(job->image_name);
+            image_stats[job->index] = job->stats;
+        }
+        if (incremental) {
+            job->cache_file = path + "result/" + job->image_name + "/" + RESULT_CACHE_FILE;
+            job->cache_key = resultCacheKey(path, job->image_name, param_sets, output, exec);
+        }
+        return true;
+    };
+
+    // Reuse the results of an unchanged stack
+    auto lookup = [&](const StackJob &job, std::vector<std::vector<MetricsRow>> *metrics) {
+        bool cached = !job.cache_key.empty() && 
+                    loadResultCache(job.cache_file, job.cache_key, param_sets, metrics);
+        std::lock_guard<std::mutex> lock(result_mutex);
+        std::cout << (cached ? "Unchanged " : "Processing ") << job.image_name << std::endl;
+        return cached;
+    };
+
+    // Reserve the estimated memory of a stack, without prefetch or streamed if too large
+    std::unique_ptr<MemoryBudget> budget;
+    if (max_memory) budget.reset(new MemoryBudget(max_memory));
+    const ExecutionOptions streaming_exec = streamingOptions(exec);
+    auto admit = [&](StackJob *job, bool *prefetch) {
+        StackGeometry geometry;
+        if (!budget) return;
+        if (!stackGeometry(path, job->image_name, &geometry)) {
+            // No estimate: stream the stack and let it run alone
+            *prefetch = false;
+            job->streamed = true;
+            job->reserved = max_memory;
+            {
+                std::lock_guard<std::mutex> lock(result_mutex);
+                std::cout << "Streaming " << job->image_name 
+                          << " (size unknown, reserving the whole budget)" << std::endl;
+            }
+            budget->acquire(job->reserved);
+            return;
+        }
+        job->reserved = stackFootprint(geometry, param_sets, output, exec, *prefetch);
+        if (*prefetch && (job->reserved > max_memory)) {
+            *prefetch = false;
+            job->reserved = stackFootprint(geometry, param_sets, output, exec, false);
+        }
+        if (job->reserved > max_memory) {
+            job->streamed = true;
+            job->reserved = stackFootprint(geometry, param_sets, output, streaming_exec, false);
+            std::lock_guard<std::mutex> lock(result_mutex);
+            std::cout << "Streaming " << job->image_name << " (" << (job->reserved >> 20) 
+                      << " MiB estimated)" << std::endl;
+        }
+        budget->acquire(job->reserved);
+    };
+
+    // Process a stack; the cache is only stored once its images are written
+    auto process = [&](StackJob *job, std::vector<std::vector<MetricsRow>> *metrics) {
+        StatsScope scope(job->stats);
+        const ExecutionOptions &job_exec = job->streamed ? streaming_exec : exec;
+        const unsigned long long first_image = writer.sequence();
+        bool success = num_readers ? 
+            processStack(std::move(job->stack), path, job->image_name, param_sets, 
+                            output, job_exec, &writer, metrics) : 
+            processStack(path, job->image_name, param_sets, output, job_exec, 
+                            &writer, metrics);
+        if (success && !job->cache_key.empty()) {
+            std::string cache_file = job->cache_file, cache_key = job->cache_key;
+            std::vector<std::vector<MetricsRow>> rows = *metrics;
+            writer.onWritten([cache_file, cache_key, rows](bool written) {
+                if (written) storeResultCache(cache_file, cache_key, rows);
+            }, first_image);
+        }
+        return success;
+    };
+
+    // Hand the rows of a stack over to this thread
+    auto finish = [&](const StackJob &job, std::vector<std::vector<MetricsRow>> metrics, 
+                        bool success, std::chrono::steady_clock::time_point start) {
+        job.stats->total_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - start).count();
+        recordPeakRss(job.stats.get());
+        if (budget) budget->release(job.reserved);
+
+        std::lock_guard<std::mutex> lock(result_mutex);
+        ImageResult &result = results[job.index];
+        result.metrics = std::move(metrics);
+        result.success = success;
+        result.done = true;
+        result_ready.notify_all();
+    };
+
+    // Reader threads: look up the cache, else decode the whole stack and queue it
+    BoundedQueue<StackJob> prefetched(READER_QUEUE_DEPTH);
+    std::atomic<unsigned int> readers_running(num_readers);
+    std::vector<std::thread> readers;
+    for (unsigned int reader = 0; reader < num_readers; reader++) {
+        readers.push_back(std::thread([&]() {
+            MatPool pool;
+            PoolScope pool_scope(&pool);
+            StackJob job;
+            while (claim(&job)) {
+                auto start = std::chrono::steady_clock::now();
+                std::vector<std::vector<MetricsRow>> metrics;
+                if (lookup(job, &metrics)) {
+                    finish(job, std::move(metrics), true, start);
+                    continue;
+                }
+                bool prefetch = true;
+                admit(&job, &prefetch);
+                {
+                    StatsScope scope(job.stats);
+                    std::unique_ptr<StackReader> stack = 
+                        openImageStack(path, job.image_name, exec);
+                    if (stack && prefetch) {
+                        std::unique_ptr<CachedStackReader> decoded(
+                                new CachedStackReader(std::move(stack), false));
+                        if (decoded->preload()) job.stack = std::move(decoded);
+                    } else {
+                        job.stack = std::move(stack);
+                    }
+                }
+                job.stats->total_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                                        std::chrono::steady_clock::now() - start).count();
+                prefetched.push(std::move(job));
+                job = StackJob();
+            }
+            if (--readers_running == 0) prefetched.close();
+        }));
     }
-    data_stream << "high intensity microglial fibre area >= " 
-                << (NUM_AREA_BINS-1)*BIN_AREA << ",";
-
-    data_stream << "low intensity microglial fibre count,";
-    for (unsigned int i = 0; i < NUM_AREA_BINS-1; i++) {
-        data_stream << i*BIN_AREA 
-                    << " <= low intensity microglial fibre area < " 
-                    << (i+1)*BIN_AREA << ",";
+
+    // Worker threads: take the stacks from the readers, or claim and decode them
+    std::vector<std::thread> workers;
+    for (unsigned int job_index = 0; job_index < num_jobs; job_index++) {
+        workers.push_back(std::thread([&]() {
+            MatPool pool;
+            PoolScope pool_scope(&pool);
+            StackJob job;
+            while (num_readers ? prefetched.pop(&job) : claim(&job)) {
+                auto start = std::chrono::steady_clock::now();
+                std::vector<std::vector<MetricsRow>> metrics;
+                bool success = !num_readers && lookup(job, &metrics);
+                if (!success) {
+                    bool prefetch = false;
+                    if (!num_readers) admit(&job, &prefetch);
+                    success = process(&job, &metrics);
+                }
+                finish(job, std::move(metrics), success, start);
+                job = StackJob();
+            }
+        }));
     }
-    data_stream << "low intensity microglial fibre area >= " 
-                << (NUM_AREA_BINS-1)*BIN_AREA << ",";
 
-    data_stream << std::endl;
-    data_stream.close();
+    // Queue the stacks that settle in tiff/ until SIGINT / SIGTERM
+    std::thread watcher_thread;
+    if (watch) {
+        std::set<std::string> known(input_images.begin(), input_images.end());
+        watcher_thread = std::thread([&, known]() mutable {
+            std::ofstream list_stream(image_list_filename, std::ios::app);
+            std::vector<std::string> settled;
+            while (!stop_requested && watcher.poll(WATCH_POLL_MS, &settled)) {
+                std::lock_guard<std::mutex> lock(result_mutex);
+                for (auto &image_name : settled) {
+                    if (!known.insert(image_name).second) continue;
+                    std::cout << "Queued " << image_name << std::endl;
+                    list_stream << image_name << std::endl;
+                    input_images.push_back(image_name);
+                    results.emplace_back();
+                    image_stats.emplace_back();
+                }
+                settled.clear();
+                input_ready.notify_all();
+            }
+            std::lock_guard<std::mutex> lock(result_mutex);
+            input_closed = true;
+            input_ready.notify_all();
+            result_ready.notify_all();
+        });
+    }
 
-    /* Process each image directory */
-    for (unsigned int index = 0; index < input_images.size(); index++) {
-        std::cout << "Processing " << input_images[index] << std::endl;
-        if (!processImage(path, input_images[index], metrics_file)) {
-            err_stream << input_images[index] << std::endl;
+    for (size_t index = 0; ; index++) {
+        std::unique_lock<std::mutex> lock(result_mutex);
+        result_ready.wait(lock, [&]() { 
+            return ((index < results.size()) && results[index].done) || 
+                    (input_closed && (index >= input_images.size()));
+        });
+        if (index >= input_images.size()) break;
+        ImageResult result = std::move(results[index]);
+        std::string image_name = input_images[index];
+        lock.unlock();
+
+        if (result.success) {
+            for (size_t set = 0; set < data_streams.size(); set++) {
+                const std::vector<MetricsRow> &rows = result.metrics[set];
+                for (auto &row : rows) writeMetricsRow(row, data_streams[set].get());
+                data_streams[set]->flush();
+                if (output.cells) {
+                    for (auto &row : rows) writeCellsRows(row, cells_streams[set].get());
+                    cells_streams[set]->flush();
+                }
+                if (output.territories) {
+                    for (auto &row : rows) {
+                        writeTerritoriesRows(row, territories_streams[set].get());
+                    }
+                    territories_streams[set]->flush();
+                }
+#ifdef HAVE_ARROW
+                size_t tables = output.cells ? 2 : 1;
+                for (size_t table = 0; arrow_output && (table < tables); table++) {
+                    arrow_writers[set*tables + table]->write(rows);
+                }
+#endif
+            }
+        } else {
+            err_stream << image_name << std::endl;
+            err_stream.flush();
         }
     }
+    if (watcher_thread.joinable()) watcher_thread.join();
+    for (auto &reader : readers) reader.join();
+    for (auto &worker : workers) worker.join();
+    writer.flush();
+    for (auto &data_stream : data_streams) data_stream->close();
+    for (auto &cells_stream : cells_streams) cells_stream->close();
+    for (auto &territories_stream : territories_streams) territories_stream->close();
+#ifdef HAVE_ARROW
+    for (auto &arrow_writer : arrow_writers) arrow_writer->close();
+#endif
     err_stream.close();
 
+    /* Write the per-image timings once every queued image has been encoded */
+    std::ofstream timings_stream(shardFilename(path + "timings", ".csv", shard));
+    if (!timings_stream.is_open()) {
+        std::cerr << "Could not create the timings file." << std::endl;
+        return -1;
+    }
+    writeTimingsHeader(&timings_stream);
+    for (auto &stats : image_stats) writeTimingsRow(*stats, &timings_stream);
+    timings_stream.close();
+    if (!trace_file.empty() && !writeTrace(trace_file)) {
+        std::cerr << "Could not create the trace file." << std::endl;
+        return -1;
+    }
+
     return 0;
 }
-
@@ -0,0 +1,55 @@
+#include "mat_pool.hpp"
+
+
+/* Pool bound to this thread */
+static thread_local MatPool *current_pool = NULL;
+
+/* A buffer is free once the pool holds its only reference */
+static bool isFree(const cv::Mat &buffer) {
+    return buffer.u && (buffer.u->refcount == 1);
+}
+
+cv::Mat MatPool::acquire(cv::Size size, int type) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t evict = buffers_.size();
+    for (size_t i = 0; i < buffers_.size(); i++) {
+        if (!isFree(buffers_[i])) continue;
+        if ((buffers_[i].size() == size) && (buffers_[i].type() == type)) {
+            return buffers_[i];
+        }
+        if (evict == buffers_.size()) evict = i;
+    }
+
+    // Grow the pool, or replace a free buffer of another size or type
+    allocations_++;
+    cv::Mat buffer(size, type);
+    if (buffers_.size() < max_buffers_) {
+        buffers_.push_back(buffer);
+    } else if (evict < buffers_.size()) {
+        buffers_[evict] = buffer;
+    }
+    return buffer;
+}
+
+PoolScope::PoolScope(MatPool *pool) : previous_(current_pool) {
+    current_pool = pool;
+}
+
+PoolScope::~PoolScope() {
+    current_pool = previous_;
+}
+
+MatPool *currentPool() {
+    return current_pool;
+}
+
+cv::Mat pooledMat(cv::Size size, int type) {
+    return current_pool ? current_pool->acquire(size, type) : cv::Mat(size, type);
+}
+
+cv::Mat pooledZeros(cv::Size size, int type) {
+    cv::Mat buffer = pooledMat(size, type);
+    buffer = cv::Scalar::all(0);
+    return buffer;
+}
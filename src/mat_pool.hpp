@@ -0,0 +1,57 @@
+#ifndef MAT_POOL_HPP
+#define MAT_POOL_HPP
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+
+#define MAT_POOL_SIZE           64  // Buffers kept by a pool
+
+
+/* Pool of reusable image buffers
+ *
+ * acquire() hands out a pooled buffer of the requested size and type that
+ * nothing but the pool references anymore. A buffer still held elsewhere,
+ * e.g. queued in the ImageWriter or kept by a CachedStackReader, is never
+ * handed out again until it is released there. Thread-safe.
+ */
+class MatPool {
+public:
+    explicit MatPool(size_t max_buffers = MAT_POOL_SIZE) : max_buffers_(max_buffers) {}
+
+    /* Buffer of the given size and type, contents undefined */
+    cv::Mat acquire(cv::Size size, int type);
+
+    /* Number of buffers allocated by the pool so far */
+    size_t allocations() const { return allocations_; }
+
+private:
+    std::mutex mutex_;
+    std::vector<cv::Mat> buffers_;
+    size_t max_buffers_;
+    std::atomic<size_t> allocations_{0};
+};
+
+/* Bind a pool to the calling thread for the lifetime of the scope */
+class PoolScope {
+public:
+    explicit PoolScope(MatPool *pool);
+    ~PoolScope();
+
+private:
+    MatPool *previous_;
+};
+
+/* Pool bound to the calling thread, NULL outside of a PoolScope */
+MatPool *currentPool();
+
+/* Buffer from the pool of the calling thread, or a new one without a pool */
+cv::Mat pooledMat(cv::Size size, int type);
+
+/* Zero-filled buffer from the pool of the calling thread */
+cv::Mat pooledZeros(cv::Size size, int type);
+
+#endif // MAT_POOL_HPP
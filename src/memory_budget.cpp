@@ -0,0 +1,102 @@
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "memory_budget.hpp"
+#include "image_writer.hpp"
+
+
+/* Estimated peak memory of processing one stack, in bytes */
+unsigned long long stackFootprint(const StackGeometry &geometry, 
+                                    const std::vector<PipelineParams> &param_sets, 
+                                    const OutputOptions &output, 
+                                    const ExecutionOptions &exec, bool prefetched) {
+
+    const unsigned long long frame = 
+            static_cast<unsigned long long>(geometry.width) * geometry.height;
+    const unsigned long long sample = geometry.bytes_per_sample;
+    const unsigned long long layer = 2 * 3 * frame * sample; // the planes and the bgr original
+
+    // Decoded layers resident at once
+    unsigned long long group = 1;
+    for (auto &params : param_sets) {
+        group = std::max<unsigned long long>(group, params.num_z_layers_combined);
+    }
+    const bool sweep = (param_sets.size() > 1) && !exec.streaming;
+    unsigned long long in_flight = (exec.tasks > 1) ? 
+                        std::min<unsigned long long>(group, geometry.z_count) : 1;
+    in_flight = std::max<unsigned long long>(in_flight, 1);
+    unsigned long long resident = in_flight;
+    if (geometry.resident || prefetched || sweep) {
+        resident = std::max<unsigned long long>(geometry.z_count, in_flight);
+    }
+
+    // 5 enhanced masks per layer in flight, merged masks and intersections, labels
+    unsigned long long working = in_flight * 5 * frame * sample;
+    working += exec.packed_masks ? 2 * frame : 8 * frame;
+    working += (exec.volumetric ? 3 : 2) * 4 * frame;
+
+    // Images queued in the writer, originals included
+    unsigned long long queued = 0;
+    if (output.level == OutputLevel::FULL) queued = WRITER_QUEUE_DEPTH * 3 * frame * sample;
+    if (output.level == OutputLevel::ENHANCED) queued = WRITER_QUEUE_DEPTH * frame;
+
+    return static_cast<unsigned long long>(
+            (resident * layer + working + queued) * FOOTPRINT_MARGIN);
+}
+
+/* Options processing a stack in the least memory */
+ExecutionOptions streamingOptions(const ExecutionOptions &exec) {
+    ExecutionOptions streaming = exec;
+    streaming.streaming = true;
+    streaming.tasks = 1;
+    if ((exec.backend == Backend::CPU) && !exec.tile_size) streaming.packed_masks = true;
+    return streaming;
+}
+
+/* Parse a byte count with an optional K, M, G or T suffix (powers of 1024) */
+bool parseMemorySize(std::string text, unsigned long long *bytes) {
+
+    char *end = NULL;
+    double value = strtod(text.c_str(), &end);
+    if ((end == text.c_str()) || !(value > 0)) return false;
+    std::string suffix(end);
+    const char *units = "KMGT";
+    double scale = 1;
+    if (suffix.size() == 1) {
+        const char *unit = strchr(units, toupper(suffix[0]));
+        if (!unit) return false;
+        for (const char *u = units; u <= unit; u++) scale *= 1024;
+    } else if (!suffix.empty()) {
+        return false;
+    }
+    // Out of range, or a fraction of a byte, is rejected before the conversion
+    const double size = value * scale;
+    if ((size < 1) || (size >= static_cast<double>(ULLONG_MAX))) return false;
+    *bytes = static_cast<unsigned long long>(size);
+    return true;
+}
+
+/* Reserve bytes, blocking until they fit */
+void MemoryBudget::acquire(unsigned long long bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (bytes > limit_) {
+        oversized_waiting_++;
+        released_.wait(lock, [this]() { return !in_use_; });
+        oversized_waiting_--;
+    } else {
+        released_.wait(lock, [this, bytes]() { 
+            return !oversized_waiting_ && (in_use_ + bytes <= limit_); 
+        });
+    }
+    in_use_ += bytes;
+}
+
+/* Return bytes reserved by acquire() */
+void MemoryBudget::release(unsigned long long bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    in_use_ -= std::min(bytes, in_use_);
+    released_.notify_all();
+}
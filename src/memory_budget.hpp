@@ -0,0 +1,65 @@
+#ifndef MEMORY_BUDGET_HPP
+#define MEMORY_BUDGET_HPP
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "pipeline.hpp"
+#include "stack_reader.hpp"
+
+
+#define FOOTPRINT_MARGIN        1.25    // Headroom over the estimated buffers
+
+
+/* Estimated peak memory of processing one stack, in bytes
+ *
+ * Counts the decoded layers resident at once: one, a merge group with
+ * tasks > 1, or the whole stack for sweeps, prefetched stacks and readers
+ * that decode up front. Adds their enhanced masks, the merged masks and
+ * intersections, the segmentation labels and the images the writer may
+ * hold, then FOOTPRINT_MARGIN.
+ */
+unsigned long long stackFootprint(const StackGeometry &geometry,
+                                    const std::vector<PipelineParams> &param_sets,
+                                    const OutputOptions &output,
+                                    const ExecutionOptions &exec, bool prefetched);
+
+/* Options processing a stack in the least memory
+ *
+ * Layers are decoded one at a time, also for sweeps, which decode the stack
+ * again for each parameter set; tasks is 1 and full-frame CPU runs merge
+ * 1-bit packed masks. The metrics are unchanged.
+ */
+ExecutionOptions streamingOptions(const ExecutionOptions &exec);
+
+/* Parse a byte count with an optional K, M, G or T suffix (powers of 1024) */
+bool parseMemorySize(std::string text, unsigned long long *bytes);
+
+/* Memory budget shared by the stacks in flight
+ *
+ * acquire() blocks until the bytes fit next to the stacks already admitted.
+ * A stack larger than the whole budget is admitted alone, once every other
+ * stack is done; no other stack is admitted while it waits. Thread-safe.
+ */
+class MemoryBudget {
+public:
+    explicit MemoryBudget(unsigned long long limit) : limit_(limit) {}
+
+    /* Reserve bytes, blocking until they fit */
+    void acquire(unsigned long long bytes);
+
+    /* Return bytes reserved by acquire() */
+    void release(unsigned long long bytes);
+
+private:
+    std::mutex mutex_;
+    std::condition_variable released_;
+    unsigned long long limit_;
+    unsigned long long in_use_ = 0;
+    unsigned int oversized_waiting_ = 0;
+};
+
+#endif // MEMORY_BUDGET_HPP
@@ -0,0 +1,238 @@
+#include <stdlib.h>
+
+#include "metrics.hpp"
+#include "histogram.hpp"
+
+
+/* Names of the nucleus classes, by RegionClass */
+static const char *kRegionClassNames[] = {
+    "unclassified", "discarded", "microglial", "neural", "other"
+};
+
+/* Name of a nucleus class in the per-cell table */
+const char *regionClassName(RegionClass region_class) {
+    return kRegionClassNames[static_cast<int>(region_class)];
+}
+
+/* Split a CSV line on commas; a trailing comma does not add a field */
+static std::vector<std::string> splitFields(const std::string &line) {
+    std::vector<std::string> fields;
+    size_t begin = 0;
+    while (begin < line.size()) {
+        size_t end = line.find(',', begin);
+        if (end == std::string::npos) end = line.size();
+        fields.push_back(line.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return fields;
+}
+
+/* Parse a whole field as a number */
+static bool parseField(const std::string &field, double *value) {
+    char *end = NULL;
+    *value = strtod(field.c_str(), &end);
+    return !field.empty() && !*end;
+}
+
+/* Integer columns of a metrics row after image_layer, in file order */
+std::vector<unsigned int> metricsCounts(const MetricsRow &row) {
+
+    std::vector<unsigned int> counts = {row.total_nuclei, row.microglial_nuclei, 
+                                        row.neural_nuclei, row.other_nuclei};
+    const AreaBins *binned[] = {&row.microglial_fibres, &row.fibre_neural_intersections, 
+                                &row.red_high_fibres, &row.red_low_fibres};
+    for (auto bins : binned) {
+        counts.push_back(bins->count);
+        counts.insert(counts.end(), bins->bins.begin(), bins->bins.end());
+    }
+    return counts;
+}
+
+/* Write the header row of the metrics file */
+void writeMetricsHeader(const PipelineParams &params, std::ostream *data_stream) {
+
+    const unsigned int num_area_bins = params.num_area_bins;
+    const BinSpec spec(params);
+
+    *data_stream << "image_layer,total nuclei count,microglial nuclei count,\
+                neural nuclei count,other nuclei count,microglial fibre count,";
+
+    for (unsigned int i = 0; i < num_area_bins-1; i++) {
+        *data_stream << spec.lower(i) << " <= microglial fibre area < " 
+                    << spec.lower(i+1) << ",";
+    }
+    *data_stream << "microglial fibre area >= " 
+                << spec.lower(num_area_bins-1) << ",";
+
+    *data_stream << "microglial fibre - neural cell intersection count,";
+    for (unsigned int i = 0; i < num_area_bins-1; i++) {
+        *data_stream << spec.lower(i) 
+                    << " <= microglial fibre - neural cell intersection area < " 
+                    << spec.lower(i+1) << ",";
+    }
+    *data_stream << "microglial fibre - neural cell intersection area >= " 
+                << spec.lower(num_area_bins-1) << ",";
+
+    *data_stream << "high intensity microglial fibre count,";
+    for (unsigned int i = 0; i < num_area_bins-1; i++) {
+        *data_stream << spec.lower(i) 
+                    << " <= high intensity microglial fibre area < " 
+                    << spec.lower(i+1) << ",";
+    }
+    *data_stream << "high intensity microglial fibre area >= " 
+                << spec.lower(num_area_bins-1) << ",";
+
+    *data_stream << "low intensity microglial fibre count,";
+    for (unsigned int i = 0; i < num_area_bins-1; i++) {
+        *data_stream << spec.lower(i) 
+                    << " <= low intensity microglial fibre area < " 
+                    << spec.lower(i+1) << ",";
+    }
+    *data_stream << "low intensity microglial fibre area >= " 
+                << spec.lower(num_area_bins-1) << ",";
+
+    *data_stream << std::endl;
+}
+
+/* Write one row of the metrics file */
+void writeMetricsRow(const MetricsRow &row, std::ostream *data_stream) {
+
+    *data_stream << row.image_layer << ",";
+    for (auto count : metricsCounts(row)) *data_stream << count << ",";
+    *data_stream << std::endl;
+}
+
+/* Parse a row written by writeMetricsRow() */
+bool readMetricsRow(const std::string &line, const PipelineParams &params, MetricsRow *row) {
+
+    std::vector<std::string> fields = splitFields(line);
+    if (fields.size() != 5 + 4*(1 + params.num_area_bins)) return false;
+    std::vector<unsigned int> counts;
+    for (size_t i = 1; i < fields.size(); i++) {
+        double value;
+        if (!parseField(fields[i], &value) || (value < 0)) return false;
+        counts.push_back(static_cast<unsigned int>(value));
+    }
+
+    *row = MetricsRow();
+    row->image_layer = fields[0];
+    row->total_nuclei = counts[0];
+    row->microglial_nuclei = counts[1];
+    row->neural_nuclei = counts[2];
+    row->other_nuclei = counts[3];
+    AreaBins *binned[] = {&row->microglial_fibres, &row->fibre_neural_intersections, 
+                            &row->red_high_fibres, &row->red_low_fibres};
+    auto count = counts.begin() + 4;
+    for (auto bins : binned) {
+        bins->count = *count++;
+        bins->bins.assign(count, count + params.num_area_bins);
+        count += params.num_area_bins;
+    }
+    return true;
+}
+
+/* Write the header row of the per-cell file */
+void writeCellsHeader(std::ostream *cells_stream) {
+
+    *cells_stream << "image_layer,region,class,valid,area,hole_area,perimeter,"
+                  << "centroid_x,centroid_y,bbox_x,bbox_y,bbox_width,bbox_height,"
+                  << "red_overlap,green_overlap,z_first,z_last" << std::endl;
+}
+
+/* Write the per-cell rows of the nuclei of a metrics row */
+void writeCellsRows(const MetricsRow &row, std::ostream *cells_stream) {
+
+    const RegionTable &nuclei = row.nuclei;
+    for (size_t i = 0; i < nuclei.size(); i++) {
+        const cv::Rect &bbox = nuclei.bbox[i];
+        *cells_stream << row.image_layer << "," << i << "," 
+                      << regionClassName(nuclei.label[i]) << "," 
+                      << static_cast<int>(nuclei.valid[i]) << "," 
+                      << nuclei.area[i] << "," << nuclei.hole_area[i] << "," 
+                      << nuclei.perimeter[i] << "," 
+                      << nuclei.centroid[i].x << "," << nuclei.centroid[i].y << "," 
+                      << bbox.x << "," << bbox.y << "," 
+                      << bbox.width << "," << bbox.height << "," 
+                      << nuclei.red_overlap[i] << "," << nuclei.green_overlap[i] << "," 
+                      << nuclei.z_first[i] << "," << nuclei.z_last[i] << std::endl;
+    }
+}
+
+/* Parse a row written by writeCellsRows() and append it to the nuclei of row */
+bool readCellsRow(const std::string &line, MetricsRow *row) {
+
+    std::vector<std::string> fields = splitFields(line);
+    if ((fields.size() != 17) || (fields[0] != row->image_layer)) return false;
+    double values[17];
+    for (size_t i = 3; i < fields.size(); i++) {
+        if (!parseField(fields[i], &values[i])) return false;
+    }
+    int region_class = 0;
+    while ((region_class < 5) && (fields[2] != kRegionClassNames[region_class])) {
+        region_class++;
+    }
+    if (region_class == 5) return false;
+
+    RegionTable &nuclei = row->nuclei;
+    size_t i = nuclei.size();
+    nuclei.resize(i+1);
+    nuclei.label[i] = static_cast<RegionClass>(region_class);
+    nuclei.valid[i] = static_cast<unsigned char>(values[3]);
+    nuclei.area[i] = values[4];
+    nuclei.hole_area[i] = values[5];
+    nuclei.perimeter[i] = values[6];
+    nuclei.centroid[i] = cv::Point2f(values[7], values[8]);
+    nuclei.bbox[i] = cv::Rect(values[9], values[10], values[11], values[12]);
+    nuclei.red_overlap[i] = values[13];
+    nuclei.green_overlap[i] = values[14];
+    nuclei.z_first[i] = values[15];
+    nuclei.z_last[i] = values[16];
+    return true;
+}
+
+/* Write the header row of the per-microglia territory file */
+void writeTerritoriesHeader(const PipelineParams &params, std::ostream *territories_stream) {
+
+    *territories_stream << "image_layer,region,centroid_x,centroid_y,roi_diameter,fibre_count";
+    for (unsigned int i = 0; i < params.num_area_bins; i++) {
+        *territories_stream << ",fibre_bin_" << i;
+    }
+    *territories_stream << std::endl;
+}
+
+/* Write the territory rows of a metrics row */
+void writeTerritoriesRows(const MetricsRow &row, std::ostream *territories_stream) {
+
+    for (auto &territory : row.territories) {
+        *territories_stream << row.image_layer << "," << territory.region << "," 
+                            << territory.centroid.x << "," << territory.centroid.y << "," 
+                            << territory.roi_diameter << "," << territory.fibres.count;
+        for (auto count : territory.fibres.bins) *territories_stream << "," << count;
+        *territories_stream << std::endl;
+    }
+}
+
+/* Parse a row written by writeTerritoriesRows() and append it to the territories of row */
+bool readTerritoriesRow(const std::string &line, const PipelineParams &params, 
+                            MetricsRow *row) {
+
+    std::vector<std::string> fields = splitFields(line);
+    if ((fields.size() != 6 + params.num_area_bins) || (fields[0] != row->image_layer)) {
+        return false;
+    }
+    std::vector<double> values(fields.size());
+    for (size_t i = 1; i < fields.size(); i++) {
+        if (!parseField(fields[i], &values[i])) return false;
+    }
+
+    Territory territory;
+    territory.region = static_cast<unsigned int>(values[1]);
+    territory.centroid = cv::Point2f(values[2], values[3]);
+    territory.roi_diameter = values[4];
+    territory.fibres.count = static_cast<unsigned int>(values[5]);
+    for (size_t i = 6; i < fields.size(); i++) {
+        territory.fibres.bins.push_back(static_cast<unsigned int>(values[i]));
+    }
+    row->territories.push_back(territory);
+    return true;
+}
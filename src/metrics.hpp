@@ -0,0 +1,75 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include "config.hpp"
+#include "region_table.hpp"
+
+
+/* Count of the valid regions of a channel, and their area histogram */
+struct AreaBins {
+    unsigned int count = 0;
+    std::vector<unsigned int> bins;     // params.num_area_bins bins of params.bin_area
+};
+
+/* Red fibres in the ROI of one microglial nucleus, one row of territories.csv */
+struct Territory {
+    unsigned int region = 0;            // row of the nucleus in the nuclei of the layer
+    cv::Point2f centroid;
+    float roi_diameter = 0;
+    AreaBins fibres;
+};
+
+/* Metrics of one merged layer, one row of computed_metrics.csv */
+struct MetricsRow {
+    std::string image_layer;
+    unsigned int total_nuclei = 0;
+    unsigned int microglial_nuclei = 0;
+    unsigned int neural_nuclei = 0;
+    unsigned int other_nuclei = 0;
+    AreaBins microglial_fibres;
+    AreaBins fibre_neural_intersections;
+    AreaBins red_high_fibres;
+    AreaBins red_low_fibres;
+    RegionTable nuclei;                 // per-cell rows, only kept for --cells
+    std::vector<Territory> territories; // per-microglia rows, only kept for --territories
+};
+
+/* Name of a nucleus class in the per-cell table */
+const char *regionClassName(RegionClass region_class);
+
+/* Integer columns of a metrics row after image_layer, in file order */
+std::vector<unsigned int> metricsCounts(const MetricsRow &row);
+
+/* Write the header row of the metrics file */
+void writeMetricsHeader(const PipelineParams &params, std::ostream *data_stream);
+
+/* Write one row of the metrics file */
+void writeMetricsRow(const MetricsRow &row, std::ostream *data_stream);
+
+/* Parse a row written by writeMetricsRow() */
+bool readMetricsRow(const std::string &line, const PipelineParams &params, MetricsRow *row);
+
+/* Write the header row of the per-cell file */
+void writeCellsHeader(std::ostream *cells_stream);
+
+/* Write the per-cell rows of the nuclei of a metrics row */
+void writeCellsRows(const MetricsRow &row, std::ostream *cells_stream);
+
+/* Parse a row written by writeCellsRows() and append it to the nuclei of row */
+bool readCellsRow(const std::string &line, MetricsRow *row);
+
+/* Write the header row of the per-microglia territory file */
+void writeTerritoriesHeader(const PipelineParams &params, std::ostream *territories_stream);
+
+/* Write the territory rows of a metrics row */
+void writeTerritoriesRows(const MetricsRow &row, std::ostream *territories_stream);
+
+/* Parse a row written by writeTerritoriesRows() and append it to the territories of row */
+bool readTerritoriesRow(const std::string &line, const PipelineParams &params,
+                            MetricsRow *row);
+
+#endif // METRICS_HPP
@@ -0,0 +1,1472 @@
+#include <iostream>
+#include <sys/stat.h>
+#include <math.h>
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/photo/photo.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include "pipeline.hpp"
+#include "plane_cache.hpp"
+#include "enhance_kernels.hpp"
+#include "volume_labeler.hpp"
+#include "spatial_index.hpp"
+#include "histogram.hpp"
+#include "instrumentation.hpp"
+#include "mat_pool.hpp"
+
+
+#define DEBUG_FLAG              0   // Debug flag for image channels
+
+
+/* Enhancement chain of one channel, on cv::Mat or on cv::UMat (OpenCL) 
+ * 
+ * enhanced, src_gray and red_low_gauss are the output and the temporaries; 
+ * red_low_gauss is only used by RED_LOW. 
+ */
+template <typename MatType>
+static bool enhanceChain(const MatType &src, ChannelType channel_type, 
+                            const PipelineParams &params, MatType &enhanced, 
+                            MatType &src_gray, MatType &red_low_gauss) {
+
+    // Enhance the image using Gaussian blur and thresholding
+    switch(channel_type) {
+        case ChannelType::BLUE: {
+            // Enhance the blue channel
+
+            // Create the mask
+            cv::threshold(src, src_gray, params.blue_tozero, 255, cv::THRESH_TOZERO);
+            bitwise_not(src_gray, src_gray);
+            cv::GaussianBlur(src_gray, enhanced, cv::Size(3,3), 0, 0);
+            cv::threshold(enhanced, enhanced, params.blue_binary, 255, cv::THRESH_BINARY);
+
+            // Invert the mask
+            bitwise_not(enhanced, enhanced);
+        } break;
+
+        case ChannelType::GREEN: {
+            // Enhance the green channel
+
+            // Create the mask
+            cv::threshold(src, src_gray, params.green_tozero, 255, cv::THRESH_TOZERO);
+            bitwise_not(src_gray, src_gray);
+            cv::GaussianBlur(src_gray, enhanced, cv::Size(3,3), 0, 0);
+            cv::threshold(enhanced, enhanced, params.green_binary, 255, cv::THRESH_BINARY);
+
+            // Invert the mask
+            bitwise_not(enhanced, enhanced);
+        } break;
+
+        case ChannelType::RED: {
+            // Enhance the red channel
+
+            // Create the mask
+            cv::threshold(src, src_gray, params.red_tozero, 255, cv::THRESH_TOZERO);
+            bitwise_not(src_gray, src_gray);
+            cv::GaussianBlur(src_gray, enhanced, cv::Size(3,3), 0, 0);
+            cv::threshold(enhanced, enhanced, params.red_binary, 255, cv::THRESH_BINARY);
+
+            // Invert the mask
+            bitwise_not(enhanced, enhanced);
+        } break;
+
+        case ChannelType::RED_LOW: {
+            // Enhance the red (low) channel
+
+            // Create the mask
+            cv::threshold(src, src_gray, params.red_low_tozero, 255, cv::THRESH_TOZERO);
+            bitwise_not(src_gray, src_gray);
+            cv::GaussianBlur(src_gray, enhanced, cv::Size(3,3), 0, 0);
+            cv::threshold(enhanced, enhanced, params.red_low_binary, 255, cv::THRESH_BINARY);
+
+            // Enhance the low intensity features
+            cv::GaussianBlur(src, red_low_gauss, cv::Size(3,3), 0, 0);
+            bitwise_and(red_low_gauss, enhanced, enhanced);
+            cv::threshold(enhanced, enhanced, 250, 255, cv::THRESH_TOZERO_INV);
+            cv::threshold(enhanced, enhanced, 1, 255, cv::THRESH_BINARY);
+        } break;
+
+        case ChannelType::RED_HIGH: {
+            // Enhance the red (high) channel
+
+            // Create the mask
+            cv::threshold(src, src_gray, params.red_high_tozero, 255, cv::THRESH_TOZERO);
+            bitwise_not(src_gray, src_gray);
+            cv::GaussianBlur(src_gray, enhanced, cv::Size(3,3), 0, 0);
+            cv::threshold(enhanced, enhanced, params.red_high_binary, 255, cv::THRESH_BINARY);
+
+            // Invert the mask
+            bitwise_not(enhanced, enhanced);
+        } break;
+
+        default: {
+            std::cerr << "Invalid channel type" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Enhance the image 
+ * 
+ * 8-bit planes go through the specialized kernel of the channel type, other 
+ * types through the generic OpenCV chain. 
+ */
+bool enhanceImage(const cv::Mat &src, ChannelType channel_type, 
+                    const PipelineParams &params, cv::Mat *dst, bool specialized) {
+
+    EnhanceKernel kernel = specialized ? enhanceKernel(channel_type, src.type()) : NULL;
+    if (kernel && !src.empty()) {
+        kernel(src, params, dst);
+        return true;
+    }
+    cv::Mat enhanced = pooledMat(src.size(), src.type());
+    cv::Mat src_gray = pooledMat(src.size(), src.type());
+    cv::Mat red_low_gauss;
+    if (channel_type == ChannelType::RED_LOW) {
+        red_low_gauss = pooledMat(src.size(), src.type());
+    }
+    if (!enhanceChain(src, channel_type, params, enhanced, src_gray, red_low_gauss)) {
+        return false;
+    }
+    *dst = enhanced;
+    return true;
+}
+
+/* Reflect-101 row/column index, as used by the default OpenCV border */
+static inline int reflect101(int index, int len) {
+    if (len == 1) return 0;
+    if (index < 0) return -index;
+    if (index >= len) return 2*len - index - 2;
+    return index;
+}
+
+/* Horizontal [1 2 1] pass of the 3x3 Gaussian over columns [x0, x1) of a row 
+ * 
+ * src is indexed by image column and must be valid over [x0-1, x1] clipped 
+ * to the row; dst[0] receives column x0. 
+ */
+static inline void gaussRow(const uchar *src, int width, int x0, int x1, 
+                                unsigned short *dst) {
+    const int begin = std::max(x0, 1), end = std::min(x1, width-1);
+    for (int x = begin; x < end; x++) {
+        dst[x-x0] = src[x-1] + 2*src[x] + src[x+1];
+    }
+    if (x0 == 0) {
+        dst[0] = src[reflect101(-1, width)] + 2*src[0] + src[reflect101(1, width)];
+    }
+    if ((x1 == width) && (width > 1)) {
+        dst[width-1-x0] = 2*src[width-2] + 2*src[width-1];
+    }
+}
+
+/* Inverted THRESH_TOZERO, i.e. bitwise_not(threshold(src, thresh, TOZERO)) */
+static inline void invertedToZeroRow(const uchar *src, int width, 
+                                        uchar thresh, uchar *dst) {
+    for (int x = 0; x < width; x++) {
+        dst[x] = 255 - ((src[x] > thresh) ? src[x] : 0);
+    }
+}
+
+/* Enhance all the channels of an 8-bit z-layer over one rect in a single pass 
+ * 
+ * Equivalent to calling enhanceImage() for BLUE, GREEN, RED, RED_LOW and 
+ * RED_HIGH, but each plane is read once, the blurred intermediates of the 
+ * red plane are shared, and the five masks are written directly. The 3x3 
+ * Gaussian uses the same fixed-point rounding as OpenCV on 8-bit data, 
+ * i.e. (sum + 8) >> 4 with reflect-101 borders, so the output is bit-exact. 
+ * 
+ * Only the rect of the full-size dst masks is written; the 1 pixel halo the 
+ * Gaussian needs is read from the neighbouring input, and the borders are 
+ * reflected at the image edges only, so tiles match the full-frame result. 
+ * With ACCUMULATE the masks are OR'ed into dst, as for the z-layer merge. 
+ */
+template <bool ACCUMULATE>
+static void enhanceRectFused(const cv::Mat &blue, const cv::Mat &green, 
+                                const cv::Mat &red, 
+                                const PipelineParams &params, cv::Rect rect, 
+                                EnhancedLayer *dst) {
+
+    enum { BLUE = 0, GREEN, RED, RAW, RLOW, RHIGH, NUM_PLANES };
+    const int height = red.rows, width = red.cols;
+    const int x0 = rect.x, x1 = rect.x + rect.width, rect_width = rect.width;
+    const int halo_x0 = std::max(x0-1, 0), halo_x1 = std::min(x1+1, width);
+    const uchar blue_tozero = params.blue_tozero, green_tozero = params.green_tozero;
+    const uchar red_tozero = params.red_tozero;
+    const uchar red_low_tozero = params.red_low_tozero;
+    const uchar red_high_tozero = params.red_high_tozero;
+    const unsigned int blue_binary = params.blue_binary;
+    const unsigned int green_binary = params.green_binary;
+    const unsigned int red_binary = params.red_binary;
+    const unsigned int red_low_binary = params.red_low_binary;
+    const unsigned int red_high_binary = params.red_high_binary;
+
+    // RED_LOW and RED_HIGH share their blurred mask when thresholds agree
+    const bool shared_red_low_high = (red_low_tozero == red_high_tozero);
+    const int red_high_plane = shared_red_low_high ? RLOW : RHIGH;
+
+    // Ring of horizontally blurred rows (3 rows per intermediate plane)
+    std::vector<unsigned short> ring(3 * NUM_PLANES * rect_width);
+    std::vector<uchar> scratch(width);
+    int ring_row[3] = {-1, -1, -1};
+    auto hrow = [&](int plane, int row) {
+        return &ring[((row % 3) * NUM_PLANES + plane) * rect_width];
+    };
+    auto blur_row = [&](const uchar *src, uchar thresh, unsigned short *dst_row) {
+        invertedToZeroRow(src + halo_x0, halo_x1 - halo_x0, thresh, &scratch[halo_x0]);
+        gaussRow(scratch.data(), width, x0, x1, dst_row);
+    };
+    auto load_row = [&](int row) {
+        if (ring_row[row % 3] == row) return;
+        ring_row[row % 3] = row;
+        blur_row(blue.ptr<uchar>(row), blue_tozero, hrow(BLUE, row));
+        blur_row(green.ptr<uchar>(row), green_tozero, hrow(GREEN, row));
+        const uchar *red_row = red.ptr<uchar>(row);
+        blur_row(red_row, red_tozero, hrow(RED, row));
+        gaussRow(red_row, width, x0, x1, hrow(RAW, row));
+        blur_row(red_row, red_low_tozero, hrow(RLOW, row));
+        if (shared_red_low_high) return;
+        blur_row(red_row, red_high_tozero, hrow(RHIGH, row));
+    };
+    auto store = [](uchar *out, uchar value) {
+        *out = ACCUMULATE ? (*out | value) : value;
+    };
+
+    for (int y = rect.y; y < rect.y + rect.height; y++) {
+        const int ym = reflect101(y-1, height), yp = reflect101(y+1, height);
+        load_row(ym);
+        load_row(y);
+        load_row(yp);
+
+        const unsigned short *b[3] = {hrow(BLUE, ym), hrow(BLUE, y), hrow(BLUE, yp)};
+        const unsigned short *g[3] = {hrow(GREEN, ym), hrow(GREEN, y), hrow(GREEN, yp)};
+        const unsigned short *r[3] = {hrow(RED, ym), hrow(RED, y), hrow(RED, yp)};
+        const unsigned short *o[3] = {hrow(RAW, ym), hrow(RAW, y), hrow(RAW, yp)};
+        const unsigned short *l[3] = {hrow(RLOW, ym), hrow(RLOW, y), hrow(RLOW, yp)};
+        const unsigned short *h[3] = {hrow(red_high_plane, ym), hrow(red_high_plane, y), 
+                                        hrow(red_high_plane, yp)};
+        uchar *blue_out     = dst->blue.ptr<uchar>(y) + x0;
+        uchar *green_out    = dst->green.ptr<uchar>(y) + x0;
+        uchar *red_out      = dst->red.ptr<uchar>(y) + x0;
+        uchar *red_low_out  = dst->red_low.ptr<uchar>(y) + x0;
+        uchar *red_high_out = dst->red_high.ptr<uchar>(y) + x0;
+
+        for (int x = 0; x < rect_width; x++) {
+            unsigned int blue_gauss     = (b[0][x] + 2*b[1][x] + b[2][x] + 8) >> 4;
+            unsigned int green_gauss    = (g[0][x] + 2*g[1][x] + g[2][x] + 8) >> 4;
+            unsigned int red_gauss      = (r[0][x] + 2*r[1][x] + r[2][x] + 8) >> 4;
+            unsigned int raw_gauss      = (o[0][x] + 2*o[1][x] + o[2][x] + 8) >> 4;
+            unsigned int red_low_gauss  = (l[0][x] + 2*l[1][x] + l[2][x] + 8) >> 4;
+            unsigned int red_high_gauss = (h[0][x] + 2*h[1][x] + h[2][x] + 8) >> 4;
+
+            store(&blue_out[x], (blue_gauss <= blue_binary) ? 255 : 0);
+            store(&green_out[x], (green_gauss <= green_binary) ? 255 : 0);
+            store(&red_out[x], (red_gauss <= red_binary) ? 255 : 0);
+            store(&red_high_out[x], (red_high_gauss <= red_high_binary) ? 255 : 0);
+            store(&red_low_out[x], ((red_low_gauss > red_low_binary) && 
+                                    (raw_gauss > 1) && (raw_gauss <= 250)) ? 255 : 0);
+        }
+    }
+}
+
+/* True if the planes of a z-layer can take the fused 8-bit kernel */
+static bool fusedLayer(const cv::Mat &blue, const cv::Mat &green, 
+                        const cv::Mat &red) {
+    return (blue.type() == CV_8UC1) && (green.type() == CV_8UC1) && 
+            (red.type() == CV_8UC1) && (blue.size() == red.size()) && 
+            (green.size() == red.size()) && !red.empty();
+}
+
+/* Enhance all the channels of a z-layer */
+bool enhanceLayer(const cv::Mat &blue, const cv::Mat &green, const cv::Mat &red, 
+                    const PipelineParams &params, EnhancedLayer *dst, bool specialized) {
+
+    // Fused kernel for 8-bit planes, per-channel enhancement otherwise
+    if (specialized && fusedLayer(blue, green, red)) {
+        cv::Mat *masks[] = {&dst->blue, &dst->green, &dst->red, 
+                                &dst->red_low, &dst->red_high};
+        for (auto mask : masks) *mask = pooledMat(red.size(), CV_8UC1);
+        enhanceRectFused<false>(blue, green, red, params, 
+                                cv::Rect(0, 0, red.cols, red.rows), dst);
+        return true;
+    }
+    const ChannelType types[] = {ChannelType::BLUE, ChannelType::GREEN, ChannelType::RED, 
+                                    ChannelType::RED_LOW, ChannelType::RED_HIGH};
+    const cv::Mat *planes[] = {&blue, &green, &red, &red, &red};
+    cv::Mat *masks[] = {&dst->blue, &dst->green, &dst->red, &dst->red_low, &dst->red_high};
+    for (int channel = 0; channel < 5; channel++) {
+        if (!enhanceImage(*planes[channel], types[channel], params, masks[channel], 
+                            specialized)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Run independent stages on up to tasks threads, the calling one included 
+ * 
+ * The stages are handed out in order; their timers are charged to the image 
+ * of the calling thread and they draw from its pool. With tasks <= 1 they 
+ * run serially. 
+ */
+static void runStages(const std::vector<std::function<void()>> &stages, 
+                        unsigned int tasks) {
+
+    if ((tasks <= 1) || (stages.size() <= 1)) {
+        for (auto &stage : stages) stage();
+        return;
+    }
+    std::shared_ptr<ImageStats> stats = currentStats();
+    MatPool *pool = currentPool();
+    std::atomic<size_t> next_stage(0);
+    auto run = [&]() {
+        StatsScope scope(stats);
+        PoolScope pool_scope(pool);
+        size_t index;
+        while ((index = next_stage++) < stages.size()) stages[index]();
+    };
+    std::vector<std::future<void>> helpers;
+    size_t num_helpers = std::min<size_t>(tasks, stages.size()) - 1;
+    for (size_t i = 0; i < num_helpers; i++) {
+        helpers.push_back(std::async(std::launch::async, run));
+    }
+    run();
+    for (auto &helper : helpers) helper.get();
+}
+
+/* Channel intersections of a merged layer */
+struct LayerIntersections {
+    cv::Mat blue_red, blue_green, green_red;
+};
+
+/* Enhance an 8-bit z-layer straight into the merged masks, one tile at a time 
+ * 
+ * Each tile runs through enhance, merge and, on the last layer of a group 
+ * (intersections set), the channel intersections while it is in cache. The 
+ * masks stay full-size, so segmentation still sees whole objects and seams 
+ * need no reconciliation. The first layer of a group (!accumulate) gets new 
+ * masks, as the previous ones may still be queued in the writer. Rows of 
+ * tiles write disjoint parts of the masks and run as concurrent stages. 
+ */
+static void enhanceMergeTiled(const StackLayer &layer, const PipelineParams &params, 
+                                unsigned int tile_size, unsigned int tasks, bool accumulate, 
+                                EnhancedLayer *merged, LayerIntersections *intersections) {
+
+    const cv::Size size = layer.red.size();
+    if (!accumulate) {
+        cv::Mat *masks[] = {&merged->blue, &merged->green, &merged->red, 
+                                &merged->red_low, &merged->red_high};
+        for (auto mask : masks) *mask = pooledMat(size, CV_8UC1);
+    }
+    if (intersections) {
+        cv::Mat *masks[] = {&intersections->blue_red, &intersections->blue_green, 
+                                &intersections->green_red};
+        for (auto mask : masks) *mask = pooledMat(size, CV_8UC1);
+    }
+
+    const int tile = static_cast<int>(tile_size);
+    auto tile_row = [&](int y) {
+        for (int x = 0; x < size.width; x += tile) {
+            cv::Rect rect(x, y, std::min(tile, size.width - x), 
+                            std::min(tile, size.height - y));
+            if (accumulate) {
+                enhanceRectFused<true>(layer.blue, layer.green, layer.red, params, 
+                                        rect, merged);
+            } else {
+                enhanceRectFused<false>(layer.blue, layer.green, layer.red, params, 
+                                        rect, merged);
+            }
+            if (!intersections) continue;
+
+            cv::Mat blue_red = intersections->blue_red(rect);
+            cv::Mat blue_green = intersections->blue_green(rect);
+            cv::Mat green_red = intersections->green_red(rect);
+            bitwise_and(merged->blue(rect), merged->red(rect), blue_red);
+            bitwise_and(merged->blue(rect), merged->green(rect), blue_green);
+            bitwise_and(merged->green(rect), merged->red(rect), green_red);
+        }
+    };
+    std::vector<std::function<void()>> tile_rows;
+    for (int y = 0; y < size.height; y += tile) {
+        tile_rows.push_back([&tile_row, y]() { tile_row(y); });
+    }
+    runStages(tile_rows, tasks);
+}
+
+/* Merged masks of a group and their intersections, packed to 1 bit per pixel */
+struct PackedLayer {
+    BitMask blue, green, red, red_low, red_high;
+    BitMask blue_red, blue_green, green_red;
+};
+
+/* OR the masks of an enhanced z-layer into the packed merge */
+static void packMerge(const EnhancedLayer &enhanced, bool accumulate, PackedLayer *packed) {
+
+    packed->blue.pack(enhanced.blue, accumulate);
+    packed->green.pack(enhanced.green, accumulate);
+    packed->red.pack(enhanced.red, accumulate);
+    packed->red_low.pack(enhanced.red_low, accumulate);
+    packed->red_high.pack(enhanced.red_high, accumulate);
+}
+
+/* Enhance the z-layers of a merge group concurrently, then OR them in order 
+ * 
+ * With packed set, the masks are ORed into the packed merge instead of merged. 
+ */
+static bool enhanceMergeGroup(std::vector<StackLayer> *layers, 
+                                const PipelineParams &params, unsigned int tasks, 
+                                bool specialized, EnhancedLayer *merged, 
+                                PackedLayer *packed) {
+
+    std::vector<EnhancedLayer> enhanced(layers->size());
+    std::vector<char> enhanced_ok(layers->size(), 0);
+    std::vector<std::function<void()>> stages;
+    for (size_t i = 0; i < layers->size(); i++) {
+        stages.push_back([&, i]() {
+            ScopedTimer timer(Stage::ENHANCE);
+            StackLayer &layer = (*layers)[i];
+            enhanced_ok[i] = enhanceLayer(layer.blue, layer.green, layer.red, 
+                                            params, &enhanced[i], specialized);
+            layer = StackLayer();
+        });
+    }
+    runStages(stages, tasks);
+    for (auto ok : enhanced_ok) {
+        if (!ok) return false;
+    }
+
+    ScopedTimer timer(Stage::MERGE);
+    if (packed) {
+        for (size_t i = 0; i < enhanced.size(); i++) packMerge(enhanced[i], i != 0, packed);
+        return true;
+    }
+    *merged = enhanced[0];
+    for (size_t i = 1; i < enhanced.size(); i++) {
+        bitwise_or(enhanced[i].blue, merged->blue, merged->blue);
+        bitwise_or(enhanced[i].green, merged->green, merged->green);
+        bitwise_or(enhanced[i].red, merged->red, merged->red);
+        bitwise_or(enhanced[i].red_low, merged->red_low, merged->red_low);
+        bitwise_or(enhanced[i].red_high, merged->red_high, merged->red_high);
+    }
+    return true;
+}
+
+/* Intersect the packed merge and unpack what contour extraction needs 
+ * 
+ * The blue-red and blue-green intersections stay packed for classification 
+ * and are only unpacked to be written as debug images. 
+ */
+static void unpackMerged(PackedLayer *packed, bool debug_images, 
+                            EnhancedLayer *merged, LayerIntersections *intersections) {
+
+    BitMask::bitwiseAnd(packed->blue, packed->red, &packed->blue_red);
+    BitMask::bitwiseAnd(packed->blue, packed->green, &packed->blue_green);
+    BitMask::bitwiseAnd(packed->green, packed->red, &packed->green_red);
+
+    const struct {
+        const BitMask *src;
+        cv::Mat *dst;
+        bool needed;
+    } masks[] = {
+        {&packed->blue,         &merged->blue,              true},
+        {&packed->green,        &merged->green,             true},
+        {&packed->red,          &merged->red,               true},
+        {&packed->red_low,      &merged->red_low,           true},
+        {&packed->red_high,     &merged->red_high,          true},
+        {&packed->green_red,    &intersections->green_red,  true},
+        {&packed->blue_red,     &intersections->blue_red,   debug_images},
+        {&packed->blue_green,   &intersections->blue_green, debug_images},
+    };
+    for (auto &mask : masks) {
+        if (!mask.needed) continue;
+        *mask.dst = pooledMat(mask.src->size(), CV_8UC1);
+        mask.src->unpack(mask.dst);
+    }
+}
+
+/* Merged masks of a group, resident on the OpenCL device */
+struct DeviceLayer {
+    cv::UMat blue, green, red, red_low, red_high;
+};
+
+/* Upload a z-layer, enhance it on the OpenCL device and merge it there 
+ * 
+ * Each plane is uploaded once; the masks and the merge never leave the 
+ * device until downloadMerged(). 
+ */
+static bool enhanceMergeDevice(const StackLayer &layer, const PipelineParams &params, 
+                                bool accumulate, DeviceLayer *merged) {
+
+    cv::UMat blue, green, red;
+    layer.blue.copyTo(blue);
+    layer.green.copyTo(green);
+    layer.red.copyTo(red);
+
+    const struct {
+        ChannelType type;
+        const cv::UMat *src;
+        cv::UMat *merged;
+    } channels[] = {
+        {ChannelType::BLUE,      &blue,     &merged->blue},
+        {ChannelType::GREEN,     &green,    &merged->green},
+        {ChannelType::RED,       &red,      &merged->red},
+        {ChannelType::RED_LOW,   &red,      &merged->red_low},
+        {ChannelType::RED_HIGH,  &red,      &merged->red_high},
+    };
+    for (auto &channel : channels) {
+        cv::UMat enhanced, src_gray, red_low_gauss;
+        if (!enhanceChain(*channel.src, channel.type, params, 
+                            enhanced, src_gray, red_low_gauss)) {
+            return false;
+        }
+        if (accumulate) {
+            bitwise_or(enhanced, *channel.merged, *channel.merged);
+        } else {
+            *channel.merged = enhanced;
+        }
+    }
+    return true;
+}
+
+/* Intersect the merged masks on the device and download masks and intersections */
+static void downloadMerged(const DeviceLayer &device, EnhancedLayer *merged, 
+                            LayerIntersections *intersections) {
+
+    cv::UMat blue_red, blue_green, green_red;
+    bitwise_and(device.blue, device.red, blue_red);
+    bitwise_and(device.blue, device.green, blue_green);
+    bitwise_and(device.green, device.red, green_red);
+
+    const struct {
+        const cv::UMat *src;
+        cv::Mat *dst;
+    } masks[] = {
+        {&device.blue,      &merged->blue},
+        {&device.green,     &merged->green},
+        {&device.red,       &merged->red},
+        {&device.red_low,   &merged->red_low},
+        {&device.red_high,  &merged->red_high},
+        {&blue_red,         &intersections->blue_red},
+        {&blue_green,       &intersections->blue_green},
+        {&green_red,        &intersections->green_red},
+    };
+    for (auto &mask : masks) {
+        *mask.dst = pooledMat(mask.src->size(), mask.src->type());
+        mask.src->copyTo(*mask.dst);
+    }
+}
+
+/* Find the contours in the image 
+ * 
+ * Each outer contour is a row of the region table; its holes are the child 
+ * contours of the RETR_CCOMP hierarchy. The colored overlay of the kept 
+ * contours is only rendered when dst is set. 
+ */
+void contourCalc(const cv::Mat &src, ChannelType channel_type, 
+                    double min_area, cv::Mat *dst, 
+                    std::vector<std::vector<cv::Point>> *contours, 
+                    std::vector<cv::Vec4i> *hierarchy, 
+                    RegionTable *regions) {
+
+    cv::Mat temp_src = pooledMat(src.size(), src.type());
+    src.copyTo(temp_src);
+    switch(channel_type) {
+        case ChannelType::BLUE :
+        case ChannelType::GREEN : {
+            findContours(temp_src, *contours, *hierarchy, cv::RETR_EXTERNAL, 
+                                                        cv::CHAIN_APPROX_SIMPLE);
+        } break;
+
+        case ChannelType::RED :
+        case ChannelType::RED_LOW :
+        case ChannelType::RED_HIGH : {
+            findContours(temp_src, *contours, *hierarchy, cv::RETR_CCOMP, 
+                                                        cv::CHAIN_APPROX_SIMPLE);
+        } break;
+
+        default: return;
+    }
+
+    if (dst) *dst = pooledZeros(temp_src.size(), CV_8UC3);
+    size_t num_regions = 0;
+    for (auto &node : *hierarchy) num_regions += (node[3] < 0);
+    *regions = RegionTable();
+    regions->resize(num_regions);
+    if (!num_regions) return;
+
+    // Measure the outer contours and keep the ones whose size is >= than min_area
+    cv::RNG rng(12345);
+    size_t row = 0;
+    for (int index = 0 ; index < (int)contours->size(); index++) {
+        if ((*hierarchy)[index][3] > -1) continue; // ignore child
+        const std::vector<cv::Point> &cntr_external = (*contours)[index];
+        double area_external = fabs(contourArea(cntr_external));
+        cv::Moments moment = moments(cntr_external);
+
+        double area_hole = 0.0;
+        int index_hole = (*hierarchy)[index][2];
+        while (index_hole > -1) {
+            area_hole += fabs(contourArea((*contours)[index_hole]));
+            index_hole = (*hierarchy)[index_hole][0];
+        }
+        double area_contour = area_external - area_hole;
+
+        regions->contour[row]   = index;
+        regions->area[row]      = area_contour;
+        regions->hole_area[row] = area_hole;
+        regions->perimeter[row] = arcLength(cntr_external, true);
+        regions->bbox[row]      = boundingRect(cntr_external);
+        if (moment.m00 != 0) {
+            regions->centroid[row] = cv::Point2f(moment.m10/moment.m00, moment.m01/moment.m00);
+        }
+        regions->valid[row] = (area_external >= min_area) && (area_contour >= min_area);
+        if (dst && regions->valid[row]) {
+            cv::Scalar color = cv::Scalar(rng.uniform(0, 255), rng.uniform(0,255), 
+                                            rng.uniform(0,255));
+            drawContours(*dst, *contours, index, color, cv::FILLED, cv::LINE_8, *hierarchy);
+        }
+        row++;
+    }
+}
+
+/* Segment the image into connected components 
+ * 
+ * Single-pass alternative to contourCalc() for the channels that only need 
+ * region areas. Areas are pixel counts of 8-connected regions; holes are the 
+ * 4-connected background regions that do not touch the image border. As with 
+ * contourCalc(), RED* channels report the hole-subtracted area and BLUE/GREEN 
+ * the filled area. Each component is a row of the region table, without a 
+ * contour or perimeter. The colored overlay is only rendered when dst is set. 
+ */
+void componentCalc(const cv::Mat &src, ChannelType channel_type, 
+                    double min_area, cv::Mat *dst, RegionTable *regions) {
+
+    cv::Mat labels = pooledMat(src.size(), CV_32S), stats, centroids;
+    int num_labels = connectedComponentsWithStats(src, labels, stats, centroids, 8, CV_32S);
+    int num_regions = num_labels - 1; // label 0 is the background
+    *regions = RegionTable();
+    regions->resize(std::max(num_regions, 0));
+    if (dst) *dst = pooledZeros(src.size(), CV_8UC3);
+    if (num_regions <= 0) return;
+
+    // Holes: background regions enclosed by one foreground region
+    cv::Mat background = pooledMat(src.size(), CV_8UC1);
+    cv::Mat bg_labels = pooledMat(src.size(), CV_32S), bg_stats, bg_centroids;
+    bitwise_not(src, background);
+    int num_bg_labels = connectedComponentsWithStats(background, bg_labels, 
+                                        bg_stats, bg_centroids, 4, CV_32S);
+    for (int bg = 1; bg < num_bg_labels; bg++) {
+        int left = bg_stats.at<int>(bg, cv::CC_STAT_LEFT);
+        int top = bg_stats.at<int>(bg, cv::CC_STAT_TOP);
+        if (!left || !top || 
+                (left + bg_stats.at<int>(bg, cv::CC_STAT_WIDTH) >= src.cols) || 
+                (top + bg_stats.at<int>(bg, cv::CC_STAT_HEIGHT) >= src.rows)) {
+            continue;
+        }
+
+        // The pixel above the first hole pixel belongs to the enclosing region
+        const int *hole_row = bg_labels.ptr<int>(top);
+        int col = left;
+        while (hole_row[col] != bg) col++;
+        int region = labels.ptr<int>(top-1)[col] - 1;
+        if (region >= 0) {
+            regions->hole_area[region] += bg_stats.at<int>(bg, cv::CC_STAT_AREA);
+        }
+    }
+
+    bool filled = (channel_type == ChannelType::BLUE) || 
+                    (channel_type == ChannelType::GREEN);
+    std::vector<cv::Vec3b> colors(num_labels, cv::Vec3b());
+    cv::RNG rng(12345);
+    for (int region = 0; region < num_regions; region++) {
+        int label = region + 1;
+        double area = stats.at<int>(label, cv::CC_STAT_AREA);
+        if (filled) area += regions->hole_area[region];
+        regions->area[region] = area;
+        regions->bbox[region] = cv::Rect(stats.at<int>(label, cv::CC_STAT_LEFT), 
+                                            stats.at<int>(label, cv::CC_STAT_TOP), 
+                                            stats.at<int>(label, cv::CC_STAT_WIDTH), 
+                                            stats.at<int>(label, cv::CC_STAT_HEIGHT));
+        regions->centroid[region] = cv::Point2f(centroids.at<double>(label, 0), 
+                                                centroids.at<double>(label, 1));
+        if (area < min_area) continue;
+        regions->valid[region] = 1;
+        if (dst) {
+            for (int c = 0; c < 3; c++) {
+                colors[label][c] = static_cast<uchar>(rng.uniform(0, 255));
+            }
+        }
+    }
+
+    // Overlay of the kept regions
+    if (!dst) return;
+    for (int y = 0; y < src.rows; y++) {
+        const int *label_row = labels.ptr<int>(y);
+        cv::Vec3b *dst_row = dst->ptr<cv::Vec3b>(y);
+        for (int x = 0; x < src.cols; x++) {
+            if (label_row[x]) dst_row[x] = colors[label_row[x]];
+        }
+    }
+}
+
+/* Segment a channel that only needs region areas with the selected engine 
+ * 
+ * dst may be NULL when no consumer needs the segmented overlay. 
+ */
+void segmentCalc(SegmentEngine engine, const cv::Mat &src, 
+                    ChannelType channel_type, 
+                    double min_area, cv::Mat *dst, RegionTable *regions) {
+
+    if (engine == SegmentEngine::COMPONENTS) {
+        componentCalc(src, channel_type, min_area, dst, regions);
+    } else {
+        std::vector<std::vector<cv::Point>> contours;
+        std::vector<cv::Vec4i> hierarchy;
+        contourCalc(src, channel_type, min_area, dst, &contours, &hierarchy, regions);
+    }
+}
+
+/* Fraction of the filled contour covered by the intersection image 
+ * 
+ * The filled contour never leaves its bounding rect, so the contour is only 
+ * rasterized and compared inside that rect instead of the whole image. 
+ */
+float contourCoverage(const std::vector<std::vector<cv::Point>> &contours, 
+                        unsigned int index, const cv::Mat &intersection) {
+
+    cv::Rect rect = cv::boundingRect(contours[index]) & 
+                        cv::Rect(0, 0, intersection.cols, intersection.rows);
+    cv::Mat drawing = cv::Mat::zeros(rect.size(), CV_8UC1);
+    drawContours(drawing, contours, index, cv::Scalar::all(255), cv::FILLED, 
+                    cv::LINE_8, cv::noArray(), 0, cv::Point(-rect.x, -rect.y));
+    int contour_count_before = countNonZero(drawing);
+    cv::Mat contour_intersection;
+    bitwise_and(drawing, intersection(rect), contour_intersection);
+    int contour_count_after = countNonZero(contour_intersection);
+    return ((float)contour_count_after)/contour_count_before;
+}
+
+/* Fraction of the filled contour covered by the packed intersection mask 
+ * 
+ * The contour is rasterized in its bounding rect as for the 8-bit mask; the 
+ * covered pixels of each run of the fill are then counted with popcounts. 
+ */
+float contourCoverage(const std::vector<std::vector<cv::Point>> &contours, 
+                        unsigned int index, const BitMask &intersection) {
+
+    cv::Rect rect = cv::boundingRect(contours[index]) & 
+                        cv::Rect(0, 0, intersection.cols(), intersection.rows());
+    cv::Mat drawing = cv::Mat::zeros(rect.size(), CV_8UC1);
+    drawContours(drawing, contours, index, cv::Scalar::all(255), cv::FILLED, 
+                    cv::LINE_8, cv::noArray(), 0, cv::Point(-rect.x, -rect.y));
+    unsigned int contour_count_before = 0, contour_count_after = 0;
+    for (int y = 0; y < rect.height; y++) {
+        const uchar *fill = drawing.ptr<uchar>(y);
+        for (int x = 0; x < rect.width; ) {
+            if (!fill[x]) {
+                x++;
+                continue;
+            }
+            int run = x;
+            while ((x < rect.width) && fill[x]) x++;
+            contour_count_before += x - run;
+            contour_count_after += intersection.countRow(rect.y + y, rect.x + run, rect.x + x);
+        }
+    }
+    return ((float)contour_count_after)/contour_count_before;
+}
+
+/* Relabel the candidate rows on their coverage by the intersection image 
+ * 
+ * Rows labelled from are relabelled covered or other, and their coverage is 
+ * stored in the overlap column. Unclassified contours too small to classify 
+ * (arc length < 10 or < 5 points) are discarded. 
+ */
+template <typename MaskType>
+static void classifyCells(const std::vector<std::vector<cv::Point>> &contours, 
+                            const MaskType &intersection, double min_coverage, 
+                            RegionClass from, RegionClass covered, RegionClass other, 
+                            std::vector<float> *overlap, RegionTable *nuclei) {
+
+    for (size_t row = 0; row < nuclei->size(); row++) {
+        if (nuclei->label[row] != from) continue;
+
+        // Eliminate small contours via contour arc calculation
+        unsigned int index = nuclei->contour[row];
+        const std::vector<cv::Point> &contour = contours[index];
+        if ((from == RegionClass::UNCLASSIFIED) && 
+                ((nuclei->perimeter[row] < 10) || (contour.size() < 5))) {
+            nuclei->label[row] = RegionClass::DISCARDED;
+            continue;
+        }
+
+        float coverage_ratio = contourCoverage(contours, index, intersection);
+        (*overlap)[row] = coverage_ratio;
+        nuclei->label[row] = (coverage_ratio < min_coverage) ? other : covered;
+    }
+}
+
+/* Classify Microglial cells */
+void classifyMicroglialCells(const std::vector<std::vector<cv::Point>> &blue_contours, 
+                                const cv::Mat &blue_red_intersection, double min_coverage, 
+                                RegionTable *nuclei) {
+
+    // Microglial cells by blue-red coverage area
+    classifyCells(blue_contours, blue_red_intersection, min_coverage, 
+                    RegionClass::UNCLASSIFIED, RegionClass::MICROGLIAL, RegionClass::OTHER, 
+                    &nuclei->red_overlap, nuclei);
+}
+
+/* Classify Neural cells */
+void classifyNeuralCells(const std::vector<std::vector<cv::Point>> &blue_contours, 
+                            const cv::Mat &blue_green_intersection, double min_coverage, 
+                            RegionTable *nuclei) {
+
+    // Neural cells by blue-green coverage area
+    classifyCells(blue_contours, blue_green_intersection, min_coverage, 
+                    RegionClass::OTHER, RegionClass::NEURAL, RegionClass::OTHER, 
+                    &nuclei->green_overlap, nuclei);
+}
+
+/* Classify Microglial cells on the packed blue-red intersection */
+void classifyMicroglialCells(const std::vector<std::vector<cv::Point>> &blue_contours, 
+                                const BitMask &blue_red_intersection, double min_coverage, 
+                                RegionTable *nuclei) {
+
+    classifyCells(blue_contours, blue_red_intersection, min_coverage, 
+                    RegionClass::UNCLASSIFIED, RegionClass::MICROGLIAL, RegionClass::OTHER, 
+                    &nuclei->red_overlap, nuclei);
+}
+
+/* Classify Neural cells on the packed blue-green intersection */
+void classifyNeuralCells(const std::vector<std::vector<cv::Point>> &blue_contours, 
+                            const BitMask &blue_green_intersection, double min_coverage, 
+                            RegionTable *nuclei) {
+
+    classifyCells(blue_contours, blue_green_intersection, min_coverage, 
+                    RegionClass::OTHER, RegionClass::NEURAL, RegionClass::OTHER, 
+                    &nuclei->green_overlap, nuclei);
+}
+
+/* Group microglia area into bins */
+void binArea(const RegionTable &regions, const PipelineParams &params, AreaBins *area_bins) {
+    histogram(BinSpec(params), {areaColumn(regions, area_bins)});
+}
+
+/* Equivalent diameter of a nucleus: of the disc of its area, or in 3D of the 
+ * sphere of its voxel volume */
+static double nucleusDiameter(const RegionTable &nuclei, size_t row) {
+    if (nuclei.z_first[row] >= 0) return cbrt(6.0 * nuclei.area[row] / M_PI);
+    return 2.0 * sqrt(nuclei.area[row] / M_PI);
+}
+
+/* Red fibres within the ROI of each microglial nucleus 
+ * 
+ * The ROI is the disc of microglial_roi_factor x the mean diameter of the 
+ * microglial nuclei of the layer, centered on the nucleus; a valid fibre is 
+ * in it when its bounding box reaches into the disc. The fibre boxes are 
+ * indexed on a grid of ROI-sized cells, so each nucleus only looks at the 
+ * fibres around it. An ROI wider than the frame is queried at the frame 
+ * size; none is computed if its diameter is not positive and finite. 
+ */
+void microgliaTerritories(const RegionTable &nuclei, const RegionTable &fibres, 
+                            const PipelineParams &params, 
+                            std::vector<Territory> *territories) {
+
+    territories->clear();
+    double diameter_sum = 0;
+    unsigned int microglia = 0;
+    for (size_t i = 0; i < nuclei.size(); i++) {
+        if (nuclei.label[i] != RegionClass::MICROGLIAL) continue;
+        diameter_sum += nucleusDiameter(nuclei, i);
+        microglia++;
+    }
+    if (!microglia) return;
+    const double roi_diameter = params.microglial_roi_factor * diameter_sum / microglia;
+    if (!std::isfinite(roi_diameter) || (roi_diameter <= 0)) return;
+    const double radius = roi_diameter / 2;
+
+    // Extent of the frame the regions cover; a larger ROI reaches all of it
+    int extent = 1;
+    const RegionTable *tables[] = {&nuclei, &fibres};
+    for (auto table : tables) {
+        for (auto &box : table->bbox) {
+            extent = std::max(extent, std::max(box.x + box.width, box.y + box.height));
+        }
+    }
+    const double query_radius = std::min(radius, static_cast<double>(extent));
+
+    std::vector<cv::Rect> boxes;
+    std::vector<unsigned int> fibre_rows;
+    for (size_t i = 0; i < fibres.size(); i++) {
+        if (!fibres.valid[i]) continue;
+        boxes.push_back(fibres.bbox[i]);
+        fibre_rows.push_back(i);
+    }
+    GridIndex index;
+    index.build(boxes, static_cast<int>(ceil(2 * query_radius)));
+    const BinSpec spec(params);
+
+    std::vector<unsigned int> hits;
+    for (size_t i = 0; i < nuclei.size(); i++) {
+        if (nuclei.label[i] != RegionClass::MICROGLIAL) continue;
+        Territory territory;
+        territory.region = i;
+        territory.centroid = nuclei.centroid[i];
+        territory.roi_diameter = roi_diameter;
+        territory.fibres.bins.assign(params.num_area_bins, 0);
+
+        const double center_x = nuclei.centroid[i].x, center_y = nuclei.centroid[i].y;
+        const int x0 = static_cast<int>(floor(center_x - query_radius));
+        const int y0 = static_cast<int>(floor(center_y - query_radius));
+        const int x1 = static_cast<int>(floor(center_x + query_radius)) + 1;
+        const int y1 = static_cast<int>(floor(center_y + query_radius)) + 1;
+        index.query(cv::Rect(x0, y0, x1 - x0, y1 - y0), &hits);
+        for (auto hit : hits) {
+            // Distance from the center to the nearest pixel of the box
+            const cv::Rect &box = boxes[hit];
+            double dx = std::max(0.0, std::max(box.x - center_x, 
+                                                center_x - (box.x + box.width - 1)));
+            double dy = std::max(0.0, std::max(box.y - center_y, 
+                                                center_y - (box.y + box.height - 1)));
+            if (dx*dx + dy*dy > radius*radius) continue;
+            territory.fibres.bins[spec.bin(fibres.area[fibre_rows[hit]])]++;
+            territory.fibres.count++;
+        }
+        territories->push_back(std::move(territory));
+    }
+}
+
+/* Create a directory unless it already exists */
+static void createDirectory(std::string dir_name) {
+    struct stat st = {0};
+    if (stat(dir_name.c_str(), &st) == -1) {
+        mkdir(dir_name.c_str(), 0700);
+    }
+}
+
+/* Original image of a layer, merged back from its planes if the reader only has those */
+static cv::Mat originalImage(const StackLayer &layer) {
+    if (!layer.original.empty()) return layer.original;
+    ScopedTimer timer(Stage::SPLIT);
+    std::vector<cv::Mat> channel = {layer.blue, layer.green, layer.red};
+    cv::Mat original = pooledMat(layer.red.size(), CV_MAKETYPE(layer.red.depth(), 3));
+    cv::merge(channel, original);
+    return original;
+}
+
+/* Process the z-stack of one image with one parameter set */
+bool processImage(StackReader *stack, const std::string &out_directory, 
+                    const std::string &image_name, const PipelineParams &params, 
+                    const OutputOptions &output, const ExecutionOptions &exec, 
+                    ImageWriter *writer, std::vector<MetricsRow> *metrics) {
+
+    /* Buffer the metric rows; the caller merges them into the metrics file */
+    unsigned int z_count = stack->layerCount();
+    const unsigned int layers_combined = params.num_z_layers_combined;
+
+    /** Stream the z-layers: read, enhance and merge one layer at a time **/
+
+    EnhancedLayer merged;
+    cv::Mat &blue_merge = merged.blue, &green_merge = merged.green, &red_merge = merged.red;
+    cv::Mat &red_low_merge = merged.red_low, &red_high_merge = merged.red_high;
+    LayerIntersections intersections;
+    DeviceLayer device_merged;
+    PackedLayer packed_merged;
+    bool packed_group = false;
+    std::vector<StackLayer> group_layers;
+    const SegmentEngine segment_engine = exec.segment_engine;
+    unsigned int merged_layer_count = 0;
+    bool debug_images = DEBUG_FLAG && (output.level != OutputLevel::METRICS);
+
+    for (unsigned int z_index = 0; z_index < z_count; z_index++) {
+
+        // Read the layer; it is released before the next one is read
+        StackLayer layer;
+        if (!stack->readLayer(z_index, &layer)) {
+            return false;
+        }
+
+        // Original image
+        if ((output.level == OutputLevel::FULL) && 
+                (output.original != OriginalOutput::SKIP)) {
+            std::string out_original = out_directory + 
+                "layer_" + std::to_string(z_index+1) + "_a_original.tif";
+            if (output.original == OriginalOutput::LINK) {
+                writer->link(stack->layerFile(z_index), out_original, originalImage(layer));
+            } else {
+                writer->write(out_original, originalImage(layer));
+            }
+        }
+
+        // Gather BGR channel information needed for feature extraction
+        const bool accumulate = (z_index%layers_combined != 0);
+        const bool group_end = ((z_index+1)%layers_combined == 0) || (z_index+1 == z_count);
+        if (!accumulate) intersections = LayerIntersections();
+        packed_group = false;
+        if (exec.backend == Backend::OPENCL) {
+            {
+                ScopedTimer timer(Stage::ENHANCE);
+                if (!enhanceMergeDevice(layer, params, accumulate, &device_merged)) {
+                    return false;
+                }
+            }
+            layer = StackLayer();
+            countLayers(1);
+            if (group_end) {
+                ScopedTimer timer(Stage::MERGE);
+                downloadMerged(device_merged, &merged, &intersections);
+                device_merged = DeviceLayer();
+            }
+        } else if (exec.tile_size && fusedLayer(layer.blue, layer.green, layer.red) && 
+                (!accumulate || (blue_merge.size() == layer.red.size()))) {
+            ScopedTimer timer(Stage::ENHANCE);
+            enhanceMergeTiled(layer, params, exec.tile_size, exec.tasks, accumulate, 
+                                &merged, group_end ? &intersections : NULL);
+            layer = StackLayer();
+            countLayers(1);
+        } else if ((exec.tasks > 1) && (layers_combined > 1)) {
+            // Keep the layers of the group and enhance them together at its end
+            group_layers.push_back(layer);
+            layer = StackLayer();
+            countLayers(1);
+            if (group_end) {
+                if (!enhanceMergeGroup(&group_layers, params, exec.tasks, !exec.reference, 
+                                        &merged, exec.packed_masks ? &packed_merged : NULL)) {
+                    return false;
+                }
+                group_layers.clear();
+                if (exec.packed_masks) {
+                    ScopedTimer timer(Stage::MERGE);
+                    unpackMerged(&packed_merged, debug_images, &merged, &intersections);
+                    packed_group = true;
+                }
+            }
+        } else {
+            EnhancedLayer enhanced;
+            {
+                ScopedTimer timer(Stage::ENHANCE);
+                if (!enhanceLayer(layer.blue, layer.green, layer.red, params, &enhanced, 
+                                    !exec.reference)) {
+                    return false;
+                }
+            }
+            layer = StackLayer();
+            countLayers(1);
+            if (exec.packed_masks) {
+                ScopedTimer timer(Stage::MERGE);
+                packMerge(enhanced, accumulate, &packed_merged);
+                if (group_end) {
+                    unpackMerged(&packed_merged, debug_images, &merged, &intersections);
+                    packed_group = true;
+                }
+            } else if (accumulate) {
+                ScopedTimer timer(Stage::MERGE);
+                bitwise_or(enhanced.blue, blue_merge, blue_merge);
+                bitwise_or(enhanced.green, green_merge, green_merge);
+                bitwise_or(enhanced.red, red_merge, red_merge);
+                bitwise_or(enhanced.red_low, red_low_merge, red_low_merge);
+                bitwise_or(enhanced.red_high, red_high_merge, red_high_merge);
+            } else {
+                blue_merge = enhanced.blue;
+                green_merge = enhanced.green;
+                red_merge = enhanced.red;
+                red_low_merge = enhanced.red_low;
+                red_high_merge = enhanced.red_high;
+            }
+        }
+
+        if (group_end) {
+
+            merged_layer_count++;
+
+            // Green-red channel intersection, segmented together with the channels
+            cv::Mat &green_red_intersection = intersections.green_red;
+            if (green_red_intersection.empty()) {
+                ScopedTimer timer(Stage::MERGE);
+                green_red_intersection = pooledMat(green_merge.size(), CV_8UC1);
+                bitwise_and(green_merge, red_merge, green_red_intersection);
+            }
+
+            // Segment the channels; the calls are independent of each other
+            cv::Mat blue_segmented, green_segmented, red_segmented;
+            cv::Mat red_low_segmented, red_high_segmented;
+            std::vector<std::vector<cv::Point>> contours_blue;
+            std::vector<cv::Vec4i> hierarchy_blue;
+            RegionTable blue_regions, green_regions, red_regions;
+            RegionTable red_low_regions, red_high_regions, green_red_regions;
+
+            auto segment = [&](cv::Mat src, ChannelType channel_type, cv::Mat *dst, 
+                                RegionTable *regions) {
+                return [=, &params]() {
+                    ScopedTimer timer(Stage::SEGMENT);
+                    segmentCalc(segment_engine, src, channel_type, params.min_area, 
+                                    debug_images ? dst : NULL, regions);
+                    countContours(regions->size());
+                };
+            };
+            std::vector<std::function<void()>> segmentations;
+            segmentations.push_back([&]() {
+                ScopedTimer timer(Stage::SEGMENT);
+                contourCalc(blue_merge, ChannelType::BLUE, params.min_area, 
+                    debug_images ? &blue_segmented : NULL, 
+                    &contours_blue, &hierarchy_blue, &blue_regions);
+                countContours(blue_regions.size());
+            });
+            segmentations.push_back(segment(green_merge, ChannelType::GREEN, 
+                                &green_segmented, &green_regions));
+            segmentations.push_back(segment(red_merge, ChannelType::RED, 
+                                &red_segmented, &red_regions));
+            segmentations.push_back(segment(red_low_merge, ChannelType::RED_LOW, 
+                                &red_low_segmented, &red_low_regions));
+            segmentations.push_back(segment(red_high_merge, ChannelType::RED_HIGH, 
+                                &red_high_segmented, &red_high_regions));
+            // The green-red overlay is never written
+            segmentations.push_back(segment(green_red_intersection, ChannelType::RED, 
+                                NULL, &green_red_regions));
+            runStages(segmentations, exec.tasks);
+
+            // Channel images, enhanced and segmented
+            const struct {
+                const char *name;
+                cv::Mat enhanced, segmented;
+            } channels[] = {
+                {"blue",        blue_merge,     blue_segmented},
+                {"green",       green_merge,    green_segmented},
+                {"red",         red_merge,      red_segmented},
+                {"red_low",     red_low_merge,  red_low_segmented},
+                {"red_high",    red_high_merge, red_high_segmented},
+            };
+            for (auto &channel : channels) {
+                if (!debug_images) break;
+                std::string out_channel = out_directory + channel.name + 
+                    "_merged_layer_" + std::to_string(merged_layer_count) + "_enhanced.tif";
+                writer->write(out_channel, channel.enhanced);
+                out_channel.insert(out_channel.find_last_of("."), "_segmented", 10);
+                writer->write(out_channel, channel.segmented);
+            }
+
+
+            /** Extract multi-dimensional features for analysis **/
+
+            // Blue-red channel intersection
+            cv::Mat &blue_red_intersection = intersections.blue_red;
+            if (blue_red_intersection.empty() && !packed_group) {
+                ScopedTimer timer(Stage::MERGE);
+                blue_red_intersection = pooledMat(blue_merge.size(), CV_8UC1);
+                bitwise_and(blue_merge, red_merge, blue_red_intersection);
+            }
+            std::string out_blue_red_intersection = out_directory + 
+                "blue_red_merged_layer_" + std::to_string(merged_layer_count) + "_enhanced.tif";
+            if (debug_images) writer->write(out_blue_red_intersection, blue_red_intersection);
+
+            // Classify microglial cells
+            {
+                ScopedTimer timer(Stage::CLASSIFY);
+                if (packed_group) {
+                    classifyMicroglialCells(contours_blue, packed_merged.blue_red, 
+                                                params.microglial_coverage, &blue_regions);
+                } else {
+                    classifyMicroglialCells(contours_blue, blue_red_intersection, 
+                                                params.microglial_coverage, &blue_regions);
+                }
+            }
+            MetricsRow row;
+            row.image_layer = image_name + "_" + std::to_string(merged_layer_count);
+            row.microglial_nuclei = blue_regions.count(RegionClass::MICROGLIAL);
+            row.total_nuclei = row.microglial_nuclei + blue_regions.count(RegionClass::OTHER);
+
+            // Blue-green channel intersection
+            cv::Mat &blue_green_intersection = intersections.blue_green;
+            if (blue_green_intersection.empty() && !packed_group) {
+                ScopedTimer timer(Stage::MERGE);
+                blue_green_intersection = pooledMat(blue_merge.size(), CV_8UC1);
+                bitwise_and(blue_merge, green_merge, blue_green_intersection);
+            }
+            std::string out_blue_green_intersection = out_directory + 
+                "blue_green_merged_layer_" + std::to_string(merged_layer_count) + "_enhanced.tif";
+            if (debug_images) writer->write(out_blue_green_intersection, blue_green_intersection);
+
+            // Classify neural cells
+            {
+                ScopedTimer timer(Stage::CLASSIFY);
+                if (packed_group) {
+                    classifyNeuralCells(contours_blue, packed_merged.blue_green, 
+                                            params.neural_coverage, &blue_regions);
+                } else {
+                    classifyNeuralCells(contours_blue, blue_green_intersection, 
+                                            params.neural_coverage, &blue_regions);
+                }
+            }
+            row.neural_nuclei = blue_regions.count(RegionClass::NEURAL);
+            row.other_nuclei = blue_regions.count(RegionClass::OTHER);
+
+            // Green-red channel intersection
+            std::string out_green_red_intersection = out_directory + 
+                "green_red_merged_layer_" + std::to_string(merged_layer_count) + "_enhanced.tif";
+            if (debug_images) writer->write(out_green_red_intersection, green_red_intersection);
+
+            // Characterize microglial fibres, all intensities, and their interaction 
+            // with neural cells; the four classes are binned in one pass
+            {
+                ScopedTimer timer(Stage::BIN);
+                histogram(BinSpec(params), {
+                    areaColumn(red_regions, &row.microglial_fibres), 
+                    areaColumn(green_red_regions, &row.fibre_neural_intersections), 
+                    areaColumn(red_high_regions, &row.red_high_fibres), 
+                    areaColumn(red_low_regions, &row.red_low_fibres)});
+            }
+
+            // Fibre territories of the microglial cells
+            if (output.territories) {
+                ScopedTimer timer(Stage::BIN);
+                microgliaTerritories(blue_regions, red_regions, params, &row.territories);
+            }
+            if (output.cells) row.nuclei = blue_regions;
+            metrics->push_back(std::move(row));
+
+
+            /** Enhanced image **/
+
+            if (output.level != OutputLevel::METRICS) {
+                std::vector<cv::Mat> merge_enhanced;
+                merge_enhanced.push_back(blue_merge);
+                merge_enhanced.push_back(green_merge);
+                merge_enhanced.push_back(red_merge);
+                cv::Mat color_enhanced = pooledMat(blue_merge.size(), CV_8UC3);
+                cv::merge(merge_enhanced, color_enhanced);
+                std::string out_enhanced = out_directory + 
+                    "layer_" + std::to_string(merged_layer_count) + "_b_enhanced.tif";
+                writer->write(out_enhanced, color_enhanced);
+            }
+
+
+            /** Analyzed image **/
+
+            if (output.level == OutputLevel::FULL) {
+                cv::Mat drawing_blue  = blue_merge;
+                cv::Mat drawing_green = pooledZeros(green_merge.size(), CV_8UC1);
+                cv::Mat drawing_red   = pooledZeros(red_merge.size(), CV_8UC1);
+                if (debug_images) {
+                    drawing_blue = pooledMat(blue_merge.size(), CV_8UC1);
+                    blue_merge.copyTo(drawing_blue);
+                }
+
+                // Draw microglial cell boundaries
+                for (size_t row = 0; row < blue_regions.size(); row++) {
+                    if (blue_regions.label[row] != RegionClass::MICROGLIAL) continue;
+                    cv::RotatedRect min_ellipse = 
+                                fitEllipse(contours_blue[blue_regions.contour[row]]);
+                    ellipse(drawing_blue, min_ellipse, 255, 4, 8);
+                    ellipse(drawing_green, min_ellipse, 0, 4, 8);
+                    ellipse(drawing_red, min_ellipse, 255, 4, 8);
+                }
+
+                // Draw neural cell boundaries
+                for (size_t row = 0; row < blue_regions.size(); row++) {
+                    if (blue_regions.label[row] != RegionClass::NEURAL) continue;
+                    cv::RotatedRect min_ellipse = 
+                                fitEllipse(contours_blue[blue_regions.contour[row]]);
+                    ellipse(drawing_blue, min_ellipse, 255, 4, 8);
+                    ellipse(drawing_green, min_ellipse, 255, 4, 8);
+                    ellipse(drawing_red, min_ellipse, 0, 4, 8);
+                }
+
+                // Merge the modified red, blue and green layers
+                std::vector<cv::Mat> merge_analyzed;
+                merge_analyzed.push_back(drawing_blue);
+                merge_analyzed.push_back(drawing_green);
+                merge_analyzed.push_back(drawing_red);
+                cv::Mat color_analyzed = pooledMat(blue_merge.size(), CV_8UC3);
+                cv::merge(merge_analyzed, color_analyzed);
+                std::string out_analyzed = out_directory + 
+                    "layer_" + std::to_string(merged_layer_count) + "_c_analyzed.tif";
+                writer->write(out_analyzed, color_analyzed);
+            }
+        }
+    }
+    return true;
+}
+
+/* Label the objects of the whole z-stack of one image in 3D 
+ * 
+ * Each layer is enhanced and fed to one VolumeLabeler per channel, so the 
+ * nuclei are counted once per stack instead of once per merged layer. A 
+ * nucleus is microglial if at least microglial_coverage of its voxels are 
+ * red, else neural if neural_coverage of them are green. The fibre bins 
+ * group voxel volumes; min_area is the minimum volume. 
+ */
+bool processVolume(StackReader *stack, const std::string &image_name, 
+                    const PipelineParams &params, const OutputOptions &output, 
+                    const ExecutionOptions &exec, std::vector<MetricsRow> *metrics) {
+
+    VolumeLabeler blue_objects, red_objects, red_low_objects, red_high_objects;
+    VolumeLabeler green_red_objects;
+    unsigned int z_count = stack->layerCount();
+    for (unsigned int z_index = 0; z_index < z_count; z_index++) {
+        StackLayer layer;
+        if (!stack->readLayer(z_index, &layer)) return false;
+
+        EnhancedLayer enhanced;
+        {
+            ScopedTimer timer(Stage::ENHANCE);
+            if (!enhanceLayer(layer.blue, layer.green, layer.red, params, &enhanced, 
+                                !exec.reference)) {
+                return false;
+            }
+        }
+        layer = StackLayer();
+        countLayers(1);
+        cv::Mat green_red = pooledMat(enhanced.green.size(), CV_8UC1);
+        {
+            ScopedTimer timer(Stage::MERGE);
+            bitwise_and(enhanced.green, enhanced.red, green_red);
+        }
+
+        // The labelers are independent of each other
+        const struct {
+            VolumeLabeler *labeler;
+            cv::Mat mask;
+            const cv::Mat *red, *green;
+        } channels[] = {
+            {&blue_objects,         enhanced.blue,      &enhanced.red,  &enhanced.green},
+            {&red_objects,          enhanced.red,       NULL,           NULL},
+            {&red_low_objects,      enhanced.red_low,   NULL,           NULL},
+            {&red_high_objects,     enhanced.red_high,  NULL,           NULL},
+            {&green_red_objects,    green_red,          NULL,           NULL},
+        };
+        bool labelled[5] = {false, false, false, false, false};
+        std::vector<std::function<void()>> labelings;
+        for (size_t i = 0; i < 5; i++) {
+            labelings.push_back([&, i]() {
+                ScopedTimer timer(Stage::SEGMENT);
+                labelled[i] = channels[i].labeler->addLayer(channels[i].mask, 
+                                                channels[i].red, channels[i].green);
+            });
+        }
+        runStages(labelings, exec.tasks);
+        for (auto success : labelled) {
+            if (!success) return false;
+        }
+    }
+
+    RegionTable nuclei, red_regions, red_low_regions, red_high_regions, green_red_regions;
+    {
+        ScopedTimer timer(Stage::SEGMENT);
+        blue_objects.finish(params.min_area, &nuclei);
+        red_objects.finish(params.min_area, &red_regions);
+        red_low_objects.finish(params.min_area, &red_low_regions);
+        red_high_objects.finish(params.min_area, &red_high_regions);
+        green_red_objects.finish(params.min_area, &green_red_regions);
+        countContours(nuclei.size() + red_regions.size() + red_low_regions.size() + 
+                        red_high_regions.size() + green_red_regions.size());
+    }
+
+    // Classify the nuclei on the fractions of their voxels in red and green
+    {
+        ScopedTimer timer(Stage::CLASSIFY);
+        for (size_t i = 0; i < nuclei.size(); i++) {
+            if (!nuclei.valid[i]) {
+                nuclei.label[i] = RegionClass::DISCARDED;
+            } else if (nuclei.red_overlap[i] >= params.microglial_coverage) {
+                nuclei.label[i] = RegionClass::MICROGLIAL;
+            } else if (nuclei.green_overlap[i] >= params.neural_coverage) {
+                nuclei.label[i] = RegionClass::NEURAL;
+            } else {
+                nuclei.label[i] = RegionClass::OTHER;
+            }
+        }
+    }
+    MetricsRow row;
+    row.image_layer = image_name;
+    row.microglial_nuclei = nuclei.count(RegionClass::MICROGLIAL);
+    row.neural_nuclei = nuclei.count(RegionClass::NEURAL);
+    row.other_nuclei = nuclei.count(RegionClass::OTHER);
+    row.total_nuclei = row.microglial_nuclei + row.neural_nuclei + row.other_nuclei;
+    {
+        ScopedTimer timer(Stage::BIN);
+        histogram(BinSpec(params), {
+            areaColumn(red_regions, &row.microglial_fibres), 
+            areaColumn(green_red_regions, &row.fibre_neural_intersections), 
+            areaColumn(red_high_regions, &row.red_high_fibres), 
+            areaColumn(red_low_regions, &row.red_low_fibres)});
+    }
+    if (output.territories) {
+        ScopedTimer timer(Stage::BIN);
+        microgliaTerritories(nuclei, red_regions, params, &row.territories);
+    }
+    if (output.cells) row.nuclei = std::move(nuclei);
+    metrics->push_back(std::move(row));
+    return true;
+}
+
+/* Open the stack of an image, through the plane cache if exec has one */
+std::unique_ptr<StackReader> openImageStack(const std::string &path, 
+                                            const std::string &image_name, 
+                                            const ExecutionOptions &exec) {
+    if (exec.plane_cache.empty()) return openStack(path, image_name);
+    return openCachedStack(path, image_name, exec.plane_cache);
+}
+
+/* Process the z-stack of one image with every parameter set 
+ * 
+ * With several parameter sets (a sweep) the stack is decoded once and kept 
+ * in memory, and the outputs of each set go to result/<image>/<set name>/. 
+ * With exec.streaming it is decoded again for each set instead. 
+ */
+bool processStack(const std::string &path, const std::string &image_name, 
+                    const std::vector<PipelineParams> &param_sets, 
+                    const OutputOptions &output, const ExecutionOptions &exec, 
+                    ImageWriter *writer, 
+                    std::vector<std::vector<MetricsRow>> *metrics) {
+    return processStack(openImageStack(path, image_name, exec), path, image_name, 
+                        param_sets, output, exec, writer, metrics);
+}
+
+/* Process a stack already opened, e.g. prefetched by a reader thread */
+bool processStack(std::unique_ptr<StackReader> stack, const std::string &path, 
+                    const std::string &image_name, 
+                    const std::vector<PipelineParams> &param_sets, 
+                    const OutputOptions &output, const ExecutionOptions &exec, 
+                    ImageWriter *writer, 
+                    std::vector<std::vector<MetricsRow>> *metrics) {
+
+    if (!stack) return false;
+    bool sweep = (param_sets.size() > 1);
+    if (sweep && !exec.streaming) stack.reset(new CachedStackReader(std::move(stack)));
+
+    // Create the output directory
+    std::string out_directory = path + "result/";
+    createDirectory(out_directory);
+    out_directory = out_directory + image_name + "/";
+    createDirectory(out_directory);
+
+    metrics->assign(param_sets.size(), std::vector<MetricsRow>());
+    for (size_t set = 0; set < param_sets.size(); set++) {
+        std::string set_directory = out_directory;
+        if (sweep) {
+            set_directory += param_sets[set].name + "/";
+            createDirectory(set_directory);
+        }
+        if (set && exec.streaming) {
+            stack = openImageStack(path, image_name, exec);
+            if (!stack) return false;
+        }
+        if (exec.volumetric) {
+            if (!processVolume(stack.get(), image_name, param_sets[set], output, exec, 
+                                &(*metrics)[set])) {
+                return false;
+            }
+        } else if (!processImage(stack.get(), set_directory, image_name, param_sets[set], 
+                            output, exec, writer, &(*metrics)[set])) {
+            return false;
+        }
+    }
+    return true;
+}
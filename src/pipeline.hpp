@@ -0,0 +1,164 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include "opencv2/core/core.hpp"
+
+#include "config.hpp"
+#include "stack_reader.hpp"
+#include "image_writer.hpp"
+#include "metrics.hpp"
+#include "bit_mask.hpp"
+
+
+#define DEFAULT_TILE_SIZE       256 // Tile edge of --tile; 3 planes in, 5 masks out fit in L2
+
+
+/* Channel type */
+enum class ChannelType : unsigned char {
+    BLUE = 0,
+    GREEN,
+    RED,
+    RED_LOW,
+    RED_HIGH
+};
+
+/* Segmentation engine */
+enum class SegmentEngine : unsigned char {
+    CONTOURS = 0,   // findContours with hole subtraction
+    COMPONENTS      // connectedComponentsWithStats, pixel areas
+};
+
+/* Where enhancement, merging and the intersections run */
+enum class Backend : unsigned char {
+    CPU = 0,
+    OPENCL          // cv::UMat on the OpenCL device, masks downloaded per group
+};
+
+/* How the pipeline runs */
+struct ExecutionOptions {
+    SegmentEngine segment_engine = SegmentEngine::CONTOURS;
+    Backend backend = Backend::CPU;
+    bool packed_masks = false;      // merge and intersect 1 bit/pixel masks
+    bool volumetric = false;        // label 3D objects across the stack (--3d)
+    unsigned int tile_size = 0;     // tile edge for enhance/merge/intersect, 0 = full frame
+    unsigned int tasks = 1;         // threads working on one image
+    std::string plane_cache;        // directory of the decoded-plane cache, empty = off
+    bool streaming = false;         // never keep a whole decoded stack (--max-memory)
+    bool reference = false;         // OpenCV enhancement chain only, no fused kernels (--verify)
+};
+
+/* Enhanced masks of one z-layer */
+struct EnhancedLayer {
+    cv::Mat blue, green, red, red_low, red_high;
+};
+
+/* Enhance the image; without specialized, always through the OpenCV chain */
+bool enhanceImage(const cv::Mat &src, ChannelType channel_type,
+                    const PipelineParams &params, cv::Mat *dst, bool specialized = true);
+
+/* Enhance all the channels of a z-layer; without specialized, through the OpenCV chain */
+bool enhanceLayer(const cv::Mat &blue, const cv::Mat &green, const cv::Mat &red,
+                    const PipelineParams &params, EnhancedLayer *dst,
+                    bool specialized = true);
+
+/* Find the contours in the image; one region row per outer contour, dst is optional */
+void contourCalc(const cv::Mat &src, ChannelType channel_type,
+                    double min_area, cv::Mat *dst,
+                    std::vector<std::vector<cv::Point>> *contours,
+                    std::vector<cv::Vec4i> *hierarchy,
+                    RegionTable *regions);
+
+/* Segment the image into connected components; one region row per component, dst is optional */
+void componentCalc(const cv::Mat &src, ChannelType channel_type,
+                    double min_area, cv::Mat *dst, RegionTable *regions);
+
+/* Segment a channel that only needs region areas with the selected engine */
+void segmentCalc(SegmentEngine engine, const cv::Mat &src,
+                    ChannelType channel_type,
+                    double min_area, cv::Mat *dst, RegionTable *regions);
+
+/* Fraction of the filled contour at index covered by the intersection image */
+float contourCoverage(const std::vector<std::vector<cv::Point>> &contours,
+                        unsigned int index, const cv::Mat &intersection);
+
+/* Fraction of the filled contour covered by a packed intersection mask */
+float contourCoverage(const std::vector<std::vector<cv::Point>> &contours,
+                        unsigned int index, const BitMask &intersection);
+
+/* Classify Microglial cells
+ *
+ * nuclei holds the regions of blue_contours as found by contourCalc();
+ * unclassified rows are labelled MICROGLIAL, OTHER or DISCARDED and their
+ * red_overlap is filled in.
+ */
+void classifyMicroglialCells(const std::vector<std::vector<cv::Point>> &blue_contours,
+                                const cv::Mat &blue_red_intersection, double min_coverage,
+                                RegionTable *nuclei);
+
+/* Classify Neural cells; OTHER rows are relabelled NEURAL by their green_overlap */
+void classifyNeuralCells(const std::vector<std::vector<cv::Point>> &blue_contours,
+                            const cv::Mat &blue_green_intersection, double min_coverage,
+                            RegionTable *nuclei);
+
+/* Classify Microglial and Neural cells on packed intersection masks */
+void classifyMicroglialCells(const std::vector<std::vector<cv::Point>> &blue_contours,
+                                const BitMask &blue_red_intersection, double min_coverage,
+                                RegionTable *nuclei);
+void classifyNeuralCells(const std::vector<std::vector<cv::Point>> &blue_contours,
+                            const BitMask &blue_green_intersection, double min_coverage,
+                            RegionTable *nuclei);
+
+/* Group the area of the valid regions into bins */
+void binArea(const RegionTable &regions, const PipelineParams &params, AreaBins *area_bins);
+
+/* Red fibres within the ROI of each microglial nucleus, in nuclei order
+ *
+ * The ROI is the disc of microglial_roi_factor x the mean microglial nucleus
+ * diameter; the fibres are found through a grid index over their boxes.
+ */
+void microgliaTerritories(const RegionTable &nuclei, const RegionTable &fibres,
+                            const PipelineParams &params,
+                            std::vector<Territory> *territories);
+
+/* Process the z-stack of one image with one parameter set
+ *
+ * The metric rows are appended to metrics; the images go through writer.
+ */
+bool processImage(StackReader *stack, const std::string &out_directory,
+                    const std::string &image_name, const PipelineParams &params,
+                    const OutputOptions &output, const ExecutionOptions &exec,
+                    ImageWriter *writer, std::vector<MetricsRow> *metrics);
+
+/* Label the objects of the whole z-stack in 3D; appends one row for the stack
+ *
+ * The rows of nuclei are the 3D objects, their area the voxel volume.
+ */
+bool processVolume(StackReader *stack, const std::string &image_name,
+                    const PipelineParams &params, const OutputOptions &output,
+                    const ExecutionOptions &exec, std::vector<MetricsRow> *metrics);
+
+/* Open the stack of an image, through the plane cache if exec has one */
+std::unique_ptr<StackReader> openImageStack(const std::string &path,
+                                            const std::string &image_name,
+                                            const ExecutionOptions &exec);
+
+/* Process the z-stack of one image with every parameter set */
+bool processStack(const std::string &path, const std::string &image_name,
+                    const std::vector<PipelineParams> &param_sets,
+                    const OutputOptions &output, const ExecutionOptions &exec,
+                    ImageWriter *writer,
+                    std::vector<std::vector<MetricsRow>> *metrics);
+
+/* Process a stack already opened, e.g. prefetched by a reader thread; fails if stack is NULL */
+bool processStack(std::unique_ptr<StackReader> stack, const std::string &path,
+                    const std::string &image_name,
+                    const std::vector<PipelineParams> &param_sets,
+                    const OutputOptions &output, const ExecutionOptions &exec,
+                    ImageWriter *writer,
+                    std::vector<std::vector<MetricsRow>> *metrics);
+
+#endif // PIPELINE_HPP
@@ -0,0 +1,256 @@
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "plane_cache.hpp"
+#include "instrumentation.hpp"
+
+
+#define PLANE_ALIGN             64  // Alignment of each plane in the file
+
+static const char kMagic[8] = {'M', 'G', 'P', 'L', 'A', 'N', 'E', 'S'};
+
+/* Start of a plane cache file
+ *
+ * The key and the '\n'-terminated layer file names follow; the planes start
+ * at data_offset, z-layer by z-layer in blue, green, red order.
+ */
+struct PlaneCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t z_count;
+    uint32_t rows, cols;
+    uint32_t type;              // CV_8UC1 or CV_16UC1
+    uint32_t reserved;
+    uint64_t key_size;
+    uint64_t names_size;
+    uint64_t plane_stride;      // bytes from one plane to the next
+    uint64_t data_offset;
+};
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+/* Stack read from a mapped plane cache file */
+class MappedPlaneReader : public StackReader {
+public:
+    ~MappedPlaneReader() {
+        if (base_) munmap(base_, size_);
+    }
+
+    /* Map the cache file; false if it is missing, damaged or not for key */
+    bool map(const std::string &filename, const std::string &key) {
+
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return false;
+        struct stat st = {0};
+        if ((fstat(fd, &st) == -1) || (st.st_size < (off_t)sizeof(PlaneCacheHeader))) {
+            close(fd);
+            return false;
+        }
+        void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) return false;
+        base_ = base;
+        size_ = st.st_size;
+
+        const char *bytes = static_cast<const char *>(base_);
+        memcpy(&header_, bytes, sizeof(header_));
+        const uint64_t key_offset = sizeof(header_);
+        const uint64_t names_offset = key_offset + header_.key_size;
+        if (memcmp(header_.magic, kMagic, sizeof(kMagic)) ||
+                (header_.version != PLANE_CACHE_VERSION) ||
+                ((header_.type != CV_8UC1) && (header_.type != CV_16UC1)) ||
+                (header_.key_size != key.size()) ||
+                (header_.data_offset < names_offset + header_.names_size) ||
+                (header_.data_offset + 3ULL*header_.z_count*header_.plane_stride > size_) ||
+                (header_.plane_stride < (uint64_t)header_.rows*header_.cols*
+                                            CV_ELEM_SIZE(header_.type)) ||
+                memcmp(bytes + key_offset, key.data(), key.size())) {
+            return false;
+        }
+
+        std::string names(bytes + names_offset, header_.names_size);
+        for (size_t begin = 0; begin < names.size(); ) {
+            size_t end = names.find('\n', begin);
+            if (end == std::string::npos) break;
+            files_.push_back(names.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        madvise(base_, size_, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    unsigned int layerCount() const { return header_.z_count; }
+
+    bool readLayer(unsigned int z_index, StackLayer *layer) {
+
+        if (z_index >= header_.z_count) return false;
+        uchar *plane = static_cast<uchar *>(base_) + header_.data_offset +
+                        3ULL*z_index*header_.plane_stride;
+        layer->original = cv::Mat();
+        layer->blue  = cv::Mat(header_.rows, header_.cols, header_.type, plane);
+        layer->green = cv::Mat(header_.rows, header_.cols, header_.type,
+                                plane + header_.plane_stride);
+        layer->red   = cv::Mat(header_.rows, header_.cols, header_.type,
+                                plane + 2*header_.plane_stride);
+        countBytesRead(3ULL*header_.rows*header_.cols*CV_ELEM_SIZE(header_.type));
+        return true;
+    }
+
+    std::string layerFile(unsigned int z_index) const {
+        return (z_index < files_.size()) ? files_[z_index] : std::string();
+    }
+
+private:
+    void *base_ = NULL;
+    size_t size_ = 0;
+    PlaneCacheHeader header_;
+    std::vector<std::string> files_;
+};
+
+/* Reader that records the planes of another reader into a plane cache file */
+class PlaneRecorder : public StackReader {
+public:
+    PlaneRecorder(std::unique_ptr<StackReader> reader, std::string filename, std::string key)
+        : reader_(std::move(reader)), filename_(filename),
+            temp_filename_(filename + ".tmp." + std::to_string(getpid())), key_(key) {}
+
+    ~PlaneRecorder() {
+        abandon();
+    }
+
+    unsigned int layerCount() const { return reader_->layerCount(); }
+
+    bool readLayer(unsigned int z_index, StackLayer *layer) {
+        if (!reader_->readLayer(z_index, layer)) return false;
+        record(z_index, *layer);
+        return true;
+    }
+
+    std::string layerFile(unsigned int z_index) const { return reader_->layerFile(z_index); }
+
+private:
+    /* Append the planes of the next layer; publish the file after the last one */
+    void record(unsigned int z_index, const StackLayer &layer) {
+
+        if (failed_) return;
+        if ((z_index != next_z_) || (!z_index && !begin(layer))) {
+            abandon();
+            return;
+        }
+        const cv::Mat *planes[] = {&layer.blue, &layer.green, &layer.red};
+        for (auto plane : planes) {
+            if ((plane->rows != (int)header_.rows) || (plane->cols != (int)header_.cols) ||
+                    ((uint32_t)plane->type() != header_.type)) {
+                abandon();
+                return;
+            }
+            const size_t row_bytes = plane->cols * plane->elemSize();
+            for (int y = 0; y < plane->rows; y++) {
+                if (fwrite(plane->ptr(y), 1, row_bytes, file_) != row_bytes) {
+                    abandon();
+                    return;
+                }
+            }
+            if (!pad(header_.plane_stride - row_bytes*plane->rows)) return;
+        }
+
+        if (++next_z_ < header_.z_count) return;
+        bool written = !fflush(file_) && !ferror(file_);
+        written = !fclose(file_) && written;
+        file_ = NULL;
+        if (!written || (rename(temp_filename_.c_str(), filename_.c_str()) == -1)) {
+            std::cerr << "Could not write the plane cache '" << filename_ << "'" << std::endl;
+            remove(temp_filename_.c_str());
+        }
+        failed_ = true; // done, nothing more to record
+    }
+
+    /* Create the file and write everything up to the first plane */
+    bool begin(const StackLayer &layer) {
+
+        if ((layer.blue.type() != CV_8UC1) && (layer.blue.type() != CV_16UC1)) return false;
+        file_ = fopen(temp_filename_.c_str(), "wb");
+        if (!file_) {
+            std::cerr << "Could not create '" << temp_filename_ << "'" << std::endl;
+            return false;
+        }
+
+        std::string names;
+        for (unsigned int z = 0; z < reader_->layerCount(); z++) {
+            names += reader_->layerFile(z) + "\n";
+        }
+        memset(&header_, 0, sizeof(header_));
+        memcpy(header_.magic, kMagic, sizeof(kMagic));
+        header_.version = PLANE_CACHE_VERSION;
+        header_.z_count = reader_->layerCount();
+        header_.rows = layer.blue.rows;
+        header_.cols = layer.blue.cols;
+        header_.type = layer.blue.type();
+        header_.key_size = key_.size();
+        header_.names_size = names.size();
+        header_.plane_stride = alignUp((uint64_t)header_.rows*header_.cols*
+                                        layer.blue.elemSize(), PLANE_ALIGN);
+        header_.data_offset = alignUp(sizeof(header_) + key_.size() + names.size(),
+                                        PLANE_ALIGN);
+        if ((fwrite(&header_, sizeof(header_), 1, file_) != 1) ||
+                (fwrite(key_.data(), 1, key_.size(), file_) != key_.size()) ||
+                (fwrite(names.data(), 1, names.size(), file_) != names.size())) {
+            return false;
+        }
+        return pad(header_.data_offset - sizeof(header_) - key_.size() - names.size());
+    }
+
+    /* Write zero bytes up to the next aligned offset */
+    bool pad(uint64_t bytes) {
+        static const char zeros[PLANE_ALIGN] = {0};
+        if (fwrite(zeros, 1, bytes, file_) == bytes) return true;
+        abandon();
+        return false;
+    }
+
+    /* Stop recording and drop the partial file */
+    void abandon() {
+        failed_ = true;
+        if (!file_) return;
+        fclose(file_);
+        file_ = NULL;
+        remove(temp_filename_.c_str());
+    }
+
+    std::unique_ptr<StackReader> reader_;
+    std::string filename_, temp_filename_, key_;
+    FILE *file_ = NULL;
+    PlaneCacheHeader header_;
+    unsigned int next_z_ = 0;
+    bool failed_ = false;
+};
+
+/* Open the stack of an image through its decoded-plane cache */
+std::unique_ptr<StackReader> openCachedStack(std::string path, std::string image_name,
+                                                std::string cache_dir) {
+
+    // The cache directory may be shared by datasets; the key names the dataset
+    std::string key = stackInputsKey(path, image_name);
+    char *dataset = realpath(path.c_str(), NULL);
+    if (!dataset) key.clear();
+    if (!key.empty()) key = std::string("dataset ") + dataset + "\n" + key;
+    free(dataset);
+    std::string filename = cache_dir + image_name + PLANE_CACHE_EXTENSION;
+    if (!key.empty()) {
+        std::unique_ptr<MappedPlaneReader> mapped(new MappedPlaneReader());
+        if (mapped->map(filename, key)) return std::move(mapped);
+    }
+
+    std::unique_ptr<StackReader> reader = openStack(path, image_name);
+    if (!reader || key.empty()) return reader;
+    return std::unique_ptr<StackReader>(new PlaneRecorder(std::move(reader), filename, key));
+}
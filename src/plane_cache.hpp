@@ -0,0 +1,27 @@
+#ifndef PLANE_CACHE_HPP
+#define PLANE_CACHE_HPP
+
+#include <memory>
+#include <string>
+
+#include "stack_reader.hpp"
+
+
+#define PLANE_CACHE_EXTENSION   ".planes"
+#define PLANE_CACHE_VERSION     1   // Bump when the file layout changes
+
+
+/* Open the stack of an image through its decoded-plane cache
+ *
+ * <cache_dir>/<image>.planes holds the decoded, split planes of the stack in
+ * raw form. If it is current for the input files, the file is mapped and
+ * the layers are cv::Mat headers into the mapping: no decode, no split, no
+ * copy. The planes stay valid while the reader lives and must not be
+ * modified. Otherwise the stack is opened with openStack() and its planes
+ * are recorded as the layers are read; the cache is only published once
+ * every layer has been read in order.
+ */
+std::unique_ptr<StackReader> openCachedStack(std::string path, std::string image_name,
+                                                std::string cache_dir);
+
+#endif // PLANE_CACHE_HPP
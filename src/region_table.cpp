@@ -0,0 +1,25 @@
+#include "region_table.hpp"
+
+
+/* Resize every column, new rows are unmeasured */
+void RegionTable::resize(size_t rows) {
+    contour.resize(rows, -1);
+    area.resize(rows, 0.0);
+    hole_area.resize(rows, 0.0);
+    perimeter.resize(rows, -1.0);
+    bbox.resize(rows, cv::Rect());
+    centroid.resize(rows, cv::Point2f(-1.0f, -1.0f));
+    z_first.resize(rows, -1);
+    z_last.resize(rows, -1);
+    valid.resize(rows, 0);
+    label.resize(rows, RegionClass::UNCLASSIFIED);
+    red_overlap.resize(rows, -1.0f);
+    green_overlap.resize(rows, -1.0f);
+}
+
+/* Number of rows of a class */
+size_t RegionTable::count(RegionClass region_class) const {
+    size_t rows = 0;
+    for (auto row_class : label) rows += (row_class == region_class);
+    return rows;
+}
@@ -0,0 +1,48 @@
+#ifndef REGION_TABLE_HPP
+#define REGION_TABLE_HPP
+
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+
+/* Class of a nucleus region */
+enum class RegionClass : unsigned char {
+    UNCLASSIFIED = 0,
+    DISCARDED,      // too small to classify
+    MICROGLIAL,
+    NEURAL,
+    OTHER
+};
+
+/* Regions of one channel of a merged layer, one column per attribute
+ *
+ * Row i is the i-th region (an outer contour, or a connected component;
+ * with --3d an object across the stack, whose area is its voxel volume).
+ * Holes are not rows; their area is summed into hole_area of the region
+ * around them. valid marks the regions kept by min_area, i.e. the ones
+ * that get binned. Columns that a stage did not measure hold -1.
+ */
+struct RegionTable {
+    std::vector<int> contour;               // index into the contours, -1 for components
+    std::vector<double> area;               // hole-subtracted for RED*, filled otherwise
+    std::vector<double> hole_area;
+    std::vector<double> perimeter;          // outer contour length, -1 for components
+    std::vector<cv::Rect> bbox;
+    std::vector<cv::Point2f> centroid;
+    std::vector<int> z_first, z_last;       // z-layers of a 3D object, -1 in 2D
+    std::vector<unsigned char> valid;       // area >= min_area
+    std::vector<RegionClass> label;
+    std::vector<float> red_overlap;         // fraction in the blue-red intersection
+    std::vector<float> green_overlap;       // fraction in the blue-green intersection
+
+    size_t size() const { return area.size(); }
+
+    /* Resize every column, new rows are unmeasured */
+    void resize(size_t rows);
+
+    /* Number of rows of a class */
+    size_t count(RegionClass region_class) const;
+};
+
+#endif // REGION_TABLE_HPP
@@ -0,0 +1,121 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+
+#include "result_cache.hpp"
+
+
+/* Line separating the key from the cached rows */
+static const char *kKeyEnd = "end key";
+
+/* Key of the cached results of an image */
+std::string resultCacheKey(const std::string &path, const std::string &image_name,
+                            const std::vector<PipelineParams> &param_sets,
+                            const OutputOptions &output, const ExecutionOptions &exec) {
+
+    std::string inputs = stackInputsKey(path, image_name);
+    if (inputs.empty()) return std::string();
+
+    std::ostringstream key;
+    key << "version " << RESULT_CACHE_VERSION << std::endl << inputs;
+    key << "segment " << static_cast<int>(exec.segment_engine) << std::endl;
+    key << "backend " << static_cast<int>(exec.backend) << std::endl;
+    key << "volumetric " << exec.volumetric << std::endl;
+    key << "output " << static_cast<int>(output.level) << " "
+        << static_cast<int>(output.original) << " " << output.cells << " " 
+        << output.territories << std::endl;
+    for (auto &params : param_sets) {
+        key << "[" << params.name << "]" << std::endl;
+        writeParams(params, &key);
+    }
+    return key.str();
+}
+
+/* Load the metric rows of every parameter set if the cache holds key
+ *
+ * The file holds the key, then per parameter set 'set <rows>' followed by
+ * the rows, each a computed_metrics.csv row, 'cells <rows>' cells.csv rows
+ * and 'territories <rows>' territories.csv rows.
+ */
+bool loadResultCache(const std::string &filename, const std::string &key,
+                        const std::vector<PipelineParams> &param_sets,
+                        std::vector<std::vector<MetricsRow>> *metrics) {
+
+    std::ifstream cache_stream(filename);
+    if (!cache_stream.is_open()) return false;
+
+    std::string line, cached_key;
+    while (std::getline(cache_stream, line) && (line != kKeyEnd)) cached_key += line + "\n";
+    if ((line != kKeyEnd) || (cached_key != key)) return false;
+
+    std::vector<std::vector<MetricsRow>> rows(param_sets.size());
+    for (size_t set = 0; set < param_sets.size(); set++) {
+        unsigned int num_rows = 0;
+        if (!std::getline(cache_stream, line) ||
+                (sscanf(line.c_str(), "set %u", &num_rows) != 1)) {
+            return false;
+        }
+        rows[set].resize(num_rows);
+        for (auto &row : rows[set]) {
+            unsigned int num_cells = 0;
+            if (!std::getline(cache_stream, line) ||
+                    !readMetricsRow(line, param_sets[set], &row)) {
+                return false;
+            }
+            if (!std::getline(cache_stream, line) ||
+                    (sscanf(line.c_str(), "cells %u", &num_cells) != 1)) {
+                return false;
+            }
+            for (unsigned int cell = 0; cell < num_cells; cell++) {
+                if (!std::getline(cache_stream, line) || !readCellsRow(line, &row)) {
+                    return false;
+                }
+            }
+            unsigned int num_territories = 0;
+            if (!std::getline(cache_stream, line) ||
+                    (sscanf(line.c_str(), "territories %u", &num_territories) != 1)) {
+                return false;
+            }
+            for (unsigned int territory = 0; territory < num_territories; territory++) {
+                if (!std::getline(cache_stream, line) ||
+                        !readTerritoriesRow(line, param_sets[set], &row)) {
+                    return false;
+                }
+            }
+        }
+    }
+    *metrics = std::move(rows);
+    return true;
+}
+
+/* Store the metric rows under key, replacing the cache file atomically */
+bool storeResultCache(const std::string &filename, const std::string &key,
+                        const std::vector<std::vector<MetricsRow>> &metrics) {
+
+    std::string temp_filename = filename + ".tmp";
+    std::ofstream cache_stream(temp_filename);
+    if (!cache_stream.is_open()) {
+        std::cerr << "Could not create '" << temp_filename << "'" << std::endl;
+        return false;
+    }
+    cache_stream.precision(17);
+    cache_stream << key << kKeyEnd << std::endl;
+    for (auto &rows : metrics) {
+        cache_stream << "set " << rows.size() << std::endl;
+        for (auto &row : rows) {
+            writeMetricsRow(row, &cache_stream);
+            cache_stream << "cells " << row.nuclei.size() << std::endl;
+            writeCellsRows(row, &cache_stream);
+            cache_stream << "territories " << row.territories.size() << std::endl;
+            writeTerritoriesRows(row, &cache_stream);
+        }
+    }
+    cache_stream.close();
+    if (!cache_stream || (rename(temp_filename.c_str(), filename.c_str()) == -1)) {
+        std::cerr << "Could not write '" << filename << "'" << std::endl;
+        remove(temp_filename.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,36 @@
+#ifndef RESULT_CACHE_HPP
+#define RESULT_CACHE_HPP
+
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "metrics.hpp"
+#include "pipeline.hpp"
+
+
+#define RESULT_CACHE_FILE       "metrics_cache.dat" // Under result/<image>/
+#define RESULT_CACHE_VERSION    3   // Bump when the cached rows change meaning
+
+
+/* Key of the cached results of an image
+ *
+ * Lists the size and mtime of each input file of the stack, the parameter
+ * sets and the options that change what is written, including the backend.
+ * The tile size and task count are left out as they do not change the
+ * results. Empty if the inputs of the stack cannot be listed.
+ */
+std::string resultCacheKey(const std::string &path, const std::string &image_name,
+                            const std::vector<PipelineParams> &param_sets,
+                            const OutputOptions &output, const ExecutionOptions &exec);
+
+/* Load the metric rows of every parameter set if the cache holds key */
+bool loadResultCache(const std::string &filename, const std::string &key,
+                        const std::vector<PipelineParams> &param_sets,
+                        std::vector<std::vector<MetricsRow>> *metrics);
+
+/* Store the metric rows under key, replacing the cache file atomically */
+bool storeResultCache(const std::string &filename, const std::string &key,
+                        const std::vector<std::vector<MetricsRow>> &metrics);
+
+#endif // RESULT_CACHE_HPP
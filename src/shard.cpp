@@ -0,0 +1,153 @@
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "shard.hpp"
+
+
+/* Parse 'i/N' with 0 <= i < N */
+bool parseShard(const std::string &value, ShardOptions *shard) {
+
+    size_t separator = value.find('/');
+    if (separator == std::string::npos) return false;
+    std::string index = value.substr(0, separator), count = value.substr(separator+1);
+    char *end = NULL;
+    long parsed_index = strtol(index.c_str(), &end, 10);
+    if (index.empty() || *end) return false;
+    long parsed_count = strtol(count.c_str(), &end, 10);
+    if (count.empty() || *end) return false;
+    if ((parsed_count < 1) || (parsed_index < 0) || (parsed_index >= parsed_count)) {
+        return false;
+    }
+    shard->index = static_cast<unsigned int>(parsed_index);
+    shard->count = static_cast<unsigned int>(parsed_count);
+    return true;
+}
+
+/* Keep the images of image_list.dat that belong to the shard, in list order */
+std::vector<std::string> shardImages(const std::vector<std::string> &input_images,
+                                        const ShardOptions &shard) {
+    std::vector<std::string> images;
+    for (size_t k = shard.index; k < input_images.size(); k += shard.count) {
+        images.push_back(input_images[k]);
+    }
+    return images;
+}
+
+/* Output file of a shard */
+std::string shardFilename(const std::string &base, const std::string &extension,
+                            const ShardOptions &shard) {
+    if (shard.count <= 1) return base + extension;
+    return base + "_shard_" + std::to_string(shard.index) + "_of_" +
+                std::to_string(shard.count) + extension;
+}
+
+/* Whether a row belongs to the image */
+static bool rowOfImage(const std::string &line, const std::string &image_name) {
+
+    if (line.compare(0, image_name.size(), image_name)) return false;
+    size_t pos = image_name.size();
+    if ((pos < line.size()) && (line[pos] == ',')) return true;
+    if ((pos >= line.size()) || (line[pos] != '_')) return false;
+    size_t digits = ++pos;
+    while ((pos < line.size()) && isdigit(static_cast<unsigned char>(line[pos]))) pos++;
+    return (pos > digits) && (pos < line.size()) && (line[pos] == ',');
+}
+
+/* Merge the shards of one CSV file back into image_list.dat order */
+static bool mergeFile(const std::string &path, const std::vector<std::string> &input_images,
+                        unsigned int shard_count, const ShardedFile &file) {
+
+    // Open every shard; a file is skipped if none of its shards exist
+    std::vector<std::unique_ptr<std::ifstream>> shards;
+    std::vector<std::string> shard_names;
+    unsigned int missing = 0;
+    for (unsigned int i = 0; i < shard_count; i++) {
+        ShardOptions shard;
+        shard.index = i;
+        shard.count = shard_count;
+        shard_names.push_back(shardFilename(path + file.base, ".csv", shard));
+        shards.push_back(std::unique_ptr<std::ifstream>(new std::ifstream(shard_names.back())));
+        if (!shards.back()->is_open()) missing++;
+    }
+    if ((missing == shard_count) && !file.required) return true;
+    for (unsigned int i = 0; i < shard_count; i++) {
+        if (shards[i]->is_open()) continue;
+        std::cerr << "Could not open '" << shard_names[i] << "'" << std::endl;
+        return false;
+    }
+
+    // The shards share the header of the unsharded file
+    std::vector<std::string> next_line(shard_count);
+    std::vector<bool> has_line(shard_count);
+    std::string header;
+    for (unsigned int i = 0; i < shard_count; i++) {
+        std::string shard_header;
+        std::getline(*shards[i], shard_header);
+        if (!i) header = shard_header;
+        if (shard_header != header) {
+            std::cerr << "Header of '" << shard_names[i] << "' does not match" << std::endl;
+            return false;
+        }
+        has_line[i] = static_cast<bool>(std::getline(*shards[i], next_line[i]));
+    }
+
+    std::string merged_name = path + file.base + ".csv";
+    std::ofstream merged(merged_name);
+    if (!merged.is_open()) {
+        std::cerr << "Could not create '" << merged_name << "'" << std::endl;
+        return false;
+    }
+    merged << header << std::endl;
+    for (size_t k = 0; k < input_images.size(); k++) {
+        unsigned int i = k % shard_count;
+        while (has_line[i] && rowOfImage(next_line[i], input_images[k])) {
+            merged << next_line[i] << std::endl;
+            has_line[i] = static_cast<bool>(std::getline(*shards[i], next_line[i]));
+        }
+    }
+    for (unsigned int i = 0; i < shard_count; i++) {
+        if (!has_line[i]) continue;
+        std::cerr << "'" << shard_names[i] << "' has rows of images that are not in "
+                  << "image_list.dat, or not in its order" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* Merge the outputs of shard_count shards into the files of an unsharded run */
+bool mergeShards(const std::string &path, const std::vector<std::string> &input_images,
+                    unsigned int shard_count, const std::vector<ShardedFile> &files) {
+
+    for (auto &file : files) {
+        if (!mergeFile(path, input_images, shard_count, file)) return false;
+    }
+
+    // Failed images, in list order
+    std::set<std::string> failed;
+    for (unsigned int i = 0; i < shard_count; i++) {
+        ShardOptions shard;
+        shard.index = i;
+        shard.count = shard_count;
+        std::string err_name = shardFilename(path + "err_list", ".dat", shard);
+        std::ifstream err_stream(err_name);
+        if (!err_stream.is_open()) {
+            std::cerr << "Could not open '" << err_name << "'" << std::endl;
+            return false;
+        }
+        std::string image_name;
+        while (std::getline(err_stream, image_name)) failed.insert(image_name);
+    }
+    std::ofstream err_stream(path + "err_list.dat");
+    if (!err_stream.is_open()) {
+        std::cerr << "Could not open the error log file." << std::endl;
+        return false;
+    }
+    for (auto &image_name : input_images) {
+        if (failed.count(image_name)) err_stream << image_name << std::endl;
+    }
+    return true;
+}
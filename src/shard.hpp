@@ -0,0 +1,45 @@
+#ifndef SHARD_HPP
+#define SHARD_HPP
+
+#include <string>
+#include <vector>
+
+
+/* Part of image_list.dat processed by one run
+ *
+ * Image k of the list belongs to shard k % count, so the shards stay
+ * balanced when similar stacks are listed next to each other.
+ */
+struct ShardOptions {
+    unsigned int index = 0;     // 0-based
+    unsigned int count = 1;     // 1 = no sharding
+};
+
+/* Parse 'i/N' with 0 <= i < N */
+bool parseShard(const std::string &value, ShardOptions *shard);
+
+/* Keep the images of image_list.dat that belong to the shard, in list order */
+std::vector<std::string> shardImages(const std::vector<std::string> &input_images,
+                                        const ShardOptions &shard);
+
+/* Output file of a shard: <base>_shard_<i>_of_<N><extension>, or the plain file */
+std::string shardFilename(const std::string &base, const std::string &extension,
+                            const ShardOptions &shard);
+
+/* CSV output of a run, without its .csv extension */
+struct ShardedFile {
+    std::string base;
+    bool required;              // fail the merge if its shard files are missing
+};
+
+/* Merge the outputs of shard_count shards into the files of an unsharded run
+ *
+ * The rows of the <base>_shard_<i>_of_<N>.csv files are interleaved back into
+ * image_list.dat order, and the failed images of the err_list shards are
+ * collected into err_list.dat. A row belongs to an image if its first field
+ * is the image name, or the image name followed by _<merged layer>.
+ */
+bool mergeShards(const std::string &path, const std::vector<std::string> &input_images,
+                    unsigned int shard_count, const std::vector<ShardedFile> &files);
+
+#endif // SHARD_HPP
@@ -0,0 +1,87 @@
+#include <algorithm>
+
+#include "spatial_index.hpp"
+
+
+/* Index the boxes on square cells of cell_size pixels */
+void GridIndex::build(const std::vector<cv::Rect> &boxes, int cell_size) {
+
+    boxes_ = boxes;
+    cell_size_ = std::max(cell_size, 1);
+    grid_cols_ = grid_rows_ = 0;
+    cell_start_.assign(1, 0);
+    items_.clear();
+    if (boxes_.empty()) return;
+
+    // The grid spans the boxes
+    int x0 = boxes_[0].x, y0 = boxes_[0].y, x1 = x0, y1 = y0;
+    for (auto &box : boxes_) {
+        x0 = std::min(x0, box.x);
+        y0 = std::min(y0, box.y);
+        x1 = std::max(x1, box.x + std::max(box.width, 1));
+        y1 = std::max(y1, box.y + std::max(box.height, 1));
+    }
+    origin_ = cv::Point(x0, y0);
+    grid_cols_ = (x1 - x0 + cell_size_ - 1) / cell_size_;
+    grid_rows_ = (y1 - y0 + cell_size_ - 1) / cell_size_;
+
+    // Count the boxes of each cell, then fill the packed lists in box order
+    const auto cells = [&](const cv::Rect &box, int *c0, int *r0, int *c1, int *r1) {
+        *c0 = cellCol(box.x);
+        *r0 = cellRow(box.y);
+        *c1 = cellCol(box.x + std::max(box.width, 1) - 1);
+        *r1 = cellRow(box.y + std::max(box.height, 1) - 1);
+    };
+    cell_start_.assign(grid_cols_*grid_rows_ + 1, 0);
+    for (auto &box : boxes_) {
+        int c0, r0, c1, r1;
+        cells(box, &c0, &r0, &c1, &r1);
+        for (int r = r0; r <= r1; r++) {
+            for (int c = c0; c <= c1; c++) cell_start_[r*grid_cols_ + c + 1]++;
+        }
+    }
+    for (size_t cell = 1; cell < cell_start_.size(); cell++) {
+        cell_start_[cell] += cell_start_[cell-1];
+    }
+    items_.resize(cell_start_.back());
+    std::vector<unsigned int> fill(cell_start_.begin(), cell_start_.end() - 1);
+    for (unsigned int i = 0; i < boxes_.size(); i++) {
+        int c0, r0, c1, r1;
+        cells(boxes_[i], &c0, &r0, &c1, &r1);
+        for (int r = r0; r <= r1; r++) {
+            for (int c = c0; c <= c1; c++) items_[fill[r*grid_cols_ + c]++] = i;
+        }
+    }
+}
+
+/* Indices of the boxes intersecting area, in ascending order
+ *
+ * A box overlapping several cells of the query is reported only by the cell
+ * holding the top-left corner of its intersection with the query.
+ */
+void GridIndex::query(const cv::Rect &area, std::vector<unsigned int> *hits) const {
+
+    hits->clear();
+    if (!grid_cols_ || (area.width <= 0) || (area.height <= 0)) return;
+    if ((area.x + area.width <= origin_.x) || (area.y + area.height <= origin_.y)) return;
+    const int c0 = std::max(0, cellCol(std::max(area.x, origin_.x)));
+    const int r0 = std::max(0, cellRow(std::max(area.y, origin_.y)));
+    const int c1 = std::min(grid_cols_ - 1, cellCol(area.x + area.width - 1));
+    const int r1 = std::min(grid_rows_ - 1, cellRow(area.y + area.height - 1));
+
+    for (int r = r0; r <= r1; r++) {
+        for (int c = c0; c <= c1; c++) {
+            const int cell = r*grid_cols_ + c;
+            for (unsigned int item = cell_start_[cell]; item < cell_start_[cell+1]; item++) {
+                const cv::Rect &box = boxes_[items_[item]];
+                const int x = std::max(box.x, area.x), y = std::max(box.y, area.y);
+                if ((x >= std::min(box.x + std::max(box.width, 1), area.x + area.width)) ||
+                        (y >= std::min(box.y + std::max(box.height, 1), area.y + area.height))) {
+                    continue;
+                }
+                if ((cellCol(x) == c) && (cellRow(y) == r)) hits->push_back(items_[item]);
+            }
+        }
+    }
+    std::sort(hits->begin(), hits->end());
+}
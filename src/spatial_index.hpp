@@ -0,0 +1,37 @@
+#ifndef SPATIAL_INDEX_HPP
+#define SPATIAL_INDEX_HPP
+
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+
+/* Uniform grid over the bounding boxes of regions
+ *
+ * Each box is listed in every cell it overlaps, the lists packed one after
+ * the other. A query only visits the cells under its rect, so with cells
+ * about the size of the queries it costs the boxes nearby rather than all
+ * of them. Queries do not modify the index and can run concurrently.
+ */
+class GridIndex {
+public:
+    /* Index the boxes on square cells of cell_size pixels */
+    void build(const std::vector<cv::Rect> &boxes, int cell_size);
+
+    /* Indices of the boxes intersecting area, in ascending order */
+    void query(const cv::Rect &area, std::vector<unsigned int> *hits) const;
+
+    size_t size() const { return boxes_.size(); }
+
+private:
+    int cellCol(int x) const { return (x - origin_.x) / cell_size_; }
+    int cellRow(int y) const { return (y - origin_.y) / cell_size_; }
+
+    std::vector<cv::Rect> boxes_;
+    cv::Point origin_;
+    int cell_size_ = 1, grid_cols_ = 0, grid_rows_ = 0;
+    std::vector<unsigned int> cell_start_;  // grid_cols_*grid_rows_ + 1 offsets into items_
+    std::vector<unsigned int> items_;       // the boxes of each cell
+};
+
+#endif // SPATIAL_INDEX_HPP
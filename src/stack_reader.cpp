@@ -0,0 +1,513 @@
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <algorithm>
+
+#include "stack_reader.hpp"
+#include "instrumentation.hpp"
+#include "mat_pool.hpp"
+
+
+/* OpenCV 4.6 added cv::ImageCollection, which decodes pages lazily */
+#if (CV_VERSION_MAJOR > 4) || ((CV_VERSION_MAJOR == 4) && (CV_VERSION_MINOR >= 6))
+#define HAVE_IMAGE_COLLECTION   1
+#else
+#define HAVE_IMAGE_COLLECTION   0
+#endif
+
+#define TIFF_MAX_PAGES          1000000 // Pages of a container walked by stackGeometry()
+#define TIFF_MAX_DESCRIPTION    (16 << 20) // Longest ImageDescription read, in bytes
+
+
+/* Size of a file in bytes, 0 if it cannot be stat'ed */
+static unsigned long long fileSize(std::string filename) {
+    struct stat st = {0};
+    if (stat(filename.c_str(), &st) == -1) return 0;
+    return st.st_size;
+}
+
+/* Split a decoded layer into its bgr streams */
+static bool splitLayer(cv::Mat img, StackLayer *layer) {
+
+    ScopedTimer timer(Stage::SPLIT);
+    if (img.empty() || (img.channels() != 3)) {
+        std::cerr << "Invalid input layer" << std::endl;
+        return false;
+    }
+    layer->original = img;
+
+    cv::Mat channel[3];
+    for (auto &plane : channel) plane = pooledMat(img.size(), img.depth());
+    cv::split(img, channel);
+
+    layer->blue  = channel[0];
+    layer->green = channel[1];
+    layer->red   = channel[2];
+    return true;
+}
+
+/* Stack stored as one _zNNc1+2+3.tif file per z-layer */
+class LayerFileReader : public StackReader {
+public:
+    LayerFileReader(std::string dir_name, std::string image_name, unsigned int z_count)
+        : dir_name_(dir_name), image_name_(image_name), z_count_(z_count) {}
+
+    unsigned int layerCount() const { return z_count_; }
+
+    bool readLayer(unsigned int z_index, StackLayer *layer) {
+
+        // Extract the bgr streams for the input image
+        std::string in_filename = layerFilename(z_index);
+        cv::Mat img;
+        {
+            ScopedTimer timer(Stage::DECODE);
+            img = cv::imread(in_filename.c_str(), cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
+        }
+        countBytesRead(fileSize(in_filename));
+        if (img.empty()) {
+            std::cerr << "Invalid input filename" << std::endl;
+            return false;
+        }
+        return splitLayer(img, layer);
+    }
+
+    std::string layerFile(unsigned int z_index) const { return layerFilename(z_index); }
+
+private:
+    /* The layer number is zero-padded to the digit count of the layer count */
+    std::string layerFilename(unsigned int z_index) const {
+        std::string layer_number = std::to_string(z_index+1);
+        size_t width = std::to_string(z_count_).size();
+        if (layer_number.size() < width) {
+            layer_number.insert(0, width - layer_number.size(), '0');
+        }
+        return dir_name_ + image_name_ + "_z" + layer_number + "c1+2+3.tif";
+    }
+
+    std::string dir_name_, image_name_;
+    unsigned int z_count_;
+};
+
+/* Image tags of one TIFF page */
+struct TiffPage {
+    unsigned int width = 0, height = 0;
+    unsigned int bits_per_sample = 0, samples_per_pixel = 1;
+    std::string description;    // ImageDescription, the OME-XML of an OME-TIFF
+};
+
+/* Walks the IFD chain of a classic TIFF or BigTIFF file without decoding */
+class TiffFile {
+public:
+    ~TiffFile() {
+        if (file_) fclose(file_);
+    }
+
+    bool open(std::string filename) {
+        file_ = fopen(filename.c_str(), "rb");
+        unsigned char head[16];
+        if (!file_ || (fread(head, 1, sizeof(head), file_) < 8)) return false;
+        if ((head[0] == 'I') && (head[1] == 'I')) {
+            little_endian_ = true;
+        } else if ((head[0] != 'M') || (head[1] != 'M')) {
+            return false;
+        }
+        unsigned long long version = value(head + 2, 2);
+        big_ = (version == 43);
+        if (!big_ && (version != 42)) return false;
+        next_ifd_ = big_ ? value(head + 8, 8) : value(head + 4, 4);
+        return true;
+    }
+
+    /* Read the next IFD, and its image tags if page is set; false at the end */
+    bool nextPage(TiffPage *page) {
+
+        if (!next_ifd_) return false;
+        const size_t count_size = big_ ? 8 : 2, entry_size = big_ ? 20 : 12;
+        const size_t field_size = big_ ? 8 : 4;
+        unsigned char entry[20];
+        if (fseeko(file_, next_ifd_, SEEK_SET) || 
+                (fread(entry, 1, count_size, file_) != count_size)) {
+            return false;
+        }
+        const unsigned long long count = value(entry, count_size);
+        if (!page) {
+            if (fseeko(file_, count * entry_size, SEEK_CUR)) return false;
+        }
+        for (unsigned long long i = 0; page && (i < count); i++) {
+            if (fread(entry, 1, entry_size, file_) != entry_size) return false;
+            const unsigned int tag = value(entry, 2), type = value(entry + 2, 2);
+            const unsigned long long values = value(entry + 4, field_size);
+            if ((tag == 270) && (type == 2)) {
+                if (!readDescription(entry + 4 + field_size, values, page)) return false;
+                continue;
+            }
+            const size_t type_size = (type == 3) ? 2 : (type == 4) ? 4 : (type == 16) ? 8 : 0;
+            if (!type_size || !values || 
+                    ((tag != 256) && (tag != 257) && (tag != 258) && (tag != 277))) {
+                continue;
+            }
+            // The first value, stored in the entry if all values fit there
+            unsigned char first[8];
+            const unsigned char *field = entry + 4 + field_size;
+            if (values * type_size <= field_size) {
+                memcpy(first, field, type_size);
+            } else {
+                off_t position = ftello(file_);
+                if (fseeko(file_, value(field, field_size), SEEK_SET) || 
+                        (fread(first, 1, type_size, file_) != type_size) || 
+                        fseeko(file_, position, SEEK_SET)) {
+                    return false;
+                }
+            }
+            const unsigned int first_value = value(first, type_size);
+            if (tag == 256) page->width = first_value;
+            if (tag == 257) page->height = first_value;
+            if (tag == 258) page->bits_per_sample = first_value;
+            if (tag == 277) page->samples_per_pixel = first_value;
+        }
+        const size_t offset_size = big_ ? 8 : 4;
+        if (fread(entry, 1, offset_size, file_) != offset_size) return false;
+        next_ifd_ = value(entry, offset_size);
+        return true;
+    }
+
+private:
+    /* Read the ASCII ImageDescription of a page, stored in the entry or at its offset */
+    bool readDescription(const unsigned char *field, unsigned long long length, 
+                            TiffPage *page) {
+        const size_t field_size = big_ ? 8 : 4;
+        if (length > TIFF_MAX_DESCRIPTION) return true;
+        std::string text(length, '\0');
+        if (length <= field_size) {
+            memcpy(&text[0], field, length);
+        } else {
+            off_t position = ftello(file_);
+            if (fseeko(file_, value(field, field_size), SEEK_SET) || 
+                    (fread(&text[0], 1, length, file_) != length) || 
+                    fseeko(file_, position, SEEK_SET)) {
+                return false;
+            }
+        }
+        page->description = text.substr(0, text.find('\0'));
+        return true;
+    }
+
+    unsigned long long value(const unsigned char *bytes, size_t size) const {
+        unsigned long long result = 0;
+        for (size_t i = 0; i < size; i++) {
+            result |= static_cast<unsigned long long>(
+                        bytes[little_endian_ ? i : size-1-i]) << (8*i);
+        }
+        return result;
+    }
+
+    FILE *file_ = NULL;
+    bool little_endian_ = false, big_ = false;
+    unsigned long long next_ifd_ = 0;
+};
+
+/* Start tags named name in an XML document, namespace prefixes ignored */
+static std::vector<std::string> xmlStartTags(const std::string &xml, const std::string &name) {
+    std::vector<std::string> tags;
+    for (size_t begin = xml.find('<'); begin != std::string::npos; 
+            begin = xml.find('<', begin + 1)) {
+        size_t end = xml.find('>', begin);
+        if (end == std::string::npos) break;
+        std::string tag = xml.substr(begin + 1, end - begin - 1);
+        std::string tag_name = tag.substr(0, tag.find_first_of(" \t\r\n/"));
+        size_t prefix = tag_name.find(':');
+        if (prefix != std::string::npos) tag_name = tag_name.substr(prefix + 1);
+        if (tag_name == name) tags.push_back(tag);
+    }
+    return tags;
+}
+
+/* Value of an attribute of a start tag, empty if it is not set */
+static std::string xmlAttribute(const std::string &tag, const std::string &name) {
+    for (size_t at = tag.find(name + "="); at != std::string::npos; 
+            at = tag.find(name + "=", at + 1)) {
+        if (!at || !isspace(static_cast<unsigned char>(tag[at-1]))) continue;
+        size_t quote = at + name.size() + 1;
+        if ((quote >= tag.size()) || ((tag[quote] != '"') && (tag[quote] != '\''))) continue;
+        size_t end = tag.find(tag[quote], quote + 1);
+        if (end == std::string::npos) return std::string();
+        return tag.substr(quote + 1, end - quote - 1);
+    }
+    return std::string();
+}
+
+/* Check the OME-XML of a stack of single-channel planes against the layout read
+ *
+ * The planes must be stored XYCZT with SizeC 3 and a single time point; when
+ * the channels carry a Color, it must be red, green, blue in that order.
+ * A description that is not OME-XML is taken to follow that layout.
+ */
+static bool omeLayoutSupported(const std::string &description, const std::string &filename) {
+
+    if (xmlStartTags(description, "OME").empty()) return true;
+    std::vector<std::string> pixels = xmlStartTags(description, "Pixels");
+    if (pixels.empty()) return true;
+    const std::string order = xmlAttribute(pixels[0], "DimensionOrder");
+    const std::string size_c = xmlAttribute(pixels[0], "SizeC");
+    const std::string size_t_count = xmlAttribute(pixels[0], "SizeT");
+    if ((order != "XYCZT") || (size_c != "3") || 
+            (!size_t_count.empty() && (size_t_count != "1"))) {
+        std::cerr << "Unsupported OME layout in '" << filename << "': DimensionOrder " 
+                  << order << ", SizeC " << size_c << ", SizeT " << size_t_count 
+                  << " (XYCZT, SizeC 3, SizeT 1 supported)" << std::endl;
+        return false;
+    }
+
+    // RGBA colors of c1, c2, c3 = red, green, blue
+    const unsigned int colors[] = {0xFF000000u, 0x00FF0000u, 0x0000FF00u};
+    const char *names[] = {"red", "green", "blue"};
+    std::vector<std::string> channels = xmlStartTags(description, "Channel");
+    for (size_t c = 0; (c < 3) && (c < channels.size()); c++) {
+        std::string color = xmlAttribute(channels[c], "Color");
+        if (color.empty()) continue;
+        unsigned int rgba = static_cast<unsigned int>(strtoll(color.c_str(), NULL, 10));
+        if ((rgba & 0xFFFFFF00u) == colors[c]) continue;
+        std::cerr << "Unsupported OME channel order in '" << filename << "': channel " 
+                  << c+1 << " is not " << names[c] << " (c1, c2, c3 = red, green, blue)" 
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* Stack stored as the pages of one multi-page TIFF / BigTIFF / OME-TIFF
+ *
+ * Pages are either one bgr image per z-layer, or single-channel planes
+ * stored channel-fastest (OME XYCZT) as c1, c2, c3 = red, green, blue,
+ * matching the c1+2+3 composites of the per-layer files. The OME-XML of
+ * single-channel planes is checked against that layout before decoding.
+ */
+class MultiPageReader : public StackReader {
+public:
+    bool open(std::string filename) {
+        const int flags = cv::IMREAD_ANYDEPTH | cv::IMREAD_ANYCOLOR;
+        size_t page_count = 0;
+        int channels = 0;
+        {
+            TiffFile tiff;
+            TiffPage page;
+            if (tiff.open(filename) && tiff.nextPage(&page) && 
+                    (page.samples_per_pixel == 1) && 
+                    !omeLayoutSupported(page.description, filename)) {
+                return false;
+            }
+        }
+        ScopedTimer timer(Stage::DECODE);
+        countBytesRead(fileSize(filename));
+#if HAVE_IMAGE_COLLECTION
+        collection_.init(filename, flags);
+        page_count = collection_.size();
+        if (page_count) channels = collection_.at(0).channels();
+#else
+        // Without lazy decoding the pages are decoded up front
+        if (!cv::imreadmulti(filename, pages_, flags)) pages_.clear();
+        page_count = pages_.size();
+        if (page_count) channels = pages_[0].channels();
+#endif
+        if (channels == 3) {
+            pages_per_layer_ = 1;
+        } else if ((channels == 1) && !(page_count % 3)) {
+            pages_per_layer_ = 3;
+        } else {
+            std::cerr << "Unsupported page layout in '" << filename << "'" << std::endl;
+            return false;
+        }
+        z_count_ = page_count / pages_per_layer_;
+        return true;
+    }
+
+    unsigned int layerCount() const { return z_count_; }
+
+    bool readLayer(unsigned int z_index, StackLayer *layer) {
+        if (z_index >= z_count_) return false;
+        if (pages_per_layer_ == 1) return splitLayer(takePage(z_index), layer);
+
+        layer->red   = takePage(3*z_index);
+        layer->green = takePage(3*z_index+1);
+        layer->blue  = takePage(3*z_index+2);
+        if (layer->red.empty() || layer->green.empty() || layer->blue.empty() ||
+                (layer->red.size() != layer->green.size()) ||
+                (layer->red.size() != layer->blue.size())) {
+            std::cerr << "Invalid input layer" << std::endl;
+            return false;
+        }
+        ScopedTimer timer(Stage::SPLIT);
+        std::vector<cv::Mat> channel = {layer->blue, layer->green, layer->red};
+        layer->original = pooledMat(layer->red.size(), CV_MAKETYPE(layer->red.depth(), 3));
+        cv::merge(channel, layer->original);
+        return true;
+    }
+
+private:
+    /* Hand out a decoded page and drop the reader's reference to it */
+    cv::Mat takePage(unsigned int page_index) {
+        ScopedTimer timer(Stage::DECODE);
+#if HAVE_IMAGE_COLLECTION
+        cv::Mat page = collection_.at(page_index);
+        collection_.releaseCache(page_index);
+#else
+        cv::Mat page = pages_[page_index];
+        pages_[page_index].release();
+#endif
+        return page;
+    }
+
+#if HAVE_IMAGE_COLLECTION
+    cv::ImageCollection collection_;
+#else
+    std::vector<cv::Mat> pages_;
+#endif
+    unsigned int pages_per_layer_ = 1;
+    unsigned int z_count_ = 0;
+};
+
+CachedStackReader::CachedStackReader(std::unique_ptr<StackReader> reader, bool keep)
+    : reader_(std::move(reader)), layers_(reader_->layerCount()), 
+        loaded_(reader_->layerCount(), false), keep_(keep) {}
+
+/* Decode every layer now, in order */
+bool CachedStackReader::preload() {
+    for (unsigned int z_index = 0; z_index < layers_.size(); z_index++) {
+        if (loaded_[z_index]) continue;
+        if (!reader_->readLayer(z_index, &layers_[z_index])) return false;
+        loaded_[z_index] = true;
+    }
+    return true;
+}
+
+/* Decode the layer on first use, then hand out the kept planes */
+bool CachedStackReader::readLayer(unsigned int z_index, StackLayer *layer) {
+    if (z_index >= layers_.size()) return false;
+    if (!loaded_[z_index]) {
+        if (!reader_->readLayer(z_index, &layers_[z_index])) return false;
+        loaded_[z_index] = true;
+    }
+    *layer = layers_[z_index];
+    if (!keep_) {
+        layers_[z_index] = StackLayer();
+        loaded_[z_index] = false;
+    }
+    return true;
+}
+
+/* Single container file of an image, empty if it is stored as layer files */
+static std::string containerFile(std::string path, std::string image_name) {
+    const char *extensions[] = {".ome.tif", ".ome.tiff", ".tif", ".tiff"};
+    for (auto extension : extensions) {
+        std::string filename = path + "tiff/" + image_name + extension;
+        struct stat st = {0};
+        if ((stat(filename.c_str(), &st) != -1) && S_ISREG(st.st_mode)) return filename;
+    }
+    return std::string();
+}
+
+/* Open the stack of an image listed in image_list.dat */
+std::unique_ptr<StackReader> openStack(std::string path, std::string image_name) {
+
+    // Single container file
+    std::string filename = containerFile(path, image_name);
+    if (!filename.empty()) {
+        std::unique_ptr<MultiPageReader> reader(new MultiPageReader());
+        if (!reader->open(filename)) return nullptr;
+        return std::move(reader);
+    }
+
+    // Count the number of images
+    unsigned int z_count = 0;
+    struct dirent *dir = NULL;
+
+    std::string dir_name = path + "tiff/" + image_name + "/";
+    DIR *read_dir = opendir(dir_name.c_str());
+    if (!read_dir) {
+        std::cerr << "Could not open directory '" << dir_name << "'" << std::endl;
+        return nullptr;
+    }
+    while ((dir = readdir(read_dir))) {
+        if (!strcmp (dir->d_name, ".") || !strcmp (dir->d_name, "..")) {
+            continue;
+        }
+        z_count++;
+    }
+    closedir(read_dir);
+
+    return std::unique_ptr<StackReader>(new LayerFileReader(dir_name, image_name, z_count));
+}
+
+/* Input files openStack() would read for an image, without decoding them */
+bool stackInputs(std::string path, std::string image_name, std::vector<std::string> *files) {
+
+    files->clear();
+    std::string filename = containerFile(path, image_name);
+    if (!filename.empty()) {
+        files->push_back(filename);
+        return true;
+    }
+
+    std::string dir_name = path + "tiff/" + image_name + "/";
+    DIR *read_dir = opendir(dir_name.c_str());
+    if (!read_dir) return false;
+    struct dirent *dir = NULL;
+    while ((dir = readdir(read_dir))) {
+        if (!strcmp (dir->d_name, ".") || !strcmp (dir->d_name, "..")) {
+            continue;
+        }
+        files->push_back(dir_name + dir->d_name);
+    }
+    closedir(read_dir);
+    std::sort(files->begin(), files->end());
+    return true;
+}
+
+/* Key of the inputs of an image: each input file, relative to path, with its size and mtime */
+std::string stackInputsKey(std::string path, std::string image_name) {
+
+    std::vector<std::string> files;
+    if (!stackInputs(path, image_name, &files) || files.empty()) return std::string();
+
+    std::ostringstream key;
+    for (auto &file : files) {
+        struct stat st = {0};
+        if (stat(file.c_str(), &st) == -1) return std::string();
+        key << "input " << file.substr(path.size()) << " " << st.st_size << " "
+            << st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec << std::endl;
+    }
+    return key.str();
+}
+
+/* Geometry of the stack openStack() would read, from the TIFF headers only */
+bool stackGeometry(std::string path, std::string image_name, StackGeometry *geometry) {
+
+    std::vector<std::string> files;
+    if (!stackInputs(path, image_name, &files) || files.empty()) return false;
+    TiffFile tiff;
+    TiffPage page;
+    if (!tiff.open(files[0]) || !tiff.nextPage(&page) || 
+            !page.width || !page.height || !page.bits_per_sample) {
+        return false;
+    }
+    geometry->width = page.width;
+    geometry->height = page.height;
+    geometry->bytes_per_sample = (page.bits_per_sample + 7) / 8;
+
+    // Layer files, or the pages of a container: one bgr page or 3 planes per layer
+    if (containerFile(path, image_name).empty()) {
+        geometry->z_count = files.size();
+        geometry->resident = false;
+        return true;
+    }
+    unsigned long long page_count = 1;
+    while ((page_count < TIFF_MAX_PAGES) && tiff.nextPage(NULL)) page_count++;
+    geometry->z_count = (page.samples_per_pixel >= 3) ? page_count : page_count / 3;
+    geometry->resident = !HAVE_IMAGE_COLLECTION;
+    return true;
+}
@@ -0,0 +1,97 @@
+#ifndef STACK_READER_HPP
+#define STACK_READER_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+
+#define READER_QUEUE_DEPTH      2   // Decoded stacks queued ahead of the workers (--readers)
+
+
+/* Z-layer of an image stack, split into its bgr planes
+ *
+ * original is empty when the reader only holds the planes (plane cache).
+ */
+struct StackLayer {
+    cv::Mat original, blue, green, red;
+};
+
+/* Source of the z-layers of one image stack */
+class StackReader {
+public:
+    virtual ~StackReader() {}
+
+    /* Number of z-layers in the stack */
+    virtual unsigned int layerCount() const = 0;
+
+    /* Read the z-layer at z_index (0-based) and split its bgr streams */
+    virtual bool readLayer(unsigned int z_index, StackLayer *layer) = 0;
+
+    /* Input file holding only the z-layer, empty if the layer shares a file */
+    virtual std::string layerFile(unsigned int) const { return std::string(); }
+};
+
+/* Reader that decodes each layer of another reader once and keeps it
+ *
+ * Used when the same stack is processed several times, e.g. by a parameter
+ * sweep. The whole decoded stack stays resident. Without keep, a layer is
+ * dropped (and decoded again if asked for) once it has been handed out, for
+ * a stack decoded ahead of time with preload() but processed once.
+ */
+class CachedStackReader : public StackReader {
+public:
+    explicit CachedStackReader(std::unique_ptr<StackReader> reader, bool keep = true);
+
+    /* Decode every layer now */
+    bool preload();
+
+    unsigned int layerCount() const { return reader_->layerCount(); }
+    bool readLayer(unsigned int z_index, StackLayer *layer);
+    std::string layerFile(unsigned int z_index) const { return reader_->layerFile(z_index); }
+
+private:
+    std::unique_ptr<StackReader> reader_;
+    std::vector<StackLayer> layers_;
+    std::vector<bool> loaded_;
+    bool keep_;
+};
+
+/* Open the stack of an image listed in image_list.dat
+ *
+ * A single multi-page TIFF, BigTIFF or OME-TIFF at tiff/<image>.tif (also
+ * .tiff, .ome.tif, .ome.tiff) is preferred; otherwise the per-layer
+ * tiff/<image>/<image>_zNNc1+2+3.tif files are used.
+ */
+std::unique_ptr<StackReader> openStack(std::string path, std::string image_name);
+
+/* Input files openStack() would read for an image, without decoding them */
+bool stackInputs(std::string path, std::string image_name, std::vector<std::string> *files);
+
+/* Size of the decoded stack of an image */
+struct StackGeometry {
+    unsigned int width = 0, height = 0;
+    unsigned int bytes_per_sample = 1;  // 1 (8-bit) or 2 (16-bit)
+    unsigned int z_count = 0;
+    bool resident = false;              // every layer is decoded when the stack is opened
+};
+
+/* Geometry of the stack openStack() would read, from the TIFF headers only
+ *
+ * Reads the first IFD of the container or of the first layer file, and
+ * walks the IFD chain of a container to count its pages.
+ */
+bool stackGeometry(std::string path, std::string image_name, StackGeometry *geometry);
+
+/* Key of the inputs of an image: each input file with its size and mtime
+ *
+ * The files are named relative to path, so the same data reached through
+ * another spelling of path, or moved as a whole, has the same key. Empty if
+ * the inputs of the stack cannot be listed or stat'ed.
+ */
+std::string stackInputsKey(std::string path, std::string image_name);
+
+#endif // STACK_READER_HPP
@@ -0,0 +1,149 @@
+#include <iostream>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "stack_watcher.hpp"
+
+
+/* Events that mean a stack is still being written */
+#define STACK_EVENTS    (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY)
+
+/* Image name of a container file, empty if the file is not a stack */
+static std::string containerImage(const std::string &filename) {
+    const char *extensions[] = {".ome.tif", ".ome.tiff", ".tif", ".tiff"};
+    for (auto extension : extensions) {
+        size_t length = strlen(extension);
+        if ((filename.size() > length) &&
+                !filename.compare(filename.size() - length, length, extension)) {
+            return filename.substr(0, filename.size() - length);
+        }
+    }
+    return std::string();
+}
+
+StackWatcher::StackWatcher(std::string path, double settle_sec)
+    : dir_name_(path + "tiff/"), settle_(settle_sec) {}
+
+StackWatcher::~StackWatcher() {
+    if (fd_ != -1) close(fd_);
+}
+
+/* Start watching; fails if tiff/ cannot be watched */
+bool StackWatcher::start(const std::set<std::string> &known) {
+
+    known_ = known;
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ == -1) {
+        std::cerr << "Could not start inotify: " << strerror(errno) << std::endl;
+        return false;
+    }
+    dir_watch_ = inotify_add_watch(fd_, dir_name_.c_str(), STACK_EVENTS | IN_ONLYDIR);
+    if (dir_watch_ == -1) {
+        std::cerr << "Could not watch '" << dir_name_ << "': " << strerror(errno) << std::endl;
+        return false;
+    }
+    scan();
+    return true;
+}
+
+/* Restart the settle time of a stack */
+void StackWatcher::touch(const std::string &image_name) {
+    pending_[image_name] = std::chrono::steady_clock::now();
+}
+
+/* Watch the directory of a stack for its layer files */
+void StackWatcher::watchStack(const std::string &image_name) {
+    std::string stack_dir = dir_name_ + image_name + "/";
+    int watch = inotify_add_watch(fd_, stack_dir.c_str(), STACK_EVENTS);
+    if (watch == -1) {
+        std::cerr << "Could not watch '" << stack_dir << "': " << strerror(errno) << std::endl;
+        return;
+    }
+    stack_watches_[watch] = image_name;
+}
+
+/* Pick up the stacks in tiff/ that are neither known nor reported yet */
+void StackWatcher::scan() {
+
+    DIR *read_dir = opendir(dir_name_.c_str());
+    if (!read_dir) {
+        std::cerr << "Could not scan '" << dir_name_ << "': " << strerror(errno) << std::endl;
+        return;
+    }
+    struct dirent *dir = NULL;
+    while ((dir = readdir(read_dir))) {
+        std::string name(dir->d_name);
+        if ((name == ".") || (name == "..")) continue;
+        struct stat st = {0};
+        if (stat((dir_name_ + name).c_str(), &st) == -1) continue;
+        std::string image_name = S_ISDIR(st.st_mode) ? name : containerImage(name);
+        if (image_name.empty() || known_.count(image_name)) continue;
+        if (S_ISDIR(st.st_mode)) watchStack(image_name);
+        touch(image_name);
+    }
+    closedir(read_dir);
+}
+
+/* Wait up to timeout_ms for events and append the stacks that have settled */
+bool StackWatcher::poll(int timeout_ms, std::vector<std::string> *settled) {
+
+    struct pollfd poll_fd = {fd_, POLLIN, 0};
+    int ready = ::poll(&poll_fd, 1, timeout_ms);
+    if ((ready == -1) && (errno != EINTR)) {
+        std::cerr << "Could not poll inotify: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // Drain the events; each read returns whole events
+    alignas(struct inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((ready > 0) && ((length = read(fd_, buffer, sizeof(buffer))) > 0)) {
+        for (char *ptr = buffer; ptr < buffer + length; ) {
+            const struct inotify_event *event = reinterpret_cast<struct inotify_event *>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost; find the stacks they were about
+                std::cerr << "inotify queue overflowed, rescanning '" << dir_name_ << "'"
+                          << std::endl;
+                scan();
+            } else if (event->wd == dir_watch_) {
+                if (!event->len) continue;
+                std::string name(event->name);
+                if (event->mask & IN_ISDIR) {
+                    // Layer files of a new stack land in its directory
+                    if (!(event->mask & (IN_CREATE | IN_MOVED_TO))) continue;
+                    watchStack(name);
+                    touch(name);
+                } else if (!containerImage(name).empty()) {
+                    touch(containerImage(name));
+                }
+            } else if (stack_watches_.count(event->wd)) {
+                touch(stack_watches_[event->wd]);
+            }
+        }
+    }
+
+    // Report the stacks that have been quiet for the settle time
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = pending_.begin(); it != pending_.end(); ) {
+        if (now - it->second < settle_) {
+            ++it;
+            continue;
+        }
+        settled->push_back(it->first);
+        known_.insert(it->first);
+        for (auto watch = stack_watches_.begin(); watch != stack_watches_.end(); ++watch) {
+            if (watch->second != it->first) continue;
+            inotify_rm_watch(fd_, watch->first);
+            stack_watches_.erase(watch);
+            break;
+        }
+        it = pending_.erase(it);
+    }
+    return true;
+}
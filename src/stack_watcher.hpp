@@ -0,0 +1,52 @@
+#ifndef STACK_WATCHER_HPP
+#define STACK_WATCHER_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <chrono>
+
+
+#define WATCH_SETTLE_SEC        30  // Quiet time after which a stack is complete
+#define WATCH_POLL_MS           500 // Longest wait for inotify events
+
+
+/* Watch tiff/ of an image directory for new stacks
+ *
+ * A stack is a tiff/<image>/ directory of layer files or a tiff/<image>.tif
+ * container (also .tiff, .ome.tif, .ome.tiff). It is reported once, after no
+ * file of it has been created, written or moved in for the settle time, so
+ * that stacks still being copied from the scope are not picked up. When the
+ * inotify queue overflows, tiff/ is scanned again for the stacks missed.
+ */
+class StackWatcher {
+public:
+    explicit StackWatcher(std::string path, double settle_sec = WATCH_SETTLE_SEC);
+    ~StackWatcher();
+
+    /* Start watching; fails if tiff/ cannot be watched
+     *
+     * The stacks already in tiff/ that are not in known (image_list.dat),
+     * e.g. copies still in progress, are picked up as if they had just landed.
+     */
+    bool start(const std::set<std::string> &known);
+
+    /* Wait up to timeout_ms for events and append the stacks that have settled */
+    bool poll(int timeout_ms, std::vector<std::string> *settled);
+
+private:
+    void touch(const std::string &image_name);
+    void watchStack(const std::string &image_name);
+    void scan();
+
+    std::string dir_name_;
+    std::chrono::duration<double> settle_;
+    int fd_ = -1;
+    int dir_watch_ = -1;
+    std::map<int, std::string> stack_watches_;      // watch of each stack directory
+    std::map<std::string, std::chrono::steady_clock::time_point> pending_;
+    std::set<std::string> known_;                   // listed or already reported
+};
+
+#endif // STACK_WATCHER_HPP
@@ -0,0 +1,273 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <map>
+#include <memory>
+
+#include "opencv2/core/ocl.hpp"
+
+#include "verify.hpp"
+#include "instrumentation.hpp"
+#include "metrics.hpp"
+
+
+#define VERIFY_TILE_SIZE        256 // Tile edge of the tiled engine without --tile
+#define VERIFY_MAX_REPORTS      10  // Differences printed per image and table
+
+/* Engines compared with the reference pipeline
+ *
+ * Except for fused, the engines keep the OpenCV enhancement chain, so a
+ * difference comes from the engine under test. components reports pixel
+ * areas where contours report polygon areas: its differences are printed
+ * but do not fail the run.
+ */
+static const struct {
+    const char *name;
+    bool gates;                 // differences fail the run
+    void (*apply)(ExecutionOptions *exec);
+} kEngines[] = {
+    {"fused",       true,   [](ExecutionOptions *) {}},
+    {"components",  false,  [](ExecutionOptions *exec) {
+                                exec->reference = true;
+                                exec->segment_engine = SegmentEngine::COMPONENTS; }},
+    {"packed",      true,   [](ExecutionOptions *exec) {
+                                exec->reference = true;
+                                exec->packed_masks = true; }},
+    {"tiled",       true,   [](ExecutionOptions *exec) {
+                                exec->reference = true;
+                                if (!exec->tile_size) exec->tile_size = VERIFY_TILE_SIZE; }},
+    {"opencl",      true,   [](ExecutionOptions *exec) {
+                                exec->reference = true;
+                                exec->backend = Backend::OPENCL; }},
+};
+
+/* Outputs of one stack processed by one engine */
+struct EngineRun {
+    std::vector<std::vector<MetricsRow>> metrics;
+    std::map<std::string, cv::Mat> images;
+    std::shared_ptr<ImageStats> stats;
+    bool success = false;
+};
+
+/* Process a stack, keeping its images */
+static void runEngine(const std::string &path, const std::string &image_name,
+                        const std::vector<PipelineParams> &param_sets,
+                        const OutputOptions &output, const ExecutionOptions &exec,
+                        EngineRun *run) {
+
+    run->stats = std::make_shared<ImageStats>(image_name);
+    StatsScope scope(run->stats);
+    auto start = std::chrono::steady_clock::now();
+    {
+        ImageWriter writer;
+        writer.capture(&run->images);
+        run->success = processStack(path, image_name, param_sets, output, exec,
+                                    &writer, &run->metrics);
+        writer.flush();
+    }
+    run->stats->total_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start).count();
+}
+
+/* Split CSV text into lines of fields */
+static std::vector<std::vector<std::string>> csvLines(const std::string &text) {
+    std::vector<std::vector<std::string>> lines;
+    std::istringstream stream(text);
+    std::string line, field;
+    while (std::getline(stream, line)) {
+        std::istringstream fields(line);
+        lines.push_back(std::vector<std::string>());
+        while (std::getline(fields, field, ',')) lines.back().push_back(field);
+    }
+    return lines;
+}
+
+/* Compare two tables field by field; prints the first differences, returns their count */
+static unsigned long long diffTable(const std::string &table, const std::string &header,
+                                    const std::string &reference, const std::string &fast) {
+
+    std::vector<std::vector<std::string>> names = csvLines(header);
+    std::vector<std::vector<std::string>> expected = csvLines(reference);
+    std::vector<std::vector<std::string>> actual = csvLines(fast);
+    unsigned long long differences = 0;
+    if (expected.size() != actual.size()) {
+        std::cout << "  " << table << ": " << expected.size() << " rows in the reference, "
+                  << actual.size() << " with the engine" << std::endl;
+        differences++;
+    }
+    for (size_t row = 0; row < std::min(expected.size(), actual.size()); row++) {
+        const size_t columns = std::max(expected[row].size(), actual[row].size());
+        for (size_t column = 0; column < columns; column++) {
+            std::string want = (column < expected[row].size()) ? expected[row][column] : "";
+            std::string got = (column < actual[row].size()) ? actual[row][column] : "";
+            if (want == got) continue;
+            if (differences++ >= VERIFY_MAX_REPORTS) continue;
+            std::string name = (!names.empty() && (column < names[0].size())) ?
+                                names[0][column] : std::to_string(column);
+            std::cout << "  " << table << " row " << row << " " << name << ": "
+                      << want << " != " << got << std::endl;
+        }
+    }
+    return differences;
+}
+
+/* Number of differing values of two images; every value if their geometry differs */
+static unsigned long long pixelDifferences(const cv::Mat &reference, const cv::Mat &fast) {
+    if ((reference.size() != fast.size()) || (reference.type() != fast.type())) {
+        return std::max(reference.total() * reference.channels(),
+                        fast.total() * fast.channels());
+    }
+    cv::Mat different;
+    cv::compare(reference.reshape(1), fast.reshape(1), different, cv::CMP_NE);
+    return cv::countNonZero(different);
+}
+
+/* Compare the images of both runs; prints the differing ones, returns their count */
+static unsigned long long diffImages(const std::map<std::string, cv::Mat> &reference,
+                                        const std::map<std::string, cv::Mat> &fast) {
+
+    unsigned long long differences = 0;
+    auto report = [&](const std::string &filename, const std::string &what) {
+        if (differences++ < VERIFY_MAX_REPORTS) {
+            std::cout << "  image " << filename << ": " << what << std::endl;
+        }
+    };
+    for (auto &image : reference) {
+        auto other = fast.find(image.first);
+        if (other == fast.end()) {
+            report(image.first, "not written by the engine");
+            continue;
+        }
+        unsigned long long pixels = pixelDifferences(image.second, other->second);
+        if (pixels) report(image.first, std::to_string(pixels) + " values differ");
+    }
+    for (auto &image : fast) {
+        if (!reference.count(image.first)) report(image.first, "only written by the engine");
+    }
+    return differences;
+}
+
+/* Compare a fast engine with the reference pipeline on every image */
+bool verifyEngine(const std::string &engine, const std::string &path,
+                    const std::vector<std::string> &images,
+                    const std::vector<PipelineParams> &param_sets,
+                    const OutputOptions &output, const ExecutionOptions &exec) {
+
+    // The reference keeps the options that change the results, the engine all of them
+    ExecutionOptions reference, fast = exec;
+    reference.volumetric = exec.volumetric;
+    reference.reference = true;
+    bool known = false, gates = true;
+    for (auto &candidate : kEngines) {
+        if (engine != candidate.name) continue;
+        candidate.apply(&fast);
+        gates = candidate.gates;
+        known = true;
+    }
+    if (!known) {
+        std::cerr << "Unknown engine '" << engine << "', one of:";
+        for (auto &candidate : kEngines) std::cerr << " " << candidate.name;
+        std::cerr << std::endl;
+        return false;
+    }
+    if (fast.packed_masks && (fast.tile_size || (fast.backend == Backend::OPENCL))) {
+        std::cerr << "The " << engine << " engine cannot run packed masks with "
+                  << "--tile or --backend opencl." << std::endl;
+        return false;
+    }
+    if (fast.backend == Backend::OPENCL) {
+        if (!cv::ocl::haveOpenCL()) {
+            std::cerr << "No OpenCL device available for the opencl engine." << std::endl;
+            return false;
+        }
+        cv::ocl::setUseOpenCL(true);
+    }
+
+    // The images are compared in memory; the inputs are not re-encoded
+    OutputOptions verify_output = output;
+    verify_output.original = OriginalOutput::SKIP;
+    if (verify_output.level == OutputLevel::METRICS) verify_output.level = OutputLevel::ENHANCED;
+
+    const int num_stages = static_cast<int>(Stage::NUM_STAGES);
+    std::vector<unsigned long long> reference_us(num_stages + 1, 0), fast_us(num_stages + 1, 0);
+    unsigned long long total_differences = 0;
+    bool success = true;
+    for (auto &image_name : images) {
+        EngineRun expected, actual;
+        runEngine(path, image_name, param_sets, verify_output, reference, &expected);
+        runEngine(path, image_name, param_sets, verify_output, fast, &actual);
+        std::cout << "Verifying " << image_name << std::endl;
+        if (!expected.success || !actual.success) {
+            std::cout << "  " << (expected.success ? "the engine" : "the reference")
+                      << " could not process the stack" << std::endl;
+            success = false;
+            continue;
+        }
+        for (int stage = 0; stage < num_stages; stage++) {
+            reference_us[stage] += expected.stats->stage_us[stage];
+            fast_us[stage] += actual.stats->stage_us[stage];
+        }
+        reference_us[num_stages] += expected.stats->total_us;
+        fast_us[num_stages] += actual.stats->total_us;
+
+        unsigned long long differences = diffImages(expected.images, actual.images);
+        for (size_t set = 0; set < param_sets.size(); set++) {
+            std::ostringstream header, reference_rows, fast_rows;
+            std::string suffix = (param_sets.size() > 1) ? "_" + param_sets[set].name : "";
+            writeMetricsHeader(param_sets[set], &header);
+            for (auto &row : expected.metrics[set]) writeMetricsRow(row, &reference_rows);
+            for (auto &row : actual.metrics[set]) writeMetricsRow(row, &fast_rows);
+            differences += diffTable("computed_metrics" + suffix, header.str(),
+                                        reference_rows.str(), fast_rows.str());
+
+            if (output.cells) {
+                std::ostringstream cells_header, reference_cells, fast_cells;
+                writeCellsHeader(&cells_header);
+                for (auto &row : expected.metrics[set]) writeCellsRows(row, &reference_cells);
+                for (auto &row : actual.metrics[set]) writeCellsRows(row, &fast_cells);
+                differences += diffTable("cells" + suffix, cells_header.str(),
+                                            reference_cells.str(), fast_cells.str());
+            }
+            if (output.territories) {
+                std::ostringstream territories_header, reference_rois, fast_rois;
+                writeTerritoriesHeader(param_sets[set], &territories_header);
+                for (auto &row : expected.metrics[set]) {
+                    writeTerritoriesRows(row, &reference_rois);
+                }
+                for (auto &row : actual.metrics[set]) writeTerritoriesRows(row, &fast_rois);
+                differences += diffTable("territories" + suffix, territories_header.str(),
+                                            reference_rois.str(), fast_rois.str());
+            }
+        }
+        std::cout << "  " << (differences ? std::to_string(differences) + " differences" :
+                                            std::string("identical")) << std::endl;
+        total_differences += differences;
+    }
+
+    // Time of each stage, summed over the images
+    std::cout << std::endl << std::left << std::setw(12) << "stage" << std::right
+              << std::setw(16) << "reference_ms" << std::setw(16) << engine + "_ms"
+              << std::setw(10) << "speedup" << std::endl;
+    for (int stage = 0; stage <= num_stages; stage++) {
+        if (!reference_us[stage] && !fast_us[stage]) continue;
+        std::cout << std::left << std::setw(12)
+                  << ((stage < num_stages) ? stageName(static_cast<Stage>(stage)) : "total")
+                  << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(16) << reference_us[stage] / 1000.0
+                  << std::setw(16) << fast_us[stage] / 1000.0 << std::setw(10);
+        if (fast_us[stage]) {
+            std::cout << static_cast<double>(reference_us[stage]) / fast_us[stage];
+        } else {
+            std::cout << "-";
+        }
+        std::cout << std::endl;
+    }
+    std::cout << std::endl << engine << ": " << images.size() << " images, "
+              << total_differences << " differences";
+    if (!gates && total_differences) {
+        std::cout << " (expected: pixel areas instead of polygon areas)";
+    }
+    std::cout << std::endl;
+    return success && (!gates || !total_differences);
+}
@@ -0,0 +1,27 @@
+#ifndef VERIFY_HPP
+#define VERIFY_HPP
+
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+#include "image_writer.hpp"
+#include "pipeline.hpp"
+
+
+/* Compare a fast engine with the reference pipeline on every image (--verify)
+ *
+ * Each stack is processed twice: by the reference pipeline (OpenCV
+ * enhancement chain, contours, full-frame 8-bit CPU masks, one task) and
+ * with the engine applied on top of exec. The images are kept in memory
+ * instead of being written. Prints every computed_metrics.csv column, cells
+ * and territories row and image pixel that differs, then the time of each
+ * stage in both runs. False if a run fails, or if anything differs for the
+ * engines whose output must match the reference (all but components).
+ */
+bool verifyEngine(const std::string &engine, const std::string &path,
+                    const std::vector<std::string> &images,
+                    const std::vector<PipelineParams> &param_sets,
+                    const OutputOptions &output, const ExecutionOptions &exec);
+
+#endif // VERIFY_HPP
@@ -0,0 +1,130 @@
+#include <iostream>
+#include <algorithm>
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include "volume_labeler.hpp"
+
+
+/* Root of the object of a part, halving the path on the way */
+unsigned int VolumeLabeler::find(unsigned int part) {
+    while (parent_[part] != part) {
+        parent_[part] = parent_[parent_[part]];
+        part = parent_[part];
+    }
+    return part;
+}
+
+/* Join the objects of two parts; the lower part stays the root */
+void VolumeLabeler::unite(unsigned int a, unsigned int b) {
+    a = find(a);
+    b = find(b);
+    if (a < b) {
+        parent_[b] = a;
+    } else if (b < a) {
+        parent_[a] = b;
+    }
+}
+
+/* Label the mask of the next z-layer */
+bool VolumeLabeler::addLayer(const cv::Mat &mask, const cv::Mat *red, const cv::Mat *green) {
+
+    if (!prev_labels_.empty() && (mask.size() != prev_labels_.size())) {
+        std::cerr << "z-layer " << z_ << " does not match the size of the stack" << std::endl;
+        return false;
+    }
+
+    // Components of the layer, as parts offset + label - 1
+    cv::Mat labels, stats, centroids;
+    int num_labels = cv::connectedComponentsWithStats(mask, labels, stats, centroids, 8, CV_32S);
+    const unsigned int offset = parts_.size();
+    for (int label = 1; label < num_labels; label++) {
+        Part part;
+        part.volume = stats.at<int>(label, cv::CC_STAT_AREA);
+        part.sum_x = centroids.at<double>(label, 0) * part.volume;
+        part.sum_y = centroids.at<double>(label, 1) * part.volume;
+        part.bbox = cv::Rect(stats.at<int>(label, cv::CC_STAT_LEFT),
+                                stats.at<int>(label, cv::CC_STAT_TOP),
+                                stats.at<int>(label, cv::CC_STAT_WIDTH),
+                                stats.at<int>(label, cv::CC_STAT_HEIGHT));
+        part.z_first = part.z_last = z_;
+        part.red_voxels = part.green_voxels = 0;
+        parent_.push_back(parts_.size());
+        parts_.push_back(part);
+    }
+
+    // Count the overlaps and join the parts over the previous layer
+    for (int y = 0; y < labels.rows; y++) {
+        const int *label_row = labels.ptr<int>(y);
+        const int *prev_row = prev_labels_.empty() ? NULL : prev_labels_.ptr<int>(y);
+        const uchar *red_row = red ? red->ptr<uchar>(y) : NULL;
+        const uchar *green_row = green ? green->ptr<uchar>(y) : NULL;
+        int last_label = 0, last_prev = 0;
+        for (int x = 0; x < labels.cols; x++) {
+            const int label = label_row[x];
+            if (!label) continue;
+            Part &part = parts_[offset + label - 1];
+            if (red_row && red_row[x]) part.red_voxels++;
+            if (green_row && green_row[x]) part.green_voxels++;
+            if (!prev_row || !prev_row[x]) continue;
+
+            // Runs of a pair of labels only need one union
+            if ((label == last_label) && (prev_row[x] == last_prev)) continue;
+            last_label = label;
+            last_prev = prev_row[x];
+            unite(prev_offset_ + prev_row[x] - 1, offset + label - 1);
+        }
+    }
+    prev_labels_ = labels;
+    prev_offset_ = offset;
+    z_++;
+    return true;
+}
+
+/* One row per object, ordered by first voxel, and reset for the next stack */
+void VolumeLabeler::finish(double min_volume, RegionTable *objects) {
+
+    // Fold each part into its root; roots come before their parts
+    std::vector<int> row_of(parts_.size(), -1);
+    size_t rows = 0;
+    for (unsigned int i = 0; i < parts_.size(); i++) {
+        unsigned int root = find(i);
+        if (root == i) {
+            row_of[i] = rows++;
+            continue;
+        }
+        Part &object = parts_[root];
+        const Part &part = parts_[i];
+        object.volume += part.volume;
+        object.sum_x += part.sum_x;
+        object.sum_y += part.sum_y;
+        object.bbox |= part.bbox;
+        object.z_first = std::min(object.z_first, part.z_first);
+        object.z_last = std::max(object.z_last, part.z_last);
+        object.red_voxels += part.red_voxels;
+        object.green_voxels += part.green_voxels;
+    }
+
+    objects->resize(0);
+    objects->resize(rows);
+    for (unsigned int i = 0; i < parts_.size(); i++) {
+        if (row_of[i] == -1) continue;
+        const Part &object = parts_[i];
+        const size_t row = row_of[i];
+        objects->area[row] = object.volume;
+        objects->bbox[row] = object.bbox;
+        objects->centroid[row] = cv::Point2f(object.sum_x / object.volume,
+                                                object.sum_y / object.volume);
+        objects->z_first[row] = object.z_first;
+        objects->z_last[row] = object.z_last;
+        objects->valid[row] = (object.volume >= min_volume);
+        objects->red_overlap[row] = ((float)object.red_voxels) / object.volume;
+        objects->green_overlap[row] = ((float)object.green_voxels) / object.volume;
+    }
+
+    parts_.clear();
+    parent_.clear();
+    prev_labels_ = cv::Mat();
+    prev_offset_ = 0;
+    z_ = 0;
+}
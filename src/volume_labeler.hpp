@@ -0,0 +1,52 @@
+#ifndef VOLUME_LABELER_HPP
+#define VOLUME_LABELER_HPP
+
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+#include "region_table.hpp"
+
+
+/* 3D connected components of a binary channel, labelled one z-layer at a time
+ *
+ * Each layer is split into 8-connected 2D components; a component joins
+ * the objects it overlaps in the previous layer (6-connectivity along z)
+ * through a union-find over the components. Only the labels of the
+ * previous layer are kept as an image; the union-find holds one entry per
+ * 2D component of the stack, so it grows with the component count.
+ */
+class VolumeLabeler {
+public:
+    /* Label the mask of the next z-layer; the voxels of each object that
+     * are set in red and green are counted when those masks are given */
+    bool addLayer(const cv::Mat &mask, const cv::Mat *red = NULL, const cv::Mat *green = NULL);
+
+    /* One row per object, ordered by first voxel, and reset for the next stack
+     *
+     * area is the voxel volume and valid marks volume >= min_volume; the
+     * overlaps are the fractions of the voxels set in red and green.
+     */
+    void finish(double min_volume, RegionTable *objects);
+
+private:
+    /* 2D component of one layer, or the sum over an object once finished */
+    struct Part {
+        long long volume;
+        double sum_x, sum_y;
+        cv::Rect bbox;
+        int z_first, z_last;
+        long long red_voxels, green_voxels;
+    };
+
+    unsigned int find(unsigned int part);
+    void unite(unsigned int a, unsigned int b);
+
+    std::vector<Part> parts_;
+    std::vector<unsigned int> parent_;
+    cv::Mat prev_labels_;
+    unsigned int prev_offset_ = 0;
+    int z_ = 0;
+};
+
+#endif // VOLUME_LABELER_HPP